@@ -15,11 +15,14 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <string>
 #include <vector>
 #include <iostream>
 
@@ -30,6 +33,7 @@
 #include <sys/time.h>
 #include <unistd.h>
 
+#include "large-io.h"
 #include "siphash24.h"
 
 
@@ -74,6 +78,70 @@ namespace {
 
     static constexpr uint32_t SIG  = 0x972fae43u;
     static constexpr uint32_t SIGR = 0x43ae2f97u;
+
+    // parity layouts (stored in high byte of block_log2)
+    enum {
+        LAYOUT_XOR = 0,         // single parity stripe
+        LAYOUT_PRODUCT = 1,     // plus row parity over column groups
+        LAYOUT_LOCAL = 2        // plus local parity per group of stripes
+    };
+
+    struct geometry {
+        int layout;
+        int64_t image_blocks;
+        int64_t stripe_blocks;
+        int64_t first_blocks;
+        int64_t num_stripes;
+        int64_t param;          // column group width or stripes per group
+        int64_t num_groups;
+        int64_t num_slots;      // entries in marker hash list
+        int64_t parity_blocks;  // blocks between the two markers
+        int marker_blocks;
+    };
+
+    // part of image or parity protected by its own hash
+    struct region {
+        int64_t offset;         // blocks from start of image or parity
+        int64_t blocks;
+        int64_t slot;           // position in hash list (-1 for parity_hash)
+        int64_t column;         // image only: block of parity
+        int64_t extra;          // image only: block of row/local parity
+        int64_t stripe;
+    };
+
+    // parity being generated for one final size
+    struct target {
+        geometry geo;
+        std::string file;       // sidecar (empty: append to image)
+        std::vector<region> regions;
+        std::vector<uint64_t> marker;
+        std::vector<unsigned char> parity;
+        size_t next;            // current region
+        int64_t done;           // blocks of current region hashed
+        siphash_ctx ctx;
+    };
+
+    // stripes computed by one of several workers (see merge_partials)
+    struct work_slice {
+        int worker;             // 1-based, 0 for whole image
+        int workers;
+        uint64_t datetime;      // common creation time (0 for now)
+        const char* output;     // partial parity file
+    };
+
+    // first block of partial parity file
+    struct partial_header {
+        char magic[8];
+        uint32_t worker;
+        uint32_t workers;
+    };
+
+    // final sizes in bytes, with the text given on the command line
+    typedef std::vector<std::pair<int64_t,std::string>> target_sizes;
+}
+
+static int64_t div_up(int64_t a, int64_t b) {
+    return (a + b - 1) / b;
 }
 
 static unsigned ilog2(unsigned x) {
@@ -89,9 +157,11 @@ static void byteswap_in_place(T& x) {
         std::swap(p[i],p[sizeof(T)-1-i]);
 }
 
-static bool check_for_marker(marker_zero& m, ssize_t block_size, int fd) {
+static bool check_for_marker(marker_zero& m, ssize_t block_size, int fd,
+                             off64_t* where = nullptr) {
     for (int i = 1; ; ) {
-        if (lseek64(fd,-i*block_size,SEEK_END) < 0) {
+        const auto pos = lseek64(fd,-i*block_size,SEEK_END);
+        if (pos < 0) {
             std::cerr << "cdrparity: seek failed (" << strerror(errno) << ")"
                       << std::endl;
             return false;
@@ -108,11 +178,14 @@ static bool check_for_marker(marker_zero& m, ssize_t block_size, int fd) {
             assert(m.signature == SIG);
         }
         if (m.signature == SIG) {
-            if (block_size != (1<<m.block_log2))
+            if (block_size != (1<<(m.block_log2&0xff)))
                 break;
             const int j = 1 + m.index;
-            if (j == 1)
+            if (j == 1) {
+                if (where)
+                    *where = pos;
                 return true;
+            }
             else if (i < j) {
                 i = j;
                 continue;
@@ -123,50 +196,578 @@ static bool check_for_marker(marker_zero& m, ssize_t block_size, int fd) {
     return false;
 }
 
-static bool read_and_xor(siphash_ctx& ctx,
-                         void* _stripe, size_t stripe_blocks,
-                         void* _block, ssize_t block_bytes, 
-                         int fd) {
-    assert(block_bytes > 0 &&
-           size_t(block_bytes) >= sizeof(unsigned long) &&
-           ((block_bytes-1)&block_bytes) == 0);
-    auto buf = static_cast<unsigned long*>(_block);
-    auto stripe = static_cast<unsigned long*>(_stripe);
-    const auto long_per_block = block_bytes / sizeof(unsigned long);
-    for ( ; stripe_blocks > 0; --stripe_blocks) {
-        // read block
-        if (read(fd,buf,block_bytes) != block_bytes)
+// xor src into dest (and second parity if any)
+static void xor_into(void* _dest, void* _extra, const void* _src, size_t bytes) {
+    auto dest = static_cast<unsigned long*>(_dest);
+    auto extra = static_cast<unsigned long*>(_extra);
+    auto src = static_cast<const unsigned long*>(_src);
+    for (size_t j = 0; j < bytes / sizeof(unsigned long); ++j) {
+        dest[j] ^= src[j];
+        if (extra)
+            extra[j] ^= src[j];
+    }
+}
+
+// sizes that follow from stripe size and layout parameter
+static void layout_sizes(geometry& geo) {
+    const auto S = geo.num_stripes;
+    const auto sb = geo.stripe_blocks;
+    switch (geo.layout) {
+    default:
+        geo.num_groups = 0;
+        geo.num_slots = S;
+        geo.parity_blocks = sb;
+        break;
+    case LAYOUT_PRODUCT:
+        geo.num_groups = div_up(sb,geo.param);
+        geo.num_slots = 1 + S*geo.num_groups + geo.num_groups + S;
+        geo.parity_blocks = sb + S*geo.param;
+        break;
+    case LAYOUT_LOCAL:
+        geo.num_groups = div_up(S,geo.param);
+        geo.num_slots = 1 + S + geo.num_groups;
+        geo.parity_blocks = sb * (1 + geo.num_groups);
+        break;
+    }
+}
+
+static bool compute_geometry(geometry& geo,
+                             int64_t cdr_blocks, int64_t image_blocks,
+                             int block_bytes, int layout, int groups) {
+    // hashes per marker block
+    const int64_t m0_lim = block_bytes / sizeof(uint64_t) - 6;
+    const int64_t mi_lim = block_bytes / sizeof(uint64_t) - 2;
+
+    geo.layout = layout;
+    geo.image_blocks = image_blocks;
+    geo.marker_blocks = 1;
+    for (int64_t lim = m0_lim; ; lim += mi_lim, ++geo.marker_blocks) {
+        const int64_t avail = cdr_blocks - image_blocks - 2*geo.marker_blocks;
+        int64_t& sb = geo.stripe_blocks;
+        switch (layout) {
+        default:
+            sb = avail;
+            break;
+        case LAYOUT_PRODUCT:
+            // row parity costs about image_blocks/groups
+            sb = avail - div_up(image_blocks,groups);
+            break;
+        case LAYOUT_LOCAL:
+            sb = avail / (groups+1);
+            break;
+        }
+        for (;;) {
+            if (sb < 1) {
+                std::cerr << "cdrparity: final size is too small for image"
+                          << std::endl;
+                return false;
+            }
+            if (sb > image_blocks)
+                sb = image_blocks;
+            geo.num_stripes = div_up(image_blocks,sb);
+            if (layout == LAYOUT_XOR)
+                geo.param = 0;
+            else if (layout == LAYOUT_PRODUCT)
+                geo.param = div_up(sb,groups);
+            else
+                geo.param = div_up(geo.num_stripes,groups);
+            layout_sizes(geo);
+            if (geo.parity_blocks <= avail)
+                break;
+            sb -= geo.parity_blocks - avail;
+        }
+        if (geo.num_slots <= lim)
+            break;
+    }
+    // hash index is 16 bits: use fewer column groups until all hashes fit
+    if (geo.num_slots > 0xffff) {
+        const int64_t S = geo.num_stripes;
+        if (layout == LAYOUT_PRODUCT && groups > 1 && S < 0xffff/2) {
+            const int fit = std::min<int64_t>(groups - 1,
+                std::max<int64_t>(1, (0xffff - 1 - S) / (S + 1)));
+            std::cout << "note: fewer than " << groups
+                      << " column groups (too many hashes for marker)"
+                      << std::endl;
+            return compute_geometry(geo,cdr_blocks,image_blocks,block_bytes,
+                                    layout,fit);
+        }
+        std::cerr << "cdrparity: too many stripes for marker ("
+                  << geo.num_slots << " hashes, at most 65535)" << std::endl;
+        return false;
+    }
+    geo.first_blocks = image_blocks - geo.stripe_blocks*(geo.num_stripes-1);
+    return true;
+}
+
+// position of hash list entry in marker
+static uint64_t* hash_slot(std::vector<uint64_t>& marker,
+                           int64_t slot, int block_bytes) {
+    const int64_t per_block = block_bytes / sizeof(uint64_t);
+    const int64_t m0_lim = per_block - 6;
+    const int64_t mi_lim = per_block - 2;
+    if (slot < m0_lim)
+        return marker.data() + 5 + slot;
+    slot -= m0_lim;
+    return marker.data() + (1 + slot/mi_lim)*per_block + 1 + slot%mi_lim;
+}
+
+// geometry of existing parity data (from marker block 0)
+static bool geometry_from_marker(geometry& geo, std::vector<uint64_t>& marker,
+                                 int block_bytes) {
+    const int64_t m0_lim = block_bytes / sizeof(uint64_t) - 6;
+    const int64_t mi_lim = block_bytes / sizeof(uint64_t) - 2;
+    const auto& m0 = *reinterpret_cast<const marker_zero*>(marker.data());
+    geo.layout = m0.block_log2 >> 8;
+    geo.image_blocks = m0.image_blocks;
+    geo.stripe_blocks = m0.stripe_blocks;
+    geo.first_blocks = m0.first_blocks;
+    geo.num_stripes = m0.num_stripes;
+    if (geo.layout > LAYOUT_LOCAL || geo.num_stripes < 1 ||
+        geo.first_blocks < 1 || geo.first_blocks > geo.stripe_blocks ||
+        geo.image_blocks !=
+        geo.first_blocks + (geo.num_stripes-1)*geo.stripe_blocks)
+        return false;
+    geo.param = 0;
+    if (geo.layout != LAYOUT_XOR) {
+        const auto param = *hash_slot(marker,0,block_bytes);
+        const auto limit = geo.layout == LAYOUT_PRODUCT ?
+            geo.stripe_blocks : geo.num_stripes;
+        if (param < 1 || param > uint64_t(limit))
             return false;
-        siphash_update(&ctx, buf, block_bytes);
-        // xor with stripe
-        for (size_t j = 0; j < long_per_block; ++j, ++stripe)
-            *stripe ^= buf[j];
+        geo.param = param;
     }
+    layout_sizes(geo);
+    if (geo.num_slots > 0xffff)
+        return false;
+    geo.marker_blocks = 1;
+    if (geo.num_slots > m0_lim)
+        geo.marker_blocks += div_up(geo.num_slots - m0_lim, mi_lim);
     return true;
 }
 
-static ssize_t write_large(int fd, const void *buf, size_t count) {
-    ssize_t result = 0;
-    while (count > 1024*1024*1024) {
-        ssize_t r = write(fd, buf, 1024*1024*1024);
-        if (r < 0) return r;
-        result += r;
-        if (r != 1024*1024*1024) return result;
-        buf = ((const char*)buf) + 1024*1024*1024;
-        count -= 1024*1024*1024;
+// hashed parts of the image in disc order
+static std::vector<region> image_regions(const geometry& geo) {
+    std::vector<region> result;
+    const auto sb = geo.stripe_blocks;
+    const auto W = geo.param;   // column group width
+    const auto K = geo.param;   // stripes per local group
+    const auto G = geo.num_groups;
+    for (int64_t i = 0; i < geo.num_stripes; ++i) {
+        // first stripe may be short
+        const int64_t c0 = i == 0 ? sb - geo.first_blocks : 0;
+        const int64_t start = i == 0 ? 0 : geo.first_blocks + (i-1)*sb;
+        switch (geo.layout) {
+        case LAYOUT_XOR:
+            result.push_back({start, sb-c0, i, c0, -1, i});
+            break;
+        case LAYOUT_PRODUCT:
+            for (int64_t g = 0; g < G; ++g) {
+                const auto lo = std::max(g*W, c0);
+                const auto hi = std::max(lo, std::min((g+1)*W, sb));
+                result.push_back({start + lo - c0, hi - lo, 1 + i*G + g,
+                                  lo, sb + i*W + lo - g*W, i});
+            }
+            break;
+        case LAYOUT_LOCAL:
+            result.push_back({start, sb-c0, 1 + i, c0,
+                              sb + (i/K)*sb + c0, i});
+            break;
+        }
     }
-    ssize_t r = write(fd, buf, count);
-    if (r < 0) return r;
-    return result += r;
+    return result;
+}
+
+// hashed parts of the parity region
+static std::vector<region> parity_regions(const geometry& geo) {
+    std::vector<region> result;
+    const auto S = geo.num_stripes;
+    const auto sb = geo.stripe_blocks;
+    const auto W = geo.param;
+    const auto G = geo.num_groups;
+    if (geo.layout == LAYOUT_PRODUCT) {
+        for (int64_t g = 0; g < G; ++g)
+            result.push_back({g*W, std::min(W, sb - g*W), 1 + S*G + g,
+                              0, -1, 0});
+        for (int64_t i = 0; i < S; ++i)
+            result.push_back({sb + i*W, W, 1 + S*G + G + i, 0, -1, i});
+    }
+    else {
+        result.push_back({0, sb, -1, 0, -1, 0});
+        for (int64_t g = 0; g < G; ++g)
+            result.push_back({sb + g*sb, sb, 1 + S + g, 0, -1, g});
+    }
+    return result;
+}
+
+// where hash of region is stored in marker
+static uint64_t* hash_dest(std::vector<uint64_t>& marker,
+                           const region& r, int block_bytes) {
+    if (r.slot < 0)
+        return &reinterpret_cast<marker_zero*>(marker.data())->parity_hash;
+    return hash_slot(marker,r.slot,block_bytes);
+}
+
+// parity_hash: num_stripes, or 0 if hashes[0] is the layout parameter
+static int64_t hash_index(const geometry& geo, const region& r) {
+    if (r.slot >= 0)
+        return r.slot;
+    return geo.layout == LAYOUT_XOR ? geo.num_stripes : 0;
+}
+
+static void hash_region(uint64_t* dest, marker_zero& m0, int64_t index,
+                        const void* src, size_t n) {
+    siphash_ctx ctx;
+    m0.index = index;
+    siphash_init(&ctx,&m0);
+    siphash_update(&ctx,src,n);
+    siphash_final(&ctx,dest);
+}
+
+static void hash_marker(std::vector<uint64_t>& marker,
+                        int marker_blocks, int block_bytes) {
+    auto& m0 = *reinterpret_cast<marker_zero*>(marker.data());
+    m0.index = 0;
+    for (int i = 1; i < marker_blocks; ++i) {
+        auto& mi = *reinterpret_cast<marker_one*>(
+            marker.data() + i * block_bytes / sizeof(uint64_t));
+        mi.signature = m0.signature;
+        mi.block_log2 = m0.block_log2;
+        mi.index = i;
+    }
+    static const uint8_t zero_key[SIPHASH_KEY_LENGTH] = {0};
+    for (int i = 0; i < marker_blocks; ++i) {
+        auto begin = marker.data() + i * block_bytes / sizeof(uint64_t);
+        siphash_ctx ctx;
+        siphash_init(&ctx,zero_key);
+        siphash_update(&ctx,begin,block_bytes-sizeof(uint64_t));
+        auto end = begin + (block_bytes / sizeof(uint64_t) - 1);
+        siphash_final(&ctx,end);
+    }
+}
+
+static bool read_at(int fd, void* buf, off64_t offset, size_t count) {
+    if (lseek64(fd,offset,SEEK_SET) != offset ||
+        read_large(fd,buf,count) != ssize_t(count)) {
+        std::cerr << std::endl
+                  << "cdrparity: read failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool write_at(int fd, const void* buf, off64_t offset, size_t count) {
+    if (lseek64(fd,offset,SEEK_SET) != offset ||
+        write_large(fd,buf,count) != ssize_t(count)) {
+        std::cerr << "cdrparity: write failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static bool setup_target(target& t, int64_t cdr_bytes, int64_t image_blocks,
+                         int block_bytes, int layout, int groups) {
+    // guess disk size if unknown
+    int64_t cdr_blocks = cdr_bytes / block_bytes;
+    if (cdr_blocks == 0) {
+        // guess cdr_blocks
+        if (image_blocks <= 649*MB/block_bytes)
+            cdr_blocks = 650*MB/block_bytes;
+        else if (image_blocks <= 699*MB/block_bytes)
+            cdr_blocks = 700*MB/block_bytes;
+        else if (image_blocks <= int64_t(4481)*MB/block_bytes)
+            cdr_blocks = int64_t(4482)*MB/block_bytes;
+        else if (image_blocks <= int64_t(23599)*MB/block_bytes)
+            cdr_blocks = int64_t(23600)*MB/block_bytes;
+        else {
+            std::cerr << "cdrparity: large image, must specify final size"
+                      << std::endl;
+            return false;
+        }
+        std::cout << "note: final size is assumed to be "
+                  << (int64_t(cdr_blocks)*block_bytes/MB) << " MB ("
+                  << cdr_blocks << " blocks)" << std::endl;
+    }
+    else
+        std::cout << "note: final size is "
+                  << (int64_t(cdr_blocks)*block_bytes/MB) << " MB ("
+                  << cdr_blocks << " blocks)" << std::endl;
+
+    auto& geo = t.geo;
+    if (!compute_geometry(geo,cdr_blocks,image_blocks,block_bytes,
+                          layout,groups))
+        return false;
+    const auto first_offset = geo.stripe_blocks - geo.first_blocks;
+    if (geo.num_stripes > 1)
+        std::cout << "note: dividing image into " << geo.num_stripes
+                  << " stripes of " << geo.stripe_blocks
+                  << " blocks each" << std::endl
+                  << "\tfirst stripe has " << geo.first_blocks
+                  << " blocks (offset by " << first_offset << ")"
+                  << std::endl
+                  << "\tmarker has " << geo.marker_blocks << " blocks"
+                  << std::endl;
+    else
+        std::cout << "note: image is 1 stripe of "
+                  << geo.stripe_blocks << " blocks" << std::endl;
+    if (layout == LAYOUT_PRODUCT)
+        std::cout << "note: row parity over " << geo.num_groups
+                  << " column groups of " << geo.param << " blocks"
+                  << std::endl;
+    else if (layout == LAYOUT_LOCAL)
+        std::cout << "note: local parity for " << geo.num_groups
+                  << " groups of " << geo.param << " stripes"
+                  << std::endl;
+    return true;
+}
+
+static void start_target(target& t, uint64_t datetime, int block_bytes) {
+    const auto& geo = t.geo;
+    t.marker.assign(geo.marker_blocks * block_bytes / sizeof(uint64_t), 0);
+    auto& m0 = *reinterpret_cast<marker_zero*>(t.marker.data());
+    m0.signature = SIG;
+    m0.block_log2 = ilog2(block_bytes) | (geo.layout << 8);
+    m0.index = 0;
+    m0.datetime = datetime;
+    m0.num_stripes = geo.num_stripes;
+    m0.first_blocks = geo.first_blocks;
+    m0.stripe_blocks = geo.stripe_blocks;
+    m0.image_blocks = geo.image_blocks;
+
+    // other layouts store their parameter ahead of the hashes
+    if (geo.layout != LAYOUT_XOR)
+        *hash_slot(t.marker,0,block_bytes) = geo.param;
+
+    // parity (row or local parity follows the parity stripe)
+    t.parity.assign(geo.parity_blocks * block_bytes, 0);
+
+    // empty regions (product layout) are hashed up front
+    for (const auto& r : image_regions(geo))
+        if (r.blocks > 0)
+            t.regions.push_back(r);
+        else
+            hash_region(hash_dest(t.marker,r,block_bytes),m0,
+                        hash_index(geo,r),nullptr,0);
+    t.next = 0;
+    t.done = 0;
+}
+
+// hash and xor next blocks of image
+static void feed_target(target& t, const unsigned char* buf, int64_t blocks,
+                        int block_bytes) {
+    auto& m0 = *reinterpret_cast<marker_zero*>(t.marker.data());
+    while (blocks > 0) {
+        const auto& r = t.regions[t.next];
+        if (t.done == 0) {
+            m0.index = hash_index(t.geo,r);
+            siphash_init(&t.ctx,&m0);
+        }
+        const auto n = std::min(blocks,r.blocks - t.done);
+        const auto bytes = n * block_bytes;
+        siphash_update(&t.ctx,buf,bytes);
+        const auto k = r.column + t.done;
+        xor_into(t.parity.data() + k*block_bytes,
+                 r.extra < 0 ? nullptr
+                 : t.parity.data() + (k + r.extra - r.column)*block_bytes,
+                 buf,bytes);
+        t.done += n;
+        buf += bytes;
+        blocks -= n;
+        if (t.done == r.blocks) {
+            siphash_final(&t.ctx,hash_dest(t.marker,r,block_bytes));
+            ++t.next;
+            t.done = 0;
+        }
+    }
+}
+
+// hash parity and marker
+static void finish_target(target& t, int block_bytes) {
+    auto& m0 = *reinterpret_cast<marker_zero*>(t.marker.data());
+    assert(t.next == t.regions.size());
+    m0.parity_hash = 0;
+    for (const auto& r : parity_regions(t.geo))
+        hash_region(hash_dest(t.marker,r,block_bytes),m0,
+                    hash_index(t.geo,r),
+                    t.parity.data() + r.offset*block_bytes,
+                    r.blocks*block_bytes);
+    hash_marker(t.marker,t.geo.marker_blocks,block_bytes);
+}
+
+// append marker, parity and marker to image (or write to sidecar)
+static bool write_target(const target& t, int image_fd, off64_t image_bytes) {
+    int fd = image_fd;
+    if (!t.file.empty()) {
+        std::cout << "writing " << t.file << "..." << std::endl;
+        fd = open(t.file.c_str(),O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE,0666);
+        if (fd == -1) {
+            std::cerr << "cdrparity: open failed (" << strerror(errno) << ")"
+                      << std::endl;
+            return false;
+        }
+        image_bytes = 0;
+    }
+    const auto closer = auto_file_descriptor(fd == image_fd ? -1 : fd);
+    const auto marker_bytes = t.marker.size() * sizeof(uint64_t);
+    std::cout << "writing marker..." << std::endl;
+    if (!write_at(fd,t.marker.data(),image_bytes,marker_bytes))
+        return false;
+    std::cout << "writing parity data..." << std::endl;
+    if (!write_at(fd,t.parity.data(),image_bytes + marker_bytes,
+                  t.parity.size()))
+        return false;
+    std::cout << "writing marker..." << std::endl;
+    return write_at(fd,t.marker.data(),
+                    image_bytes + marker_bytes + t.parity.size(),
+                    marker_bytes);
+}
+
+static const char partial_magic[8] = "cdrpart";
+
+// partial parity: header block, marker with own hashes only, parity
+static bool write_partial(target& t, const work_slice& slice,
+                          int64_t s0, int64_t s1, int block_bytes) {
+    const auto& geo = t.geo;
+    std::vector<uint64_t> marker(t.marker.size(),0);
+    memcpy(marker.data(),t.marker.data(),offsetof(marker_zero,parity_hash));
+    reinterpret_cast<marker_zero*>(marker.data())->index = 0;
+    if (slice.worker == 1 && geo.layout != LAYOUT_XOR)
+        *hash_slot(marker,0,block_bytes) = geo.param;
+    for (const auto& r : image_regions(geo))
+        if (r.stripe >= s0 && r.stripe < s1)
+            *hash_dest(marker,r,block_bytes) =
+                *hash_dest(t.marker,r,block_bytes);
+
+    std::vector<unsigned char> header(block_bytes,0);
+    auto& h = *reinterpret_cast<partial_header*>(header.data());
+    memcpy(h.magic,partial_magic,sizeof(h.magic));
+    h.worker = slice.worker;
+    h.workers = slice.workers;
+
+    std::cout << "writing " << slice.output << "..." << std::endl;
+    const auto fd = auto_file_descriptor(
+        open(slice.output,O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE,0666));
+    if (fd == -1) {
+        std::cerr << "cdrparity: open failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return false;
+    }
+    const off64_t marker_bytes = marker.size() * sizeof(uint64_t);
+    return write_at(fd,header.data(),0,block_bytes) &&
+        write_at(fd,marker.data(),block_bytes,marker_bytes) &&
+        write_at(fd,t.parity.data(),block_bytes + marker_bytes,
+                 t.parity.size());
+}
+
+// xor partial parity of all workers and append to image
+static bool merge_partials(const char* isofile, char** partials, int n,
+                           int block_bytes) {
+    std::vector<std::unique_ptr<auto_file_descriptor>> fds(n);
+    for (int i = 0; i < n; ++i) {
+        auto fd = std::unique_ptr<auto_file_descriptor>(
+            new auto_file_descriptor(open(partials[i],O_RDONLY|O_LARGEFILE)));
+        if (*fd == -1) {
+            std::cerr << "cdrparity: open failed: " << partials[i]
+                      << " (" << strerror(errno) << ")" << std::endl;
+            return false;
+        }
+        partial_header h;
+        if (!read_at(*fd,&h,0,sizeof(h)))
+            return false;
+        if (memcmp(h.magic,partial_magic,sizeof(h.magic)) != 0 ||
+            int(h.workers) != n || h.worker < 1 || int(h.worker) > n) {
+            std::cerr << "cdrparity: not one of " << n
+                      << " partial parity files: " << partials[i]
+                      << std::endl;
+            return false;
+        }
+        if (fds[h.worker-1]) {
+            std::cerr << "cdrparity: worker " << h.worker
+                      << " given twice" << std::endl;
+            return false;
+        }
+        fds[h.worker-1] = std::move(fd);
+    }
+
+    // geometry from first worker
+    target t;
+    t.marker.resize(block_bytes / sizeof(uint64_t));
+    if (!read_at(*fds[0],t.marker.data(),block_bytes,block_bytes))
+        return false;
+    auto& geo = t.geo;
+    if (!geometry_from_marker(geo,t.marker,block_bytes)) {
+        std::cerr << "cdrparity: invalid partial parity" << std::endl;
+        return false;
+    }
+    const size_t marker_words =
+        geo.marker_blocks * block_bytes / sizeof(uint64_t);
+    const size_t header_words = offsetof(marker_zero,parity_hash)
+        / sizeof(uint64_t);
+    t.marker.assign(marker_words,0);
+    t.parity.assign(geo.parity_blocks * block_bytes,0);
+    std::vector<uint64_t> marker(marker_words);
+    std::vector<unsigned char> parity(t.parity.size());
+    for (int i = 0; i < n; ++i) {
+        std::cout << "reading partial parity " << (i+1) << " of " << n
+                  << "...   \r" << std::flush;
+        if (!read_at(*fds[i],marker.data(),block_bytes,
+                     marker_words * sizeof(uint64_t)) ||
+            !read_at(*fds[i],parity.data(),
+                     block_bytes + marker_words * sizeof(uint64_t),
+                     parity.size()))
+            return false;
+        if (i == 0)
+            std::copy(marker.begin(),marker.begin() + header_words,
+                      t.marker.begin());
+        else if (!std::equal(marker.begin(),marker.begin() + header_words,
+                             t.marker.begin())) {
+            std::cerr << std::endl << "cdrparity: partial parity of worker "
+                      << (i+1) << " is for a different image" << std::endl;
+            return false;
+        }
+        for (size_t j = header_words; j < marker_words; ++j)
+            t.marker[j] ^= marker[j];
+        xor_into(t.parity.data(),nullptr,parity.data(),parity.size());
+    }
+    std::cout << "partial parity merged.                 " << std::endl;
+
+    // append to image
+    const auto fd = auto_file_descriptor(open(isofile,O_RDWR|O_LARGEFILE));
+    if (fd == -1) {
+        std::cerr << "cdrparity: open failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return false;
+    }
+    struct stat64 s;
+    if (fstat64(fd,&s) != 0) {
+        std::cerr << "cdrparity: stat failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return false;
+    }
+    if (s.st_size != geo.image_blocks * block_bytes) {
+        std::cerr << "cdrparity: image does not match partial parity ("
+                  << geo.image_blocks << " blocks)" << std::endl;
+        return false;
+    }
+    t.next = 0;
+    finish_target(t,block_bytes);
+    if (!write_target(t,fd,s.st_size))
+        return false;
+    std::cout << "done." << std::endl;
+    return true;
 }
 
 static bool process_file(const char* isofile,
-                         int64_t cdr_bytes,
+                         const target_sizes& sizes,
                          int block_bytes,
-                         size_t,  //  buffer_bytes
+                         size_t buffer_bytes,
                          bool force,
                          bool strip,
-                         bool pad) {
+                         bool pad,
+                         int layout,
+                         int groups,
+                         const work_slice& slice) {
 
     // buffer for single block
     assert(block_bytes >= 64 && ((block_bytes-1)&block_bytes) == 0);
@@ -230,28 +831,6 @@ static bool process_file(const char* isofile,
     std::cout << "note: image file has " << image_blocks << " blocks"
               << std::endl;
     
-    // guess disk size if unknown
-    int cdr_blocks = cdr_bytes / block_bytes;
-    if (cdr_blocks == 0) {
-        // guess cdr_blocks
-        if (image_blocks <= 649*MB/block_bytes)
-            cdr_blocks = 650*MB/block_bytes;
-        else if (image_blocks <= 699*MB/block_bytes)
-            cdr_blocks = 700*MB/block_bytes;
-        else if (image_blocks <= int64_t(4481)*MB/block_bytes)
-            cdr_blocks = int64_t(4482)*MB/block_bytes;
-        else if (image_blocks <= int64_t(23599)*MB/block_bytes)
-            cdr_blocks = int64_t(23600)*MB/block_bytes;
-        else {
-            std::cerr << "cdrparity: large image, must specify final size"
-                      << std::endl;
-            return false;
-        }
-        std::cout << "note: final size is assumed to be "
-                  << (int64_t(cdr_blocks)*block_bytes/MB) << " MB ("
-                  << cdr_blocks << " blocks)" << std::endl;
-    }
-
     // check for existing parity
     marker_zero& old = *reinterpret_cast<marker_zero*>(block.get());
     if (check_for_marker(old,block_bytes,fd)) {
@@ -274,163 +853,372 @@ static bool process_file(const char* isofile,
         return false;
     }
 
-    // stripes per marker block
-    const auto m0_lim = block_bytes / sizeof(uint64_t) - 6;
-    const auto mi_lim = block_bytes / sizeof(uint64_t) - 2;
-    
-    // compute stripe and marker size
-    int stripe_blocks;
-    int num_stripes;
-    int marker_blocks = 1;
-    for (int lim = m0_lim; ; lim += mi_lim, ++marker_blocks) {
-        stripe_blocks = cdr_blocks - image_blocks - 2*marker_blocks;
-        if (stripe_blocks < 1) {
-            std::cerr << "cdrparity: final size is too small for image"
+    // compute stripe and marker size of each target
+    const bool sidecar = sizes.size() > 1;
+    std::vector<target> targets(sizes.size());
+    for (size_t t = 0; t < sizes.size(); ++t) {
+        if (!setup_target(targets[t],sizes[t].first,image_blocks,
+                          block_bytes,layout,groups))
+            return false;
+        if (sidecar)
+            targets[t].file = std::string(isofile) + ".parity-"
+                + sizes[t].second;
+    }
+
+    // same creation time for all targets
+    uint64_t datetime = slice.datetime;
+    if (!datetime) {
+        struct timeval tv;
+        if (gettimeofday(&tv, nullptr) != 0) {
+            std::cerr << std::endl
+                      << "cdrparity: gettimeofday (" << strerror(errno) << ")"
                       << std::endl;
             return false;
         }
-        if (stripe_blocks > image_blocks)
-            stripe_blocks = image_blocks;
-        num_stripes = (image_blocks+stripe_blocks-1) / stripe_blocks;
-        if (num_stripes <= lim)
-            break;
+        datetime = tv.tv_sec;
+        datetime = (datetime*(1000*1000) + tv.tv_usec)*1000;
     }
-    const ssize_t first_blocks = image_blocks - stripe_blocks*(num_stripes-1);
-    const ssize_t first_offset = stripe_blocks - first_blocks;
-        
-    if (num_stripes > 1)
-        std::cout << "note: dividing image into " << num_stripes
-                  << " stripes of " << stripe_blocks
-                  << " blocks each" << std::endl
-                  << "\tfirst stripe has " << first_blocks
-                  << " blocks (offset by " << first_offset << ")"
-                  << std::endl
-                  << "\tmarker has " << marker_blocks << " blocks"
-                  << std::endl;
-    else
-        std::cout << "note: image is 1 stripe of "
-                  << stripe_blocks << " blocks" << std::endl;
+    for (auto& t : targets)
+        start_target(t,datetime,block_bytes);
 
-    // marker
-    const ssize_t marker_bytes = marker_blocks * block_bytes;
-    std::vector<uint64_t> marker(marker_bytes / sizeof(uint64_t));
-    auto& m0 = *reinterpret_cast<marker_zero*>(marker.data());
-    m0.signature = SIG;
-    m0.block_log2 = ilog2(block_bytes);
-    m0.index = 0;
-    struct timeval tv;
-    if (gettimeofday(&tv, nullptr) != 0) {
-        std::cerr << std::endl
-                  << "cdrparity: gettimeofday (" << strerror(errno) << ")"
-                  << std::endl;
-        return false;
+    // a worker only reads its own stripes
+    int64_t first_block = 0, end_block = image_blocks;
+    int64_t s0 = 0, s1 = 0;
+    if (slice.worker) {
+        auto& t = targets[0];
+        const auto S = t.geo.num_stripes;
+        s0 = (slice.worker-1) * S / slice.workers;
+        s1 = slice.worker * S / slice.workers;
+        std::cout << "note: worker " << slice.worker << " of "
+                  << slice.workers << " computes stripes #" << (s0+1)
+                  << "-#" << s1 << std::endl;
+        std::vector<region> own;
+        for (const auto& r : t.regions)
+            if (r.stripe >= s0 && r.stripe < s1)
+                own.push_back(r);
+        t.regions.swap(own);
+        first_block = end_block = 0;
+        if (!t.regions.empty()) {
+            first_block = t.regions.front().offset;
+            end_block = t.regions.back().offset + t.regions.back().blocks;
+        }
     }
-    m0.datetime = tv.tv_sec;
-    m0.datetime = (m0.datetime*(1000*1000) + tv.tv_usec)*1000;
 
-    m0.num_stripes = num_stripes;
-    m0.first_blocks = first_blocks;
-    m0.stripe_blocks = stripe_blocks;
-    m0.image_blocks = image_blocks;
+    // read image once, hash and xor into every target
+    const int64_t chunk_blocks =
+        std::max<int64_t>(1,buffer_bytes / block_bytes);
+    std::vector<unsigned char> buf(chunk_blocks * block_bytes);
+    for (int64_t pos = first_block; pos < end_block; pos += chunk_blocks) {
+        std::cout << "reading block " << pos << " of " << image_blocks
+                  << "...   \r" << std::flush;
+        const auto n = std::min(chunk_blocks,end_block-pos);
+        if (!read_at(fd,buf.data(),pos*block_bytes,n*block_bytes))
+            return false;
+        for (auto& t : targets)
+            feed_target(t,buf.data(),n,block_bytes);
+    }
+    std::cout << "image successfully read and parity calculated"
+              << std::endl;
 
-    auto hash_dest = marker.begin() + sizeof(marker_zero) / sizeof(uint64_t);
-    auto hash_lim = m0_lim;
+    if (slice.worker) {
+        if (!write_partial(targets[0],slice,s0,s1,block_bytes))
+            return false;
+        std::cout << "done." << std::endl;
+        return true;
+    }
 
-    // parity
-    const auto stripe_bytes = ssize_t(stripe_blocks) * block_bytes;
-    std::vector<unsigned char> parity(stripe_bytes, 0);
+    for (auto& t : targets) {
+        finish_target(t,block_bytes);
+        if (!write_target(t,fd,image_blocks * block_bytes))
+            return false;
+    }
+  
+    std::cout << "done." << std::endl;
+    return true;
+}
 
-    // read first stripe (it may be short)
-    {
-        std::cout << "reading first stripe... \r" << std::flush;
-        siphash_ctx ctx;
-        siphash_init(&ctx,&m0);
-        ++m0.index;
-        if (!read_and_xor(ctx,
-                          parity.data()+first_offset*block_bytes,first_blocks,
-                          block.get(),block_bytes,fd)) {
-            std::cerr << std::endl
-                      << "cdrparity: read failed (" << strerror(errno) << ")"
+// sorted, non-overlapping ranges of blocks [first,end)
+typedef std::vector<std::pair<int64_t,int64_t>> block_ranges;
+
+static void merge_ranges(block_ranges& ranges) {
+    std::sort(ranges.begin(),ranges.end());
+    block_ranges merged;
+    for (const auto& r : ranges)
+        if (!merged.empty() && r.first <= merged.back().second)
+            merged.back().second = std::max(merged.back().second,r.second);
+        else
+            merged.push_back(r);
+    ranges.swap(merged);
+}
+
+// parse list of inclusive block ranges like "16-31,100"
+static bool parse_ranges(block_ranges& ranges, const char* s,
+                         int64_t image_blocks) {
+    while (*s) {
+        const char* start = s;
+        char* end;
+        const int64_t first = strtoll(s,&end,10);
+        int64_t last = first;
+        if (end != s && *end == '-') {
+            s = end + 1;
+            last = strtoll(s,&end,10);
+        }
+        if (end == s || (*end && *end != ',') ||
+            first < 0 || last < first || last >= image_blocks) {
+            std::cerr << "cdrparity: invalid block range: " << start
                       << std::endl;
             return false;
         }
-        siphash_final(&ctx,&*hash_dest++);
-        --hash_lim;
+        ranges.emplace_back(first,last+1);
+        s = *end ? end + 1 : end;
     }
+    merge_ranges(ranges);
+    return true;
+}
 
-    // read remaining stripes, hash and xor
-    for (int i = 1; i < num_stripes; ++i) {
-        std::cout << "reading stripe #" << (i+1) << "...   \r" << std::flush;
-        siphash_ctx ctx;
-        siphash_init(&ctx,&m0);
-        ++m0.index;
-        if (!read_and_xor(ctx,parity.data(),stripe_blocks,
-                          block.get(),block_bytes,fd)) {
-            std::cerr << std::endl
-                      << "cdrparity: read failed (" << strerror(errno) << ")"
-                      << std::endl;
+// compare old and new image to find changed blocks
+static bool find_changes(block_ranges& ranges, int fd, int nfd,
+                         int64_t image_blocks, int block_bytes,
+                         int64_t chunk_blocks) {
+    std::vector<unsigned char> a(chunk_blocks*block_bytes);
+    std::vector<unsigned char> b(chunk_blocks*block_bytes);
+    std::cout << "comparing images..." << std::endl;
+    for (int64_t pos = 0; pos < image_blocks; pos += chunk_blocks) {
+        const auto n = std::min(chunk_blocks,image_blocks-pos);
+        if (!read_at(fd,a.data(),pos*block_bytes,n*block_bytes) ||
+            !read_at(nfd,b.data(),pos*block_bytes,n*block_bytes))
             return false;
-        }
-        siphash_final(&ctx,&*hash_dest++);
-        if (--hash_lim == 0) {
-            hash_lim = mi_lim;
-            hash_dest += 2;
+        for (int64_t k = 0; k < n; ++k) {
+            if (memcmp(&a[k*block_bytes],&b[k*block_bytes],block_bytes) == 0)
+                continue;
+            if (!ranges.empty() && ranges.back().second == pos+k)
+                ++ranges.back().second;
+            else
+                ranges.emplace_back(pos+k,pos+k+1);
         }
     }
-    std::cout << "image successfully read and parity calculated"
-              << std::endl;
+    return true;
+}
 
-    // hash parity
-    {
-        siphash_ctx ctx;
-        siphash_init(&ctx,&m0);
-        siphash_update(&ctx,parity.data(),stripe_bytes);
-        siphash_final(&ctx,&m0.parity_hash);
+// xor difference of old and new data into parity (and second parity)
+static void xor_delta(void* _parity, void* _extra,
+                      const void* _old, const void* _new, size_t bytes) {
+    auto parity = static_cast<unsigned long*>(_parity);
+    auto extra = static_cast<unsigned long*>(_extra);
+    auto o = static_cast<const unsigned long*>(_old);
+    auto n = static_cast<const unsigned long*>(_new);
+    for (size_t j = 0; j < bytes / sizeof(unsigned long); ++j) {
+        const auto d = o[j] ^ n[j];
+        parity[j] ^= d;
+        if (extra)
+            extra[j] ^= d;
     }
+}
 
-    // hash marker
-    m0.index = 0;
-    for (int i = 1; i < marker_blocks; ++i) {
-        auto& mi = *reinterpret_cast<marker_one*>(
-            marker.data() + i * block_bytes / sizeof(uint64_t));
-        mi.signature = m0.signature;
-        mi.block_log2 = m0.block_log2;
-        mi.index = i;
-    }
-    static const uint8_t zero_key[SIPHASH_KEY_LENGTH] = {0};
-    for (int i = 0; i < marker_blocks; ++i) {
-        auto begin = marker.data() + i * block_bytes / sizeof(uint64_t);
-        siphash_ctx ctx;
-        siphash_init(&ctx,zero_key);
-        siphash_update(&ctx,begin,block_bytes-sizeof(uint64_t));
-        auto end = begin + (block_bytes / sizeof(uint64_t) - 1);
-        siphash_final(&ctx,end);
+// replace image in file with new_image, updating only affected parity
+static bool update_file(const char* isofile, const char* new_image,
+                        const char* range_list, int block_bytes,
+                        size_t buffer_bytes) {
+    const auto fd = auto_file_descriptor(open(isofile,O_RDWR|O_LARGEFILE));
+    if (fd == -1) {
+        std::cerr << "cdrparity: open failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return false;
     }
-    
-    // write marker
-    std::cout << "writing marker..." << std::endl;
-    if (write(fd,&m0,marker_bytes) != marker_bytes) {
-        std::cerr << "cdrparity: write failed (" << strerror(errno) << ")"
+    const auto nfd =
+        auto_file_descriptor(open(new_image,O_RDONLY|O_LARGEFILE));
+    if (nfd == -1) {
+        std::cerr << "cdrparity: open failed (" << strerror(errno) << ")"
                   << std::endl;
         return false;
     }
 
-    // write parity
-    std::cout << "writing parity data..." << std::endl;
-    if (write_large(fd,parity.data(),stripe_bytes) != stripe_bytes) {
-        std::cerr << "cdrparity: write failed (" << strerror(errno) << ")"
+    // find existing parity
+    std::vector<uint64_t> marker(block_bytes / sizeof(uint64_t));
+    off64_t marker_offset;
+    if (!check_for_marker(*reinterpret_cast<marker_zero*>(marker.data()),
+                          block_bytes,fd,&marker_offset)) {
+        std::cerr << "cdrparity: no parity data found in file" << std::endl;
+        return false;
+    }
+    if (!read_at(fd,marker.data(),marker_offset,block_bytes))
+        return false;
+    if (reinterpret_cast<marker_zero*>(marker.data())->signature != SIG) {
+        std::cerr << "cdrparity: cannot update parity of other byte order"
                   << std::endl;
         return false;
     }
-  
-    // write marker
-    std::cout << "writing marker..." << std::endl;
-    if (write(fd,&m0,marker_bytes) != marker_bytes) {
-        std::cerr << "cdrparity: write failed (" << strerror(errno) << ")"
+    geometry geo;
+    if (!geometry_from_marker(geo,marker,block_bytes)) {
+        std::cerr << "cdrparity: invalid marker" << std::endl;
+        return false;
+    }
+    const off64_t image_bytes = geo.image_blocks * block_bytes;
+    const off64_t parity_offset =
+        image_bytes + off64_t(geo.marker_blocks) * block_bytes;
+    const size_t marker_bytes = geo.marker_blocks * block_bytes;
+    if (marker_offset != parity_offset + geo.parity_blocks * block_bytes) {
+        std::cerr << "cdrparity: parity data does not match marker"
                   << std::endl;
         return false;
     }
-  
+    marker.resize(marker_bytes / sizeof(uint64_t));
+    if (!read_at(fd,marker.data(),marker_offset,marker_bytes))
+        return false;
+    auto check = marker;
+    hash_marker(check,geo.marker_blocks,block_bytes);
+    if (check != marker) {
+        std::cerr << "cdrparity: marker is corrupt (run cdrrepair first)"
+                  << std::endl;
+        return false;
+    }
+    auto& m0 = *reinterpret_cast<marker_zero*>(marker.data());
+    std::cout << "note: image has " << geo.image_blocks << " blocks in "
+              << geo.num_stripes << " stripes" << std::endl;
+
+    // new image must have same size
+    struct stat64 s;
+    if (fstat64(nfd,&s) != 0) {
+        std::cerr << "cdrparity: stat failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return false;
+    }
+    if (s.st_size != image_bytes) {
+        std::cerr << "cdrparity: new image must have the same size ("
+                  << geo.image_blocks << " blocks)" << std::endl;
+        return false;
+    }
+
+    // changed blocks
+    const int64_t chunk_blocks =
+        std::max<int64_t>(1,buffer_bytes / block_bytes);
+    block_ranges ranges;
+    if (range_list) {
+        if (!parse_ranges(ranges,range_list,geo.image_blocks))
+            return false;
+    }
+    else if (!find_changes(ranges,fd,nfd,geo.image_blocks,block_bytes,
+                           chunk_blocks))
+        return false;
+    if (ranges.empty()) {
+        std::cout << "note: images are identical" << std::endl;
+        return true;
+    }
+    int64_t changed_blocks = 0;
+    for (const auto& r : ranges)
+        changed_blocks += r.second - r.first;
+    std::cout << "note: " << changed_blocks << " blocks changed in "
+              << ranges.size() << " ranges" << std::endl;
+
+    // read and check parity
+    std::cout << "reading parity data..." << std::endl;
+    std::vector<unsigned char> parity(geo.parity_blocks * block_bytes);
+    if (!read_at(fd,parity.data(),parity_offset,parity.size()))
+        return false;
+    const auto pregions = parity_regions(geo);
+    for (const auto& r : pregions) {
+        uint64_t hash;
+        hash_region(&hash,m0,hash_index(geo,r),
+                    parity.data() + r.offset*block_bytes,
+                    r.blocks*block_bytes);
+        if (hash != *hash_dest(marker,r,block_bytes)) {
+            std::cerr << "cdrparity: parity data is corrupt"
+                      << " (run cdrrepair first)" << std::endl;
+            return false;
+        }
+    }
+
+    // xor old and new data of touched regions into parity
+    std::vector<unsigned char> old_buf(chunk_blocks * block_bytes);
+    std::vector<unsigned char> new_buf(chunk_blocks * block_bytes);
+    int64_t touched = 0, last_stripe = -1;
+    auto ri = ranges.cbegin();
+    for (const auto& r : image_regions(geo)) {
+        const auto end = r.offset + r.blocks;
+        while (ri != ranges.cend() && ri->second <= r.offset)
+            ++ri;
+        if (r.blocks == 0 || ri == ranges.cend() || ri->first >= end)
+            continue;
+        if (r.stripe != last_stripe) {
+            std::cout << "updating stripe #" << (r.stripe+1) << "...   \r"
+                      << std::flush;
+            last_stripe = r.stripe;
+            ++touched;
+        }
+        siphash_ctx old_ctx, new_ctx;
+        m0.index = hash_index(geo,r);
+        siphash_init(&old_ctx,&m0);
+        siphash_init(&new_ctx,&m0);
+        auto rj = ri;
+        for (int64_t pos = r.offset; pos < end; pos += chunk_blocks) {
+            const auto n = std::min(chunk_blocks,end-pos);
+            if (!read_at(fd,old_buf.data(),pos*block_bytes,n*block_bytes))
+                return false;
+            memcpy(new_buf.data(),old_buf.data(),n*block_bytes);
+            while (rj != ranges.cend() && rj->second <= pos)
+                ++rj;
+            for (auto rk = rj; rk != ranges.cend() && rk->first < pos+n; ++rk) {
+                const auto lo = std::max(rk->first,pos);
+                const auto hi = std::min(rk->second,pos+n);
+                if (!read_at(nfd,new_buf.data() + (lo-pos)*block_bytes,
+                             lo*block_bytes,(hi-lo)*block_bytes))
+                    return false;
+            }
+            siphash_update(&old_ctx,old_buf.data(),n*block_bytes);
+            siphash_update(&new_ctx,new_buf.data(),n*block_bytes);
+            const auto k = r.column + pos - r.offset;
+            xor_delta(parity.data() + k*block_bytes,
+                      r.extra < 0 ? nullptr
+                      : parity.data() + (k + r.extra - r.column)*block_bytes,
+                      old_buf.data(),new_buf.data(),n*block_bytes);
+        }
+        uint64_t old_hash;
+        siphash_final(&old_ctx,&old_hash);
+        const auto dest = hash_dest(marker,r,block_bytes);
+        if (old_hash != *dest) {
+            std::cerr << std::endl
+                      << "cdrparity: stripe #" << (r.stripe+1)
+                      << " is corrupt (run cdrrepair first)" << std::endl;
+            return false;
+        }
+        siphash_final(&new_ctx,dest);
+    }
+    std::cout << "note: updating " << touched << " of " << geo.num_stripes
+              << " stripes" << std::endl;
+
+    // rehash parity, remembering which parts changed
+    std::vector<const region*> changed;
+    for (const auto& r : pregions) {
+        const auto dest = hash_dest(marker,r,block_bytes);
+        const auto old_hash = *dest;
+        hash_region(dest,m0,hash_index(geo,r),
+                    parity.data() + r.offset*block_bytes,
+                    r.blocks*block_bytes);
+        if (*dest != old_hash)
+            changed.push_back(&r);
+    }
+    hash_marker(marker,geo.marker_blocks,block_bytes);
+
+    // nothing is written until all old hashes have been checked
+    std::cout << "writing changed blocks..." << std::endl;
+    for (const auto& r : ranges)
+        for (auto pos = r.first; pos < r.second; pos += chunk_blocks) {
+            const auto n = std::min(chunk_blocks,r.second-pos);
+            if (!read_at(nfd,new_buf.data(),pos*block_bytes,n*block_bytes) ||
+                !write_at(fd,new_buf.data(),pos*block_bytes,n*block_bytes))
+                return false;
+        }
+    std::cout << "writing parity data..." << std::endl;
+    for (const auto r : changed)
+        if (!write_at(fd,parity.data() + r->offset*block_bytes,
+                      parity_offset + r->offset*block_bytes,
+                      r->blocks*block_bytes))
+            return false;
+    std::cout << "writing marker..." << std::endl;
+    if (!write_at(fd,marker.data(),image_bytes,marker_bytes) ||
+        !write_at(fd,marker.data(),marker_offset,marker_bytes))
+        return false;
+
     std::cout << "done." << std::endl;
     return true;
 }
@@ -452,8 +1240,17 @@ static void usage(std::ostream& out) {
     out << "Usage:" << std::endl
         << "  cdrparity [OPTIONS] iso_image ..." << std::endl
         << "    -s size\tset final size (default: 650M, 700M, 4482M or 23600M)" << std::endl
+        << "    -s size,...\tone pass for several sizes (parity to file.parity-size)" << std::endl
         << "    -b size\tset block size (default: 2k)" << std::endl
         << "    -B size\tmemory use (default: 64M)" << std::endl
+        << "    -x n\tadd row parity over n column groups" << std::endl
+        << "    -g n\tadd local parity for n groups of stripes" << std::endl
+        << "    -u new\tupdate image and parity to match new image" << std::endl
+        << "    -r list\tchanged blocks for -u (e.g. 16-31,100)" << std::endl
+        << "    -w i/n\tworker i of n: partial parity of i-th slice of stripes" << std::endl
+        << "    -o file\twrite partial parity to file (with -w)" << std::endl
+        << "    -T ns\tcreation time (nanoseconds since epoch, same for all workers)" << std::endl
+        << "    -m  \tmerge partial parity: cdrparity -m iso_image partial ..." << std::endl
         << "    -p  \tpad to block size" << std::endl
         << "    -f  \tforce adding extra parity" << std::endl
         << "    -S  \tstrip existing parity before starting" << std::endl;
@@ -469,12 +1266,18 @@ int main(int argc, char*argv[]) {
         return -1;
     }
 
-    off64_t cdr_size = 0;
+    const char* cdr_sizes = "0";
     off_t block_size = 2048;
     off_t buffer_size = 64*MB;
     auto force = false;
     auto strip = false;
     auto pad = false;
+    auto layout = int(LAYOUT_XOR);
+    auto groups = 0;
+    const char* new_image = nullptr;
+    const char* range_list = nullptr;
+    work_slice slice = {0, 0, 0, nullptr};
+    auto merge = false;
   
     // parse options
     while (argc > 0 && argv[0][0] == '-') {
@@ -494,7 +1297,7 @@ int main(int argc, char*argv[]) {
                           << std::endl;
                 return -1;
             }
-            cdr_size = parse_size(argv[1]);
+            cdr_sizes = argv[1];
             --argc; ++argv;
             break;
 
@@ -516,8 +1319,87 @@ int main(int argc, char*argv[]) {
             }
             buffer_size = parse_size(argv[1]);
             --argc; ++argv;
-            std::cout << "note: custom buffer size ignored (not implemented)"
-                      << std::endl;
+            break;
+
+        case 'x':
+            if (argc < 2) {
+                std::cerr << "cdrparity: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            layout = LAYOUT_PRODUCT;
+            groups = atoi(argv[1]);
+            --argc; ++argv;
+            break;
+
+        case 'g':
+            if (argc < 2) {
+                std::cerr << "cdrparity: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            layout = LAYOUT_LOCAL;
+            groups = atoi(argv[1]);
+            --argc; ++argv;
+            break;
+
+        case 'u':
+            if (argc < 2) {
+                std::cerr << "cdrparity: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            new_image = argv[1];
+            --argc; ++argv;
+            break;
+
+        case 'r':
+            if (argc < 2) {
+                std::cerr << "cdrparity: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            range_list = argv[1];
+            --argc; ++argv;
+            break;
+
+        case 'w':
+            if (argc < 2) {
+                std::cerr << "cdrparity: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            if (sscanf(argv[1],"%d/%d",&slice.worker,&slice.workers) != 2 ||
+                slice.worker < 1 || slice.worker > slice.workers) {
+                std::cerr << "cdrparity: invalid worker: " << argv[1]
+                          << std::endl;
+                return -1;
+            }
+            --argc; ++argv;
+            break;
+
+        case 'o':
+            if (argc < 2) {
+                std::cerr << "cdrparity: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            slice.output = argv[1];
+            --argc; ++argv;
+            break;
+
+        case 'T':
+            if (argc < 2) {
+                std::cerr << "cdrparity: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            slice.datetime = strtoull(argv[1],nullptr,10);
+            --argc; ++argv;
+            break;
+
+        case 'm':
+            merge = true;
             break;
 
         case 'f':
@@ -565,24 +1447,92 @@ int main(int argc, char*argv[]) {
     }
     buffer_size = ((buffer_size+block_size-1)/block_size) * block_size;
 
-    // check cdr_size
-    if (cdr_size < 0) {
-        std::cerr << "cdrparity: final size must be positive: " << cdr_size
+    // check groups
+    if (layout != LAYOUT_XOR && groups < 1) {
+        std::cerr << "cdrparity: number of groups must be positive: "
+                  << groups << std::endl;
+        return -1;
+    }
+
+    // check final sizes (comma separated list)
+    target_sizes sizes;
+    for (const char* p = cdr_sizes; ; ) {
+        const char* comma = strchr(p,',');
+        const std::string text = comma ? std::string(p,comma) : p;
+        const auto cdr_size = parse_size(text.c_str());
+        if (cdr_size < 0) {
+            std::cerr << "cdrparity: final size must be positive: " << cdr_size
+                      << std::endl;
+            return -1;
+        }
+        if (cdr_size % block_size) {
+            std::cerr << "cdrparity: final size must be a multiple of block size: "
+                      << cdr_size << std::endl;
+            return -1;
+        }
+        sizes.emplace_back(cdr_size,text);
+        if (!comma)
+            break;
+        p = comma + 1;
+    }
+    if (sizes.size() > 1)
+        for (const auto& size : sizes)
+            if (size.first == 0) {
+                std::cerr << "cdrparity: each final size must be given"
+                          << std::endl;
+                return -1;
+            }
+  
+    // update existing parity
+    if (range_list && !new_image) {
+        std::cerr << "cdrparity: block ranges require new image (-u)"
                   << std::endl;
         return -1;
     }
-    if (cdr_size % block_size) {
-        std::cerr << "cdrparity: final size must be a multiple of block size: "
-                  << cdr_size << std::endl;
+    if (new_image) {
+        if (argc != 1) {
+            std::cerr << "cdrparity: update needs exactly one file"
+                      << std::endl;
+            return -1;
+        }
+        std::cout << std::endl
+                  << "updating file: " << argv[0] << std::endl;
+        return update_file(argv[0], new_image, range_list,
+                           block_size, buffer_size) ? 0 : 1;
+    }
+
+    // merge partial parity of workers
+    if (merge) {
+        if (argc < 2) {
+            std::cerr << "cdrparity: merge needs image and partial parity"
+                      << std::endl;
+            return -1;
+        }
+        std::cout << std::endl
+                  << "merging into file: " << argv[0] << std::endl;
+        return merge_partials(argv[0], argv+1, argc-1, block_size) ? 0 : 1;
+    }
+    if (slice.worker) {
+        if (!slice.output || !slice.datetime || argc != 1 ||
+            sizes.size() != 1) {
+            std::cerr << "cdrparity: worker needs one image, one final size,"
+                      << " output file (-o) and creation time (-T)"
+                      << std::endl;
+            return -1;
+        }
+    }
+    else if (slice.output) {
+        std::cerr << "cdrparity: output file only used by worker (-w)"
+                  << std::endl;
         return -1;
     }
-  
+
     while (argc >= 1) {
         std::cout << std::endl
                   << "processing file: " << argv[0] << std::endl;
         if (!process_file(argv[0],
-                          cdr_size, block_size, buffer_size,
-                          force, strip, pad))
+                          sizes, block_size, buffer_size,
+                          force, strip, pad, layout, groups, slice))
             return 1;
         --argc; ++argv;
     }
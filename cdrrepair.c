@@ -15,47 +15,24 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE         // copy_file_range()
+
 #include <assert.h>
-#include <byteswap.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <time.h>
 #include <unistd.h>
 
-#include "siphash24.h"
-
-
-/* Marker format (block zero):
- *   uint32_t signature;       // 0x972fae43
- *   uint16_t log2_blocksize;  // min 6
- *   uint16_t index;           // 0
- *   uint64_t date_time;
- *
- *   uint32_t num_stripes;
- *   uint32_t first_blocks;
- *   uint32_t stripe_blocks;
- *   uint32_t image_blocks;
- *
- *   uint64_t parity_hash;
- *   uint64_t stripe_hashes[];
- *   uint64_t checksum;    
- *
- * Block one and later (i):
- *   uint32_t signature;       // 0x972fae43
- *   uint16_t log2_blocksize;
- *   uint16_t index;           // i
- *
- *   uint64_t stripe_hashes[];
- *   uint64_t checksum;    
- */
+#include "large-io.h"
+#include "marker-v2.h"
+#include "volume.h"
 
-#define SIG  0x972fae43u
-#define SIGR 0x43ae2f97u
 
 // dest/src must be aligned on some machines
 static void memxor(void* dest, const void* src, size_t n) {
@@ -73,119 +50,114 @@ static void memxor(void* dest, const void* src, size_t n) {
     }
 }
 
-static ssize_t read_large(int fd, void *buf, size_t count) {
-    ssize_t result = 0;
-    while (count > 1024*1024*1024) {
-        ssize_t r = read(fd, buf, 1024*1024*1024);
-        if (r < 0) return r;
-        result += r;
-        if (r != 1024*1024*1024) return result;
-        buf = ((char*)buf) + 1024*1024*1024;
-        count -= 1024*1024*1024;
-    }
-    ssize_t r = read(fd, buf, count);
-    if (r < 0) return r;
-    return result += r;
+/* Items whose hash failed during the read pass are kept, in memory up
+ * to a budget and in a temporary file beyond that, so the correction is
+ * applied to the bytes that were read instead of reading them again.
+ */
+struct retained {
+    uint8_t** data;         // per item, NULL if not in memory
+    off_t* spill_ofs;       // per item, -1 if not in spill file
+    int spill_fd;
+    off_t spill_bytes;
+    uint64_t mem_bytes, budget;
+};
+
+static void retained_init(struct retained* rt, unsigned num_items,
+                          uint64_t budget) {
+    unsigned i;
+    rt->data = calloc(num_items, sizeof(uint8_t*));
+    rt->spill_ofs = malloc(num_items * sizeof(off_t));
+    for (i = 0; i < num_items; ++i)
+        rt->spill_ofs[i] = -1;
+    rt->spill_fd = -1;
+    rt->spill_bytes = 0;
+    rt->mem_bytes = 0;
+    rt->budget = budget;
 }
 
-static ssize_t write_large(int fd, const void *buf, size_t count) {
-    ssize_t result = 0;
-    while (count > 1024*1024*1024) {
-        ssize_t r = write(fd, buf, 1024*1024*1024);
-        if (r < 0) return r;
-        result += r;
-        if (r != 1024*1024*1024) return result;
-        buf = ((const char*)buf) + 1024*1024*1024;
-        count -= 1024*1024*1024;
-    }
-    ssize_t r = write(fd, buf, count);
-    if (r < 0) return r;
-    return result += r;
+static void retained_free(struct retained* rt, unsigned num_items) {
+    unsigned i;
+    for (i = 0; i < num_items; ++i)
+        free(rt->data[i]);
+    free(rt->data);
+    free(rt->spill_ofs);
+    if (rt->spill_fd != -1)
+        close(rt->spill_fd);
 }
 
-static int verify_stripe_hash(const void* stripe, size_t stripe_bytes,
-                              void* marker, unsigned index,
-                              const void* expected_hash) {
-    const int need_bswap = *(uint32_t*)marker == SIGR;
-    ((uint16_t*)marker)[3] = need_bswap ? bswap_16(index) : index;
-    uint8_t hash[SIPHASH_DIGEST_LENGTH];
-    siphash(hash, stripe, stripe_bytes, marker);
-    return memcmp(hash, expected_hash, SIPHASH_DIGEST_LENGTH) == 0;
+// keep copy of item i, returns 0 if it could not be kept
+static int retain(struct retained* rt, unsigned i, const uint8_t* src,
+                  uint64_t bytes) {
+    if (rt->mem_bytes + bytes <= rt->budget &&
+        (rt->data[i] = malloc(bytes)) != NULL) {
+        memcpy(rt->data[i], src, bytes);
+        rt->mem_bytes += bytes;
+        return 1;
+    }
+    if (rt->spill_fd == -1) {
+        FILE* f = tmpfile();
+        if (!f)
+            return 0;
+        rt->spill_fd = dup(fileno(f));
+        fclose(f);
+    }
+    if (pwrite(rt->spill_fd, src, bytes, rt->spill_bytes) != (ssize_t)bytes)
+        return 0;
+    rt->spill_ofs[i] = rt->spill_bytes;
+    rt->spill_bytes += bytes;
+    return 1;
 }
 
-static int verify_marker_block_hash(const void* src, size_t block_bytes) {
-    static const uint8_t zero_key[SIPHASH_KEY_LENGTH] = {0};
-    uint8_t hash[SIPHASH_DIGEST_LENGTH];
-    siphash(hash, src, block_bytes - 8, zero_key);
-    const void* expected_hash = ((char*)src) + block_bytes - 8;
-    return memcmp(hash, expected_hash, SIPHASH_DIGEST_LENGTH) == 0;
-}
-    
-// -1 if not found, offset otherwise
-static ssize_t find_marker_v2(const void* src, size_t len) {
-    size_t i = len & ~(size_t)63;
-    const uint32_t* p = src;
-    p += i / 4;
-    while (i > 0) {
-        i -= 64;
-        p -= 16;
-        if (*p == SIG && ((const uint16_t*)p)[3] == 0) {
-            const int block_log2 = ((const uint16_t*)p)[2];
-            if (block_log2 < 30) {
-                const size_t block_bytes = 1 << block_log2;
-                if (i + block_bytes <= len &&
-                    verify_marker_block_hash(p, block_bytes))
-                    return i;
-            }
-        }
-        else if (*p == SIGR && ((const uint16_t*)p)[3] == 0) {
-            const int block_log2 = bswap_16(((const uint16_t*)p)[2]);
-            if (block_log2 < 30) {
-                const size_t block_bytes = 1 << block_log2;
-                if (i + block_bytes <= len &&
-                    verify_marker_block_hash(p, block_bytes))
-                    return i;
-            }
-        }
+// copy of item i into buf, 0 if not kept
+static int retained_copy(const struct retained* rt, unsigned i,
+                         uint8_t* buf, uint64_t bytes) {
+    if (rt->data[i]) {
+        memcpy(buf, rt->data[i], bytes);
+        return 1;
     }
-    return -1;
+    return rt->spill_ofs[i] >= 0 &&
+        pread(rt->spill_fd, buf, bytes, rt->spill_ofs[i]) == (ssize_t)bytes;
 }
 
-static int repair_stripe(int fd, off_t ofs, uint8_t* buf,
-                         const uint8_t* diff, int64_t stripe_bytes,
-                         void* marker, unsigned index,
-                         const void* expected_hash) {
+static int repair_item(int in, int out, const struct v2_marker* m,
+                       const void* marker,
+                       const struct v2_item* item, uint8_t* buf,
+                       const uint8_t* diff, const struct retained* rt) {
+    const off_t ofs = item->offset * m->block_bytes;
+    const int64_t item_bytes = item->blocks * m->block_bytes;
 
-    if (lseek(fd,ofs,SEEK_SET) != ofs) {
-        fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
-        return 0;
-    }
+    if (!retained_copy(rt, item - m->items, buf, item_bytes)) {
+        if (lseek(in,ofs,SEEK_SET) != ofs) {
+            fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
+            return 0;
+        }
 
-    printf("re-reading corrupt stripe #%d...", index+1);
-    fflush(stdout);
-    memset(buf, 0, stripe_bytes);
-    if (read_large(fd,buf,stripe_bytes) < 0) {
-        printf(" failed!\n");
-        fprintf(stderr,"cdrrepair: read() failed (%s)\n",strerror(errno));
-        return 0;
+        printf("re-reading corrupt %s...", item_name(m,item));
+        fflush(stdout);
+        memset(buf, 0, item_bytes);
+        if (read_large(in,buf,item_bytes) < 0) {
+            printf(" failed!\n");
+            fprintf(stderr,"cdrrepair: read() failed (%s)\n",strerror(errno));
+            return 0;
+        }
+        printf(" done.\n");
     }
-    printf(" done.\n");
 
     printf("applying correction...");
-    memxor(buf, diff, stripe_bytes);
-    if (!verify_stripe_hash(buf, stripe_bytes, marker, index, expected_hash)) {
+    memxor(buf, diff, item_bytes);
+    if (!verify_item_hash(m, marker, item, buf)) {
         printf(" repair failed!\n");
         return 0;
     }
     printf(" success.\n");
 
-    if (lseek(fd,ofs,SEEK_SET) != ofs) {
+    if (lseek(out,ofs,SEEK_SET) != ofs) {
         fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
         return 0;
     }
 
-    printf("writing stripe #%d...", index+1);
-    if (write_large(fd,buf,stripe_bytes) != stripe_bytes) {
+    printf("writing %s...", item_name(m,item));
+    if (write_large(out,buf,item_bytes) != item_bytes) {
         printf(" failed!\n");
         fprintf(stderr,"cdrrepair: write() failed (%s)\n",strerror(errno));
         return 0;
@@ -195,92 +167,334 @@ static int repair_stripe(int fd, off_t ofs, uint8_t* buf,
     return 1;
 }
 
-// returns 0 if successful
-static int repair_v2(int fd, void* _marker) {
-    uint16_t* m16 = (uint16_t*)_marker;
-    uint32_t* m32 = (uint32_t*)_marker;
-    uint64_t* m64 = (uint64_t*)_marker;
+/* Read blocks first..first+blocks of an item one by one after a failed
+ * chunk.  Blocks that cannot be read are zero and marked in *erased
+ * (allocated for all item_blocks on first error).
+ * returns number of unreadable blocks
+ */
+static uint64_t read_blocks(int fd, uint8_t* buf, off_t ofs, uint64_t first,
+                            uint64_t blocks, uint64_t item_blocks,
+                            uint64_t block_bytes, uint8_t** erased) {
+    uint64_t b, count = 0;
+    for (b = first; b < first + blocks; ++b) {
+        uint8_t* dest = buf + b*block_bytes;
+        if (pread(fd,dest,block_bytes,ofs + b*block_bytes) == (ssize_t)block_bytes)
+            continue;
+        memset(dest,0,block_bytes);
+        if (!*erased)
+            *erased = calloc(item_blocks,1);
+        (*erased)[b] = 1;
+        ++count;
+    }
+    return count;
+}
 
-    const int need_bswap = m32[0] == SIGR;
-    if (need_bswap)
-        printf("marker needs to be byte-swapped\n");
+static int is_zero(const uint8_t* p, size_t n) {
+    while (n > 0 && *p == 0) {
+        ++p;
+        --n;
+    }
+    return n == 0;
+}
 
-    const int block_log2 = need_bswap ? bswap_16(m16[2]) : m16[2];
-    const uint64_t block_bytes = 1 << block_log2;
+#define MAX_COPIES 8        // cdrrepair -c
+#define CHUNK (1024*1024)   // read size
 
-    if (block_bytes < 64 || (block_bytes & (block_bytes-1))) {
-        printf("INVALID BLOCK SIZE (%ld)\n",block_bytes);
-        return 1;
+// in group being repaired (group < 0 for all)
+static int in_group(const struct v2_item* item, int group) {
+    return group < 0 ||
+        ((item->kind == ITEM_STRIPE || item->kind == ITEM_LOCAL) &&
+         item->col == (unsigned)group);
+}
+
+/* Reads one item from one copy of the disc.  With several copies, each
+ * copy is read in its own thread so that separate drives read in
+ * parallel.
+ */
+struct reader {
+    int fd;
+    off_t pos;              // file position, -1 if unknown
+    uint8_t* buf;
+    const struct v2_marker* m;
+    const struct v2_item* item;
+    uint8_t* erased;        // unreadable blocks, NULL if none
+    uint64_t unreadable;
+    int failed;
+    uint8_t hash[SIPHASH_DIGEST_LENGTH];
+    pthread_t thread;
+};
+
+static void* read_item(void* arg) {
+    struct reader* rd = arg;
+    const struct v2_marker* m = rd->m;
+    const struct v2_item* item = rd->item;
+    const uint64_t block_bytes = m->block_bytes;
+    const off_t ofs = item->offset * block_bytes;
+    const int64_t item_bytes = item->blocks * block_bytes;
+    rd->erased = NULL;
+    rd->unreadable = 0;
+    if (ofs != rd->pos && lseek(rd->fd,ofs,SEEK_SET) != ofs) {
+        fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
+        rd->failed = 1;
+        return NULL;
+    }
+    memset(rd->buf, 0, item_bytes);
+    rd->pos = ofs;
+
+    // large chunks, only a chunk that fails is read block by block
+    const uint64_t chunk_blocks = block_bytes < CHUNK ? CHUNK / block_bytes : 1;
+    uint64_t b, n = 0;
+    int error = 0;
+    for (b = 0; b < item->blocks; b += chunk_blocks) {
+        const uint64_t blocks = item->blocks - b < chunk_blocks ?
+            item->blocks - b : chunk_blocks;
+        const ssize_t bytes = blocks * block_bytes;
+        const ssize_t r = read_large(rd->fd,rd->buf + b*block_bytes,bytes);
+        if (r == bytes) {
+            rd->pos += bytes;
+            continue;
+        }
+        error |= r < 0;
+        n += read_blocks(rd->fd,rd->buf,ofs,b,blocks,item->blocks,
+                         block_bytes,&rd->erased);
+        rd->pos += bytes;
+        if (lseek(rd->fd,rd->pos,SEEK_SET) != rd->pos) {
+            fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
+            rd->pos = -1;
+            rd->failed = 1;
+            free(rd->erased);
+            rd->erased = NULL;
+            return NULL;
+        }
+    }
+    if (n > 0 && (item->offset < m->image_blocks || error))
+        rd->unreadable = n;
+    else {
+        // end of a truncated parity region reads as zero
+        free(rd->erased);
+        rd->erased = NULL;
     }
+    item_hash(m,item,rd->buf,rd->hash);
+    return NULL;
+}
 
-    const uint64_t date_time = need_bswap ? bswap_64(m64[1]) : m64[1];
-    const time_t dt = date_time / (1000*1000*1000);
-    printf("created:     %s", ctime(&dt));
+// whole marker at marker #1 or #2 of a copy, 0 if neither is valid
+static int read_whole_marker(int fd, const struct v2_marker* m,
+                             uint8_t* dest) {
+    const uint64_t block_bytes = m->block_bytes;
+    const int64_t marker_bytes = m->marker_blocks * block_bytes;
+    const off_t ofs[2] = {
+        m->image_blocks*block_bytes,
+        (m->image_blocks+m->marker_blocks+m->parity_blocks)*block_bytes
+    };
+    int k;
+    for (k = 0; k < 2; ++k)
+        if (pread(fd,dest,marker_bytes,ofs[k]) == marker_bytes &&
+            verify_marker_hash(dest,block_bytes,m->marker_blocks))
+            return 1;
+    return 0;
+}
 
-    printf("block size:  %ld bytes\n", block_bytes);
-    
-    const unsigned num_stripes   = need_bswap ? bswap_32(m32[4]) : m32[4];
-    const unsigned first_blocks  = need_bswap ? bswap_32(m32[5]) : m32[5];
-    const unsigned stripe_blocks = need_bswap ? bswap_32(m32[6]) : m32[6];
-    const unsigned image_blocks  = need_bswap ? bswap_32(m32[7]) : m32[7];
-
-    const uint64_t image_bytes = image_blocks * block_bytes;
-    const int64_t first_bytes  = first_blocks * block_bytes;
-    const int64_t stripe_bytes = stripe_blocks * block_bytes;
-    const int64_t offset_bytes = stripe_bytes - first_bytes;
-    
-    printf("num stripes: %d\n", num_stripes);
-    printf("stripe size: %d blocks (%ld kiB)\n",
-           stripe_blocks, stripe_bytes/1024);
-    printf("image size:  %d blocks (%ld kiB)\n",
-           image_blocks, image_bytes/1024);
-
-    if (first_blocks > stripe_blocks) {
-        printf("INVALID FIRST STRIPE (%d)\n",first_blocks);
+// copy of bytes read to dest, when streaming from a device
+static int stream_out(int out, const void* buf, size_t bytes, off_t ofs) {
+    if (out < 0 || pwrite(out,buf,bytes,ofs) == (ssize_t)bytes)
         return 1;
-    }
-    if (stripe_blocks > image_blocks) {
-        printf("INVALID STRIPE SIZE (%d)\n",stripe_blocks);
-        return 1;
-    }
-    if (image_blocks != first_blocks + stripe_blocks*(num_stripes-1)) {
-        printf("INVALID NUMBER OF STRIPES (%d)\n",num_stripes);
+    fprintf(stderr,"cdrrepair: write() failed (%s)\n",strerror(errno));
+    return 0;
+}
+
+/* Corrections and marker blocks are written to out (fd itself for an
+ * in-place repair).  If stream is set, out starts empty and everything
+ * read is also copied to it.  Items that are corrupt on fd are taken from
+ * the first of the other copies where they are good; parity is used only
+ * for items bad on every copy.
+ * returns 0 if successful
+ */
+static int repair_v2(int fd, int out, int stream, void* _marker, size_t avail,
+                     int group, uint64_t budget,
+                     const int* copy_fd, unsigned num_copies) {
+    struct v2_marker m;
+    if (*(uint32_t*)_marker == SIGR)
+        printf("marker needs to be byte-swapped\n");
+    if (parse_marker_v2(stdout,&m,_marker) != 0)
         return 1;
-    }
+    print_marker_v2(stdout,&m);
 
-    // stripe hashes per marker block
-    const unsigned m0_lim = block_bytes / sizeof(uint64_t) - 6;
-    const unsigned mi_lim = block_bytes / sizeof(uint64_t) - 2;
+    unsigned i;
+    if (group >= 0) {
+        if (m.layout != LAYOUT_LOCAL) {
+            fprintf(stderr,"cdrrepair: image does not have local groups\n");
+            return 1;
+        }
+        if ((unsigned)group >= m.num_groups) {
+            fprintf(stderr,"cdrrepair: no such group (%d)\n",group+1);
+            return 1;
+        }
+        // only the local equation of the group is available
+        for (i = 0; i < m.num_items; ++i)
+            m.items[i].eq[1] = -1;
+        printf("repairing local group #%d only\n",group+1);
+    }
 
-    unsigned marker_blocks = 0;
-    while (num_stripes > m0_lim + marker_blocks * mi_lim)
-        ++marker_blocks;
-    ++marker_blocks;
-    printf("marker size: %d blocks\n", marker_blocks);
-    const int64_t marker_bytes  = marker_blocks * block_bytes;
+    const uint64_t block_bytes = m.block_bytes;
+    const int64_t marker_bytes = m.marker_blocks * block_bytes;
     uint8_t* marker = malloc(marker_bytes);
 
-    unsigned hash_lim = m0_lim;
-    const uint64_t* stripe_hash = ((uint64_t*)marker) + 5;
-
-    uint8_t* stripe =
-        malloc(stripe_bytes > marker_bytes ? stripe_bytes : marker_bytes);
-
-    // read markers
-    printf("reading markers...");
-    const off_t marker1_offset = image_blocks*block_bytes;
-    if (lseek(fd,marker1_offset,SEEK_SET) != marker1_offset) {
-        printf(" failed!\n");
-        fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
-        return 1;
+    uint64_t buf_blocks = m.marker_blocks;
+    for (i = 0; i < m.num_items; ++i)
+        if (m.items[i].blocks > buf_blocks)
+            buf_blocks = m.items[i].blocks;
+    uint8_t* stripe = malloc(buf_blocks * block_bytes);
+
+    // equation offsets
+    uint64_t* eq_start = malloc(m.num_eqs * sizeof(uint64_t));
+    uint64_t syndrome_bytes = 0;
+    for (i = 0; i < m.num_eqs; ++i) {
+        eq_start[i] = syndrome_bytes;
+        syndrome_bytes += m.eq_blocks[i] * block_bytes;
+    }
+    uint8_t* syndrome = calloc(syndrome_bytes, 1);
+    uint8_t (*hash)[SIPHASH_DIGEST_LENGTH] =
+        malloc(m.num_items * SIPHASH_DIGEST_LENGTH);
+    int* bad = calloc(m.num_items, sizeof(int));
+    unsigned bad_count = 0;
+
+    // with the whole marker from the scan, bad items are known while reading
+    const int early = (int64_t)avail >= marker_bytes &&
+        verify_marker_hash(_marker, block_bytes, m.marker_blocks);
+    struct retained rt;
+    retained_init(&rt, m.num_items, budget);
+    uint8_t** erased = calloc(m.num_items, sizeof(uint8_t*));
+    uint64_t erased_count = 0;
+
+    // other copies need a valid marker before reading, and must agree
+    uint8_t* ref = NULL;
+    if (num_copies > 0) {
+        ref = malloc(marker_bytes);
+        uint8_t* other = malloc(marker_bytes);
+        if (early)
+            memcpy(ref, _marker, marker_bytes);
+        else if (!read_whole_marker(fd, &m, ref)) {
+            for (i = 0; i < num_copies; ++i)
+                if (read_whole_marker(copy_fd[i], &m, ref))
+                    break;
+            if (i == num_copies) {
+                fprintf(stderr,"cdrrepair: no valid marker on any copy\n");
+                return 1;
+            }
+        }
+        for (i = 0; i < num_copies; ++i) {
+            if (!read_whole_marker(copy_fd[i], &m, other) ||
+                memcmp(ref, other, marker_bytes) != 0) {
+                fprintf(stderr,"cdrrepair: marker of copy #%u does not agree\n",
+                        i+2);
+                return 1;
+            }
+        }
+        free(other);
+        printf("merging %u copies\n", num_copies+1);
     }
-    if (read(fd,marker,marker_bytes) != marker_bytes) {
-        printf(" failed!\n");
-        fprintf(stderr,"cdrrepair: read() failed (%s)\n",strerror(errno));
-        return 1;
+    struct reader* rd = calloc(num_copies+1, sizeof(struct reader));
+    for (i = 0; i <= num_copies; ++i) {
+        rd[i].fd = i ? copy_fd[i-1] : fd;
+        rd[i].pos = -1;
+        rd[i].buf = i ? malloc(buf_blocks * block_bytes) : stripe;
+        rd[i].m = &m;
     }
+    unsigned taken = 0;
+
+    // read stripes, marker #1, parity and marker #2 in disc order,
+    // hashes are checked once the markers are known
+    const off_t marker1_offset = m.image_blocks*block_bytes;
     const off_t marker2_offset =
-        (image_blocks+marker_blocks+stripe_blocks)*block_bytes;
+        (m.image_blocks+m.marker_blocks+m.parity_blocks)*block_bytes;
+    int marker1_read = 0;
+    for (i = 0; i <= m.num_items; ++i) {
+        const struct v2_item* item = &m.items[i];
+        if (!marker1_read &&
+            (i == m.num_items || item->offset >= m.image_blocks)) {
+            // unreadable is the same as corrupt, fixed from another copy
+            printf("reading marker #1...");
+            rd[0].pos = -1;
+            if (pread(fd,marker,marker_bytes,marker1_offset) != marker_bytes) {
+                printf(" UNREADABLE!\n");
+                memset(marker,0,marker_bytes);
+            }
+            else
+                printf(" done.\n");
+            if (!stream_out(stream ? out : -1,marker,marker_bytes,marker1_offset))
+                return 1;
+            marker1_read = 1;
+        }
+        if (i == m.num_items)
+            break;
+        const off_t ofs = item->offset * block_bytes;
+        const int64_t item_bytes = item->blocks * block_bytes;
+        if (!in_group(item,group))
+            continue;
+        if (i == 0 || item->kind != item[-1].kind || item->num != item[-1].num) {
+            printf("reading %s...    \r",region_name(&m,item));
+            fflush(stdout);
+        }
+        unsigned k;
+        for (k = 0; k <= num_copies; ++k)
+            rd[k].item = item;
+        for (k = 1; k <= num_copies; ++k)
+            pthread_create(&rd[k].thread,NULL,read_item,&rd[k]);
+        read_item(&rd[0]);
+        for (k = 1; k <= num_copies; ++k)
+            pthread_join(rd[k].thread,NULL);
+        for (k = 0; k <= num_copies; ++k)
+            if (rd[k].failed)
+                return 1;
+
+        // first copy with a good hash, else this copy
+        struct reader* use = &rd[0];
+        if (ref && (rd[0].erased ||
+                    !item_hash_matches(&m,ref,item,rd[0].hash))) {
+            for (k = 1; k <= num_copies; ++k)
+                if (!rd[k].erased && item_hash_matches(&m,ref,item,rd[k].hash))
+                    break;
+            if (k <= num_copies) {
+                printf("%s taken from copy #%u    \n",item_name(&m,item),k+1);
+                use = &rd[k];
+                if (!stream && !stream_out(out,use->buf,item_bytes,ofs))
+                    return 1;
+                ++taken;
+            }
+        }
+        for (k = 0; k <= num_copies; ++k)
+            if (&rd[k] != use)
+                free(rd[k].erased);
+        erased[i] = use->erased;
+        if (use->unreadable) {
+            printf("%s: %lu unreadable blocks    \n",
+                   item_name(&m,item),(unsigned long)use->unreadable);
+            erased_count += use->unreadable;
+        }
+        memcpy(hash[i], use->hash, SIPHASH_DIGEST_LENGTH);
+
+        if (!stream_out(stream ? out : -1,use->buf,item_bytes,ofs))
+            return 1;
+        if (((early && !item_hash_matches(&m,_marker,item,hash[i])) ||
+             erased[i]) && !retain(&rt,i,use->buf,item_bytes))
+            printf("note: %s not kept, will be read again\n",
+                   item_name(&m,item));
+        int j;
+        for (j = 0; j < 2; ++j)
+            if (item->eq[j] >= 0)
+                memxor(syndrome + eq_start[item->eq[j]]
+                       + item->eq_offset*block_bytes,
+                       use->buf, item_bytes);
+    }
+    for (i = 1; i <= num_copies; ++i)
+        free(rd[i].buf);
+    free(rd);
+    if (taken > 0)
+        printf("%u regions taken from other copies\n",taken);
+    printf("reading done.                          \n");
+
+    printf("reading marker #2...");
     memset(stripe, 0, marker_bytes);
     if (lseek(fd,marker2_offset,SEEK_SET) != marker2_offset)
         printf(" missing!\n");
@@ -288,10 +502,13 @@ static int repair_v2(int fd, void* _marker) {
         printf(" truncated!\n");
     else
         printf(" done.\n");
+    if (!stream_out(stream ? out : -1,stripe,marker_bytes,marker2_offset))
+        return 1;
 
-    unsigned i;
-    int* marker_good = malloc(marker_blocks * sizeof(int));
-    for (i = 0; i < marker_blocks; ++i) {
+    // whole valid marker from another copy or the scan, if any
+    const uint8_t* spare = ref ? ref : early ? (uint8_t*)_marker : NULL;
+    int* marker_good = malloc(m.marker_blocks * sizeof(int));
+    for (i = 0; i < m.marker_blocks; ++i) {
         ssize_t ofs = i*block_bytes;
         marker_good[i] =
             verify_marker_block_hash(marker+ofs, block_bytes);
@@ -300,8 +517,14 @@ static int repair_v2(int fd, void* _marker) {
 
         switch (marker_good[i]) {
         case 0:
-            fprintf(stderr,"marker block %d CORRUPT! repair failed!\n", i);
-            return 1;
+            if (!spare) {
+                fprintf(stderr,"marker block %d CORRUPT! repair failed!\n", i);
+                return 1;
+            }
+            printf("marker block %d CORRUPT, taken from %s\n", i,
+                   ref ? "other copy" : "marker found by scan");
+            memcpy(marker+ofs, spare+ofs, block_bytes);
+            break;
             
         case 1:
             printf("marker #2 block %d CORRUPT!\n", i);
@@ -319,171 +542,157 @@ static int repair_v2(int fd, void* _marker) {
             }
         }
     }
-    if (memcmp(m16, marker, block_bytes) != 0) {
+    if (memcmp(_marker, marker, block_bytes) != 0) {
         fprintf(stderr,"marker block 0 mismatch! repair failed!\n");
         return 1;
     }
 
-    uint8_t* parity = malloc(stripe_bytes);
-
-    const off_t parity_offset = (image_blocks+marker_blocks)*block_bytes;
-    if (lseek(fd,parity_offset,SEEK_SET) != parity_offset) {
-        fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-
-    // read parity
-    printf("reading parity...");
-    fflush(stdout);
-    memset(parity, 0, stripe_bytes);
-    if (read_large(fd,parity,stripe_bytes) < 0) {
-        printf(" failed!\n");
-        fprintf(stderr,"cdrrepair: read() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-    const int parity_good =
-        verify_stripe_hash(parity,stripe_bytes,m16,num_stripes,m64+4);
-    if (parity_good)
-        printf(" done.\n");
-    else
-        printf(" CORRUPT!\n");
-
-    int* stripe_good = malloc(num_stripes * sizeof(int));
-    int bad_count = !parity_good;
-
-    if (lseek(fd,0,SEEK_SET) != 0) {
-        fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-
-    // read stripes
-    printf("reading first stripe... \r");
-    if (read_large(fd,stripe,first_bytes) != first_bytes) {
-        fprintf(stderr,"cdrrepair: read() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-    stripe_good[0] =
-        verify_stripe_hash(stripe,first_bytes,m16,0,stripe_hash++);
-    --hash_lim;
-    if (!stripe_good[0]) {
-        printf("stripe #1 CORRUPT!       \n");
-        ++bad_count;
-    }
-    memxor(parity+offset_bytes,stripe,first_bytes);
-
-    for (i = 1; i < num_stripes; ++i) {
-        printf("reading stripe #%d...    \r",i+1);
-        fflush(stdout);
-        if (read_large(fd,stripe,stripe_bytes) != stripe_bytes) {
-            fprintf(stderr,"cdrrepair: read() failed (%s)\n",strerror(errno));
-            return 1;
-        }
-        stripe_good[i] =
-            verify_stripe_hash(stripe,stripe_bytes,m16,i,stripe_hash++);
-        if (--hash_lim == 0) {
-            hash_lim = mi_lim;
-            stripe_hash += 2;
-        }
-        if (!stripe_good[i]) {
-            printf("stripe #%d CORRUPT!   \n",i+1);
+    // compare hashes, items with unreadable blocks are corrupt
+    if (erased_count > 0)
+        printf("%lu unreadable blocks\n",(unsigned long)erased_count);
+    for (i = 0; i < m.num_items; ++i) {
+        const struct v2_item* item = &m.items[i];
+        if (in_group(item,group) &&
+            (erased[i] || !item_hash_matches(&m,marker,item,hash[i]))) {
+            printf("%s CORRUPT!   \n",item_name(&m,item));
+            bad[i] = 1;
             ++bad_count;
         }
-        memxor(parity,stripe,stripe_bytes);
     }
-    printf("reading stripes done.       \n");
+    free(hash);
 
-    int changes_made = 0;
+    int changes_made = taken > 0;
     
-    if (bad_count == 0) {
-        // parity should be all zero
-        ssize_t j;
-        for (j = 0; j < stripe_bytes; ++j)
-            if (parity[j]) {
-                fprintf(stderr,"cannot determine location of error! repair failed!");
-                return 1;
-            }
-    }
-
-    else if (bad_count == 1) {
-        // parity must not be all zero
-        ssize_t j;
-        for (j = 0; j < stripe_bytes; ++j)
-            if (parity[j]) break;
-        if (j >= stripe_bytes) {
-            fprintf(stderr,"cannot determine location of error! repair failed!");
-            return 1;
-        }
-
-        if (!parity_good) {
-            if (!repair_stripe(fd, parity_offset,
-                               stripe, parity, stripe_bytes,
-                               m16, num_stripes, m64+4))
-                return 1;
-        }
-
-        else if (!stripe_good[0]) {
-            if (j < offset_bytes) {
-                fprintf(stderr,"cannot determine location of error! repair failed!");
-                return 1;
+    /* Recover corrupt blocks one equation column at a time: a block is
+     * unknown if it could not be read, or if it belongs to a corrupt item
+     * without unreadable blocks (the error could be anywhere in it).  A
+     * column of an equation with a single unknown block gives that block.
+     */
+    uint8_t** diff = calloc(m.num_items, sizeof(uint8_t*));
+    uint8_t** unknown = calloc(m.num_items, sizeof(uint8_t*));
+    unsigned* bad_items = malloc((bad_count+1) * sizeof(unsigned));
+    unsigned nb = 0;
+    for (i = 0; i < m.num_items; ++i) {
+        if (!bad[i])
+            continue;
+        const struct v2_item* item = &m.items[i];
+        bad_items[nb++] = i;
+        diff[i] = calloc(item->blocks, block_bytes);
+        unknown[i] = malloc(item->blocks);
+        uint64_t b;
+        for (b = 0; b < item->blocks; ++b)
+            unknown[i][b] = erased[i] ? erased[i][b] : 1;
+    }
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        unsigned k, l;
+        for (k = 0; k < nb; ++k) {
+            const unsigned ii = bad_items[k];
+            const struct v2_item* item = &m.items[ii];
+            uint64_t b;
+            for (b = 0; b < item->blocks; ++b) {
+                if (!unknown[ii][b])
+                    continue;
+                const uint64_t col = item->eq_offset + b;
+                int j, e = -1;
+                for (j = 0; j < 2 && e < 0; ++j) {
+                    if (item->eq[j] < 0)
+                        continue;
+                    // other unknowns in this column of the equation
+                    for (l = 0; l < nb; ++l) {
+                        const struct v2_item* other = &m.items[bad_items[l]];
+                        if (l == k || (other->eq[0] != item->eq[j] &&
+                                       other->eq[1] != item->eq[j]) ||
+                            col < other->eq_offset ||
+                            col >= other->eq_offset + other->blocks)
+                            continue;
+                        if (unknown[bad_items[l]][col - other->eq_offset])
+                            break;
+                    }
+                    if (l == nb)
+                        e = item->eq[j];
+                }
+                if (e < 0)
+                    continue;
+                uint8_t* d = diff[ii] + b*block_bytes;
+                memcpy(d, syndrome + eq_start[e] + col*block_bytes, block_bytes);
+                for (j = 0; j < 2; ++j)
+                    if (item->eq[j] >= 0)
+                        memxor(syndrome + eq_start[item->eq[j]] + col*block_bytes,
+                               d, block_bytes);
+                unknown[ii][b] = 0;
+                progress = 1;
             }
-            if (!repair_stripe(fd, 0, stripe,
-                               parity+offset_bytes, first_bytes,
-                               m16, 0, m64+5))
-                return 1;
         }
+    }
 
-        else {
-            for (i = 1; i < num_stripes; ++i)
-                if (!stripe_good[i]) {
-                    stripe_hash = ((uint64_t*)marker) + 5 + i;
-                    for (hash_lim = m0_lim; i >= hash_lim; hash_lim += mi_lim)
-                        stripe_hash += 2;
-                    if (!repair_stripe(fd, first_bytes + (i-1)*stripe_bytes,
-                                       stripe, parity, stripe_bytes,
-                                       m16, i, stripe_hash))
-                        return 1;
-                    else
-                        break;
+    // blocks still unknown cannot be recovered
+    size_t num_lost = 0, max_lost = 16;
+    off_t* lost = malloc(2 * max_lost * sizeof(off_t));
+    for (i = 0; i < nb; ++i) {
+        const struct v2_item* item = &m.items[bad_items[i]];
+        uint64_t b;
+        for (b = 0; b < item->blocks; ++b) {
+            if (!unknown[bad_items[i]][b])
+                continue;
+            const off_t ofs = (item->offset + b) * block_bytes;
+            if (num_lost > 0 && lost[2*num_lost-1] == ofs)
+                lost[2*num_lost-1] += block_bytes;
+            else {
+                if (num_lost == max_lost) {
+                    max_lost *= 2;
+                    lost = realloc(lost, 2 * max_lost * sizeof(off_t));
                 }
-            if (i >= num_stripes) {
-                fprintf(stderr,"UNKNOWN FAILURE!\n");
-                return 1;
+                lost[2*num_lost] = ofs;
+                lost[2*num_lost+1] = ofs + block_bytes;
+                ++num_lost;
             }
         }
-        changes_made = 1;
     }
-
-    else {
+    if (num_lost > 0) {
         fprintf(stderr,"too many errors! repair failed!\n");
+        print_damaged_files(stdout,fd,lost,num_lost);
         return 1;
     }
-
-    // fix marker
-    for (i = 0; i < marker_blocks; ++i) {
-        if (marker_good[i] != 3) {
-            off_t ofs;
-            switch (marker_good[i]) {
-            case 1:
-                printf("writing marker #2 block %d...", i);
-                ofs = marker2_offset;
-                break;
-            case 2:
-                printf("writing marker #1 block %d...", i);
-                ofs = marker1_offset;
-                break;
-            default:
-                fprintf(stderr,"UNKNOWN FAILURE!\n");
-                return 1;
-            }
-            ofs += i * block_bytes;
-
-            if (lseek(fd,ofs,SEEK_SET) != ofs) {
+    free(lost);
+    if (!is_zero(syndrome, syndrome_bytes)) {
+        fprintf(stderr,"cannot determine location of error! repair failed!\n");
+        return 1;
+    }
+    for (i = 0; i < nb; ++i) {
+        if (!repair_item(fd, out, &m, marker, &m.items[bad_items[i]], stripe,
+                         diff[bad_items[i]], &rt))
+            return 1;
+        changes_made = 1;
+    }
+    for (i = 0; i < m.num_items; ++i) {
+        free(diff[i]);
+        free(unknown[i]);
+        free(erased[i]);
+    }
+    free(diff);
+    free(unknown);
+    free(erased);
+    free(bad_items);
+
+    // fix marker, blocks bad in both copies come from another disc
+    for (i = 0; i < m.marker_blocks; ++i) {
+        int c;
+        for (c = 0; c < 2; ++c) {
+            if (marker_good[i] & (1 << c))
+                continue;
+            printf("writing marker #%d block %d...", c+1, i);
+            const off_t ofs = (c ? marker2_offset : marker1_offset)
+                + i * block_bytes;
+
+            if (lseek(out,ofs,SEEK_SET) != ofs) {
                 printf(" failed!\n");
                 fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
                 return 1;
             }
             
-            if (write(fd,marker+i*block_bytes,block_bytes) != (ssize_t)block_bytes) {
+            if (write(out,marker+i*block_bytes,block_bytes) != (ssize_t)block_bytes) {
                 printf(" failed!\n");
                 fprintf(stderr,"cdrrepair: write() failed (%s)\n",strerror(errno));
                 return 1;
@@ -496,26 +705,121 @@ static int repair_v2(int fd, void* _marker) {
     if (!changes_made)
         fprintf(stdout,"no changes made.\n");
     
-    free(parity);
+    retained_free(&rt, m.num_items);
+    free(syndrome);
+    free(eq_start);
+    free(bad);
     free(stripe);
-    free(stripe_good);
     free(marker);
     free(marker_good);
+    free(ref);
+    free_marker_v2(&m);
         
     return 0;
 }
 
+/* Copy a regular file with copy_file_range(), which shares the blocks
+ * (reflink) where the filesystem supports it.  Falls back to read/write.
+ * returns 0 if successful
+ */
+static int copy_file(int in, int out, off_t bytes) {
+    off_t done = 0;
+    while (done < bytes) {
+        loff_t in_ofs = done, out_ofs = done;
+        const ssize_t r = copy_file_range(in,&in_ofs,out,&out_ofs,
+                                          bytes - done,0);
+        if (r <= 0)
+            break;
+        done += r;
+    }
+    if (done < bytes) {
+        static const size_t buf_size = 1024*1024;
+        uint8_t* buf = malloc(buf_size);
+        while (done < bytes) {
+            const size_t n = bytes - done < (off_t)buf_size ?
+                (size_t)(bytes - done) : buf_size;
+            const ssize_t r = pread(in,buf,n,done);
+            if (r <= 0) {
+                fprintf(stderr,"cdrrepair: read() failed (%s)\n",
+                        r < 0 ? strerror(errno) : "end of file");
+                free(buf);
+                return 1;
+            }
+            if (pwrite(out,buf,r,done) != r) {
+                fprintf(stderr,"cdrrepair: write() failed (%s)\n",strerror(errno));
+                free(buf);
+                return 1;
+            }
+            done += r;
+        }
+        free(buf);
+    }
+    return 0;
+}
 
 
 int main(int argc, char*argv[]) {
 
-    if (argc <= 1) {
-        printf("Usage:\n  cdrrepair file\n");
+    int group = -1;
+    uint64_t budget = 256*1024*1024;
+    int copy_fd[MAX_COPIES];
+    unsigned num_copies = 0;
+    while (argc > 2 && argv[1][0] == '-') {
+        if (strcmp(argv[1],"-g") == 0 && argc > 3) {
+            group = atoi(argv[2]) - 1;
+            if (group < 0) {
+                fprintf(stderr,"cdrrepair: invalid group: %s\n",argv[2]);
+                return 1;
+            }
+            argc -= 2; argv += 2;
+        }
+        else if (strcmp(argv[1],"-M") == 0 && argc > 3) {
+            char* end;
+            errno = 0;
+            budget = strtoull(argv[2],&end,10);
+            int shift = 0;
+            if (*end == 'k' || *end == 'K')
+                shift = 10;
+            else if (*end == 'm' || *end == 'M')
+                shift = 20;
+            else if (*end == 'g' || *end == 'G')
+                shift = 30;
+            if (!isdigit((unsigned char)argv[2][0]) || errno != 0 ||
+                end[shift ? 1 : 0] != '\0' || (budget >> (63 - shift)) != 0) {
+                fprintf(stderr,"cdrrepair: invalid memory size: %s\n",argv[2]);
+                return 1;
+            }
+            budget <<= shift;
+            argc -= 2; argv += 2;
+        }
+        else if (strcmp(argv[1],"-c") == 0 && argc > 3) {
+            if (num_copies == MAX_COPIES) {
+                fprintf(stderr,"cdrrepair: too many copies\n");
+                return 1;
+            }
+            if ((copy_fd[num_copies++] = open(argv[2],O_RDONLY)) == -1) {
+                fprintf(stderr,"cdrrepair: failed to open file %s\n",argv[2]);
+                return 1;
+            }
+            argc -= 2; argv += 2;
+        }
+        else {
+            fprintf(stderr,"cdrrepair: invalid argument: %s\n",argv[1]);
+            return 1;
+        }
+    }
+
+    if (argc <= 1 || argc > 3) {
+        printf("Usage:\n  cdrrepair [-g group] [-M size] [-c copy]... file [dest]\n"
+               "    -g group\trepair one local group only\n"
+               "    -M size\tmemory for corrupt stripes (default: 256M)\n"
+               "    -c copy\tanother copy of the disc, read in parallel\n"
+               "    dest\twrite repaired copy to dest, file is not changed\n");
         return 1;
     }
 
     // open cdrom device
-    const int fd = open(argv[1],O_RDWR);
+    const int fd = open(argv[1],argc > 2 ? O_RDONLY : O_RDWR);
     if (fd == -1) {
         fprintf(stderr,"cdrrepair: failed to open file %s\n",argv[1]);
         return 1;
@@ -528,23 +832,50 @@ int main(int argc, char*argv[]) {
         return 1;
     }
 
+    struct stat src;
+    if (fstat(fd,&src) != 0) {
+        fprintf(stderr,"cdrrepair: stat() failed (%s)\n",strerror(errno));
+        return 1;
+    }
+    const int stream = argc > 2 && !S_ISREG(src.st_mode);
+    if (stream && group >= 0) {
+        fprintf(stderr,"cdrrepair: -g with dest needs a regular file\n");
+        return 1;
+    }
+
     static const ssize_t buf_size = 1024*1024;
     off_t nio = (file_size+buf_size-1) / buf_size;
     uint8_t* buf = malloc(buf_size);
     
     ssize_t ofs = -1;
 
-    // scan for marker
+    // try right after the filesystem first, then scan from the end
     printf("scanning for marker...");
     fflush(stdout);
+    off_t buf_ofs;
+    ssize_t len = 0;
+    if ((ofs = locate_marker_v2(fd,file_size,buf,buf_size,&buf_ofs)) >= 0) {
+        len = file_size - buf_ofs < buf_size ? file_size - buf_ofs : buf_size;
+        nio = 0;
+    }
     while (nio > 0) {
         --nio;
         if (lseek(fd,nio*buf_size,SEEK_SET) == (off_t)-1) {
             fprintf(stderr,"cdrrepair: lseek() failed (%s)\n",strerror(errno));
             return 1;
         }
-        ssize_t len;
-        if ((len = read(fd,buf,buf_size)) <= 0) {
+        if ((len = read(fd,buf,buf_size)) < 0) {
+            // around a bad sector, in small pieces (unreadable as zero)
+            const off_t start = nio*buf_size;
+            len = file_size - start < buf_size ? file_size - start : buf_size;
+            ssize_t k;
+            for (k = 0; k < len; k += 4096) {
+                const size_t n = len - k < 4096 ? len - k : 4096;
+                if (pread(fd,buf + k,n,start + k) != (ssize_t)n)
+                    memset(buf + k,0,n);
+            }
+        }
+        if (len <= 0) {
             fprintf(stderr,"cdrrepair: read() failed (%s)\n",strerror(errno));
             return 1;
         }
@@ -554,14 +885,65 @@ int main(int argc, char*argv[]) {
             break;
     }
 
-    int r = 1;
-    if (ofs >= 0) {
-        printf(" found.\n");
-        r = repair_v2(fd, buf + ofs);
-    }
-    else
+    if (ofs < 0) {
         printf(" not found\n");
+        free(buf);
+        return 1;
+    }
+    printf(" found.\n");
+
+    /* Copy-on-repair: a regular file is copied first (blocks shared where
+     * possible), a device is copied as it is read during the repair.  The
+     * destination is truncated only once it is known not to be the source,
+     * and removed again if the repair fails.
+     */
+    int out = fd, unlink_out = 0;
+    if (argc > 2) {
+        struct stat dst;
+        out = open(argv[2],O_WRONLY|O_CREAT,0666);
+        if (out == -1 || fstat(out,&dst) != 0) {
+            fprintf(stderr,"cdrrepair: failed to create file %s (%s)\n",
+                    argv[2],strerror(errno));
+            free(buf);
+            return 1;
+        }
+        if (dst.st_dev == src.st_dev && dst.st_ino == src.st_ino) {
+            fprintf(stderr,"cdrrepair: %s and %s are the same file\n",
+                    argv[1],argv[2]);
+            close(out);
+            free(buf);
+            return 1;
+        }
+        unlink_out = S_ISREG(dst.st_mode);
+        if (unlink_out && ftruncate(out,0) != 0) {
+            fprintf(stderr,"cdrrepair: ftruncate() failed (%s)\n",
+                    strerror(errno));
+            close(out);
+            unlink(argv[2]);
+            free(buf);
+            return 1;
+        }
+    }
+
+    int r = 0;
+    if (argc > 2 && !stream) {
+        printf("copying %s to %s...",argv[1],argv[2]);
+        fflush(stdout);
+        r = copy_file(fd,out,file_size) != 0;
+        printf(r ? " failed!\n" : " done.\n");
+    }
+    if (r == 0)
+        r = repair_v2(fd, out, stream, buf + ofs, len - ofs, group, budget,
+                      copy_fd, num_copies);
 
+    if (out != fd && close(out) != 0) {
+        fprintf(stderr,"cdrrepair: close() failed (%s)\n",strerror(errno));
+        r = 1;
+    }
+    if (r != 0 && unlink_out) {
+        fprintf(stderr,"cdrrepair: repair failed, %s removed\n",argv[2]);
+        unlink(argv[2]);
+    }
     free(buf);
     return r;
 }
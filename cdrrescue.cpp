@@ -14,11 +14,16 @@
    You should have received a copy of the GNU General Public License
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
-
-#include <cassert>
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
+#include <csignal>
 #include <cstring>
+#include <ctime>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <string>
 #include <vector>
 #include <iostream>
 
@@ -29,6 +34,8 @@
 #include <unistd.h>
 
 #include "Marker.h"
+#include "marker-v2.h"
+#include "volume.h"
 
 
 #define MB (1024*1024)
@@ -45,62 +52,6 @@ struct auto_file_descriptor {
     }
 };
 
-template <typename T>
-struct unique_array {
-    typedef T value_type;
-    value_type* arr;
-    explicit unique_array(value_type* arr) : arr(arr) {}
-    ~unique_array() { delete[] arr; }
-    value_type* get() { return arr; }
-    const value_type* get() const { return arr; }
-    value_type& operator[](unsigned i) { return arr[i]; }
-    const value_type& operator[](unsigned i) const { return arr[i]; }
-
-private:
-    unique_array(const unique_array&);
-    unique_array& operator=(const unique_array&);
-};
-
-class BitMap2d {
-public:
-    static const unsigned BITS_PER_LONG = sizeof(unsigned long)*8;
-
-    const unsigned nrows;
-    const unsigned ncols;
-  
-    BitMap2d(unsigned rows, unsigned cols) 
-        : nrows(rows), 
-          ncols(cols),
-          per_row((ncols+BITS_PER_LONG-1) / BITS_PER_LONG),
-          bits(nrows*per_row,0) {
-    }
-
-    bool test(unsigned int row, unsigned int col) const {
-        return (bucket(row,col)>>(col%BITS_PER_LONG))&1;
-    }
-    
-    void set(unsigned int row, unsigned int col) {
-        bucket(row,col) |= 1ul<<(col%BITS_PER_LONG);
-    }
-    void reset(unsigned int row, unsigned int col) {
-        bucket(row,col) &= ~(1ul<<(col%BITS_PER_LONG));
-    }
-    void flip(unsigned int row, unsigned int col) {
-        bucket(row,col) ^= 1ul<<(col%BITS_PER_LONG);
-    }
-  
-private:
-    const unsigned per_row;
-    std::vector<unsigned long> bits;
-
-    inline unsigned long& bucket(unsigned row, unsigned col) {
-        return bits[row*per_row + col/BITS_PER_LONG];
-    }
-    inline const unsigned long& bucket(unsigned row, unsigned col) const {
-        return bits[row*per_row + col/BITS_PER_LONG];
-    }
-};
-
 
 // dest/src must be aligned on some machines
 static void memxor(void* dest, const void* src, size_t n) {
@@ -146,12 +97,33 @@ static bool seek_and_write(int fd, const void* src, off64_t pos, size_t n) {
 }
 
 
+// valid marker anywhere in buf
+static bool marker_in(Marker& m, const char* buf, size_t n) {
+    for (size_t i = 0; i + sizeof(Marker) <= n; ++i) {
+        if (memcmp(buf+i,&Marker::SIG1,sizeof(Marker::SIG1)) == 0 ||
+            memcmp(buf+i,&Marker::SIG1R,sizeof(Marker::SIG1R)) == 0) {
+            memcpy(&m,buf+i,sizeof(Marker));
+            if (m.is_valid()) {
+                m.fix_endian();
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
 static bool find_marker(Marker& m, int fd) {
     static const int block_size = 2048;
     static const int look_back = 1024;
     char buf[block_size];
 
+    // marker block normally follows the filesystem in the image
     bool found = false;
+    const off64_t volume = volume_bytes(fd);
+    const ssize_t n = volume > 0 ? pread64(fd,buf,block_size,volume) : 0;
+    if (n > 0)
+        found = marker_in(m,buf,n);
+
     for (int j = 1; j <= look_back && !found; ++j) {
         off64_t o = lseek64(fd,-j*block_size,SEEK_END);
         if (o == (off64_t)-1) {
@@ -165,17 +137,7 @@ static bool find_marker(Marker& m, int fd) {
                       << std::endl;
             continue;
         }
-        for (size_t i = 0; i <= block_size - sizeof(Marker); ++i) {
-            if (memcmp(buf+i,&Marker::SIG1,sizeof(Marker::SIG1)) == 0 ||
-                memcmp(buf+i,&Marker::SIG1R,sizeof(Marker::SIG1R)) == 0) {
-                memcpy(&m,buf+i,sizeof(Marker));
-                if (m.is_valid()) {
-                    m.fix_endian();
-                    found = true;
-                    break;
-                }
-            }
-        }
+        found = marker_in(m,buf,block_size);
     }
     if (lseek(fd,0,SEEK_SET) != 0)
         std::cerr << "cdrrescue: seek failed (" << strerror(errno) << ")"
@@ -183,261 +145,994 @@ static bool find_marker(Marker& m, int fd) {
     return found;
 }
 
-static bool recover_image(const char* destfile, const char* srcfile) {
-    // open src file
-    const auto_file_descriptor fin(open(srcfile,O_RDONLY|O_LARGEFILE));
-    if (fin == -1) {
-        std::cerr << "cdrrescue: " << strerror(errno)
-                  << " '" << srcfile << "'"
-                  << std::endl;
-        return false;
+// disjoint ranges of blocks
+class RangeSet {
+public:
+    RangeSet() : n(0) {}
+
+    void insert(uint64_t a, uint64_t b) {
+        if (a >= b)
+            return;
+        auto p = r.upper_bound(a);
+        if (p != r.begin() && std::prev(p)->second >= a)
+            --p;
+        while (p != r.end() && p->first <= b) {
+            a = std::min(a, p->first);
+            b = std::max(b, p->second);
+            n -= p->second - p->first;
+            p = r.erase(p);
+        }
+        r[a] = b;
+        n += b - a;
     }
-  
-    // find existing parity marker
-    Marker m;
-    if (!find_marker(m,fin)) {
-        std::cerr << "cdrrescue: marker not found" << std::endl;
-        return false;
+
+    void erase(uint64_t a, uint64_t b) {
+        auto p = r.upper_bound(a);
+        if (p != r.begin() && std::prev(p)->second > a)
+            --p;
+        while (p != r.end() && p->first < b) {
+            const uint64_t s = p->first, e = p->second;
+            n -= e - s;
+            p = r.erase(p);
+            if (s < a) {
+                r[s] = a;
+                n += a - s;
+            }
+            if (e > b) {
+                r[b] = e;
+                n += e - b;
+            }
+        }
     }
-    const size_t laststripesize = m.imagesize - m.stripesize*(m.nstripes-1);
-    const size_t totalsize = m.imagesize + m.stripesize + 1; // not including last marker
 
-    std::cout << "note: image file has " << m.imagesize << " blocks"
-              << std::endl;
-    std::cout << "note: divided into " << m.nstripes << " stripes of "
-              << m.stripesize << " blocks each" << std::endl;
-    std::cout << "\tlast stripe has " << laststripesize << " blocks"
-              << std::endl;
-    std::cout << "\tparity offset by " << m.stripeoffset << " blocks"
-              << std::endl;
+    // first block at or after pos, and end of its range
+    bool next(uint64_t pos, uint64_t& block, uint64_t& end) const {
+        auto p = r.upper_bound(pos);
+        if (p != r.begin() && std::prev(p)->second > pos) {
+            block = pos;
+            end = std::prev(p)->second;
+            return true;
+        }
+        if (p == r.end())
+            return false;
+        block = p->first;
+        end = p->second;
+        return true;
+    }
 
-    // allocate all-zero block
-    const std::vector<char> zeroblock(m.blocksize, 0);
-  
-    // allocate stripe
-    std::vector<char> stripe(m.stripesize * m.blocksize, 0);
-
-    // allocate read buffer
-    size_t bufsize = MB;
-    if (bufsize < m.blocksize)
-        bufsize = m.blocksize;
-    size_t blocks_per_buf = bufsize / m.blocksize;
-    while (blocks_per_buf > m.stripesize) {
-        blocks_per_buf /= 2;
-        bufsize /= 2;
-    }
-    unique_array<char> buf(new char[bufsize]);
-    if (buf.get() == NULL) {
-        std::cerr << "cdrrescue: failed to allocate needed memory" << std::endl;
-        return false;
+    uint64_t size() const { return n; }
+    const std::map<uint64_t,uint64_t>& ranges() const { return r; }
+
+private:
+    std::map<uint64_t,uint64_t> r;  // first -> end
+    uint64_t n;
+};
+
+
+/* The image is split into items (stripes, tiles or parity regions), each
+ * a member of one or two parity equations: the xor of all members of an
+ * equation, aligned at their eq_offset, is zero.  v1 has one equation of
+ * stripesize columns, with the parity split in two items because it is
+ * rotated by stripeoffset.
+ *
+ * Known blocks (read or rebuilt) are xored into one accumulator per
+ * equation, and every column keeps a count of its missing blocks, so a
+ * block can be rebuilt as soon as its count drops to one.  The blocks not
+ * yet known are kept as ranges, to find the next one to read.  With v2 a
+ * completed item is checked against its hash right away: if a read
+ * returned wrong data the item is dropped and rebuilt from parity instead.
+ */
+
+enum { MISSING, READ, REBUILT };
+
+struct item_state {
+    std::vector<uint8_t> block;     // MISSING, READ or REBUILT
+    uint64_t missing;
+    bool untrusted;         // read wrong data, rebuild only
+    bool failed;            // rebuilt data failed hash
+    bool confirmed;         // complete (and hash matches)
+};
+
+class Rescue {
+public:
+    const uint64_t bb;
+    const std::vector<v2_item> items;
+    std::vector<item_state> state;
+
+    // blocks from out_blocks on are not written; v2 marker to check hashes
+    Rescue(int fout, uint64_t block_bytes, uint64_t image_blocks,
+           uint64_t out_blocks, const std::vector<v2_item>& items,
+           const std::vector<uint64_t>& eq_blocks,
+           const v2_marker* m = NULL, const char* marker = NULL)
+        : bb(block_bytes),
+          items(items),
+          state(items.size()),
+          fout(fout),
+          image_blocks(image_blocks),
+          out_blocks(out_blocks),
+          m(m),
+          marker(marker),
+          members(eq_blocks.size()),
+          acc(eq_blocks.size()),
+          missing(eq_blocks.size()),
+          image_missing(eq_blocks.size()),
+          unconfirmed(0),
+          known(0),
+          buf(MB) {
+        for (unsigned e = 0; e < eq_blocks.size(); ++e) {
+            acc[e].assign(eq_blocks[e] * bb, 0);
+            missing[e].assign(eq_blocks[e], 0);
+            image_missing[e].assign(eq_blocks[e], 0);
+        }
+        for (unsigned i = 0; i < items.size(); ++i) {
+            const v2_item& it = items[i];
+            item_state& s = state[i];
+            s.block.assign(it.blocks, MISSING);
+            s.missing = it.blocks;
+            s.untrusted = s.failed = s.confirmed = false;
+            unconfirmed += in_image(i);
+            offsets.push_back(it.offset);
+            unread.insert(it.offset, it.offset + it.blocks);
+            for (int j = 0; j < 2; ++j) {
+                const int e = it.eq[j];
+                if (e < 0)
+                    continue;
+                members[e].push_back(i);
+                for (uint64_t c = 0; c < it.blocks; ++c) {
+                    ++missing[e][it.eq_offset + c];
+                    if (in_image(i))
+                        ++image_missing[e][it.eq_offset + c];
+                }
+            }
+        }
+        queue_rebuildable();
     }
-  
-    // open dest file
-    const auto_file_descriptor fout(
-        open(destfile,O_CREAT|O_TRUNC|O_WRONLY|O_LARGEFILE,0666));
-    if (fout == -1) {
-        std::cerr << "cdrrescue: " << strerror(errno)
-                  << " '" << destfile << "'"
-                  << std::endl;
+
+    // item holding disc block, -1 for marker blocks
+    int item_at(uint64_t block) const {
+        const auto p = std::upper_bound(offsets.begin(),offsets.end(),block);
+        if (p == offsets.begin())
+            return -1;
+        const unsigned i = p - offsets.begin() - 1;
+        return block < items[i].offset + items[i].blocks ? (int)i : -1;
+    }
+
+    bool in_image(unsigned i) const {
+        return items[i].offset < image_blocks;
+    }
+
+    // next blocks to read or rebuild at or after pos
+    bool next_unread(uint64_t pos, uint64_t& block, uint64_t& end) const {
+        return unread.next(pos,block,end);
+    }
+
+    // block b of item i as read from disc
+    bool accept(unsigned i, uint64_t b, const char* data) {
+        item_state& s = state[i];
+        if (s.block[b] != MISSING || s.untrusted)
+            return true;
+        if (!write_block(i,b,data))
+            return false;
+        known_block(i,b,READ,data);
+        return s.missing > 0 || complete(i);
+    }
+
+    // equation that gives missing block b of item i, -1 if none yet
+    int rebuildable(unsigned i, uint64_t b) const {
+        const v2_item& it = items[i];
+        if (state[i].failed)
+            return -1;
+        for (int j = 0; j < 2; ++j)
+            if (it.eq[j] >= 0 && missing[it.eq[j]][it.eq_offset + b] == 1)
+                return it.eq[j];
+        return -1;
+    }
+
+    bool rebuild(unsigned i, uint64_t b, int e) {
+        const uint64_t col = items[i].eq_offset + b;
+        std::vector<char> block(acc[e].begin() + col*bb,
+                                acc[e].begin() + (col + 1)*bb);
+        if (!write_block(i,b,&block[0]))
+            return false;
+        known_block(i,b,REBUILT,&block[0]);
+        return state[i].missing > 0 || complete(i);
+    }
+
+    // image blocks are always wanted, parity only for a missing column
+    bool needed(unsigned i, uint64_t b) const {
+        if (in_image(i))
+            return true;
+        const v2_item& it = items[i];
+        for (int j = 0; j < 2; ++j)
+            if (it.eq[j] >= 0 && image_missing[it.eq[j]][it.eq_offset + b] > 0)
+                return true;
         return false;
     }
- 
-    // bitmap to track successfully read blocks
-    BitMap2d bm(m.nstripes+1,m.stripesize);
-
-    // mark tail blocks in last stripe as successfully read
-    for (unsigned int i = laststripesize; i < m.stripesize; ++i)
-        bm.set(m.nstripes-1,i);
-
-    // read large buffer
-    unsigned int blocks_found = 0;
-    unsigned int blocks_written = 0;
-    unsigned int nfullbufs = totalsize/blocks_per_buf;
-    for (unsigned int buf_num = 0; buf_num < nfullbufs; ++buf_num) {
-        std::cout << "cdrrescue: " << blocks_found << '/' << m.imagesize
-                  << "     \r" << std::flush;
 
-        off64_t buf_start = bufsize;
-        buf_start *= buf_num;
-        if (!seek_and_read(buf.get(),fin,buf_start,bufsize))
-            continue;
+    // block worth reading: missing, needed and not rebuildable
+    bool wanted(uint64_t block) const {
+        const int i = item_at(block);
+        if (i < 0)
+            return false;
+        const uint64_t b = block - items[i].offset;
+        return state[i].block[b] == MISSING && !state[i].untrusted &&
+            needed(i,b) && rebuildable(i,b) < 0;
+    }
 
-        // write out zero blocks if necessary
-        if (buf_num*blocks_per_buf <= m.imagesize)
-            while(blocks_written < buf_num*blocks_per_buf) {
-                if (write(fout,&zeroblock[0],m.blocksize) != (ssize_t)m.blocksize) {
-                    std::cerr << "cdrrescue: write failed (" << strerror(errno)
-                              << ")" << std::endl;
-                    return false;
+    // columns made rebuildable by reading block b of item i
+    unsigned unlocks(unsigned i, uint64_t b) const {
+        const v2_item& it = items[i];
+        unsigned n = 0;
+        for (int j = 0; j < 2; ++j)
+            n += it.eq[j] >= 0 && missing[it.eq[j]][it.eq_offset + b] == 2;
+        return n;
+    }
+
+    // rebuild until nothing more can be, false on write error
+    bool rebuild_all(uint64_t& rebuilt) {
+        while (!queue.empty()) {
+            const int e = queue.back().first;
+            const uint64_t col = queue.back().second;
+            queue.pop_back();
+            if (missing[e][col] != 1)
+                continue;
+            for (unsigned k : members[e]) {
+                const v2_item& o = items[k];
+                if (col < o.eq_offset || col >= o.eq_offset + o.blocks ||
+                    state[k].block[col - o.eq_offset] != MISSING)
+                    continue;
+                if (!state[k].failed) {
+                    if (!rebuild(k,col - o.eq_offset,e))
+                        return false;
+                    ++rebuilt;
                 }
-                ++blocks_written;
+                break;
             }
-    
-        for (unsigned int i = 0; i < blocks_per_buf; ++i) {
-            unsigned int block_num = buf_num*blocks_per_buf+i;
-            if (block_num < m.imagesize) {
-                // main image
-                int stripe_num = block_num/m.stripesize;
-                int col = block_num%m.stripesize;
-                if (write(fout,&buf[i*m.blocksize],m.blocksize) != (ssize_t)m.blocksize) {
-                    std::cerr << "cdrrescue: write failed (" << strerror(errno)
-                              << ")" << std::endl;
+        }
+        return true;
+    }
+
+    uint64_t image_known() const { return known; }
+    bool image_done() const { return unconfirmed == 0; }
+
+    bool parity_zero() const {
+        for (const auto& a : acc)
+            for (char c : a)
+                if (c)
                     return false;
+        return true;
+    }
+
+    /* Rescue state file: known and bad block ranges, then regions read
+     * with wrong data.  Only blocks in the output file are listed (not the
+     * v1 parity), so the accumulators can be rebuilt from it on load.
+     * Written to a temporary file and renamed, after the output file is
+     * synced, so it always matches the output file.
+     */
+    bool save(const char* file, const RangeSet& bad) const {
+        if (fdatasync(fout) != 0) {
+            std::cerr << "cdrrescue: sync of output file failed ("
+                      << strerror(errno) << ")" << std::endl;
+            return false;
+        }
+        const std::string tmp = std::string(file) + ".tmp";
+        std::ofstream out(tmp.c_str(),std::ios::binary|std::ios::trunc);
+        out << "# cdrrescue mapfile" << std::endl
+            << "# block_bytes image_blocks items equations" << std::endl
+            << bb << ' ' << image_blocks << ' ' << items.size() << ' '
+            << acc.size() << std::endl
+            << "# first_block blocks status (+ read, * rebuilt, - bad)"
+            << std::endl << std::showbase << std::hex;
+        for (unsigned i = 0; i < items.size(); ++i) {
+            const item_state& st = state[i];
+            if (items[i].offset + items[i].blocks > out_blocks)
+                continue;
+            for (uint64_t b = 0; b < items[i].blocks; ) {
+                uint64_t e = b + 1;
+                while (e < items[i].blocks && st.block[e] == st.block[b])
+                    ++e;
+                if (st.block[b] != MISSING)
+                    out << items[i].offset + b << ' ' << e - b << ' '
+                        << (st.block[b] == READ ? '+' : '*') << std::endl;
+                b = e;
+            }
+        }
+        for (const auto& p : bad.ranges())
+            out << p.first << ' ' << p.second - p.first << " -" << std::endl;
+        out << std::dec;
+        for (unsigned i = 0; i < items.size(); ++i)
+            if (state[i].untrusted)
+                out << "untrusted " << i << std::endl;
+        out << "end" << std::endl;
+        out.close();
+        const int fd = open(tmp.c_str(),O_RDONLY);
+        const bool synced = fd >= 0 && fsync(fd) == 0;
+        if (fd >= 0)
+            close(fd);
+        if (!out || !synced || rename(tmp.c_str(),file) != 0) {
+            std::cerr << "cdrrescue: failed to write " << file << " ("
+                      << strerror(errno) << ")" << std::endl;
+            return false;
+        }
+        return true;
+    }
+
+    bool load(const char* file, RangeSet& bad) {
+        std::ifstream in(file,std::ios::binary);
+        std::string line;
+        bool header = false;
+        while (std::getline(in,line)) {
+            if (line.empty() || line[0] == '#')
+                continue;
+            std::istringstream f(line);
+            if (!header) {
+                uint64_t b, n, k, e;
+                header = f >> b >> n >> k >> e && b == bb &&
+                    n == image_blocks && k == items.size() && e == acc.size();
+                if (!header)
+                    break;
+                continue;
+            }
+            std::string word;
+            f >> word;
+            if (word == "untrusted") {
+                unsigned i;
+                if (f >> i && i < items.size()) {
+                    state[i].untrusted = true;
+                    unread.erase(items[i].offset,
+                                 items[i].offset + items[i].blocks);
                 }
-                ++blocks_written;
-                memxor(&stripe[col*m.blocksize],
-                       &buf[i*m.blocksize],
-                       m.blocksize);
-                bm.set(stripe_num,col);
-                ++blocks_found;
+                continue;
+            }
+            if (word == "end") {
+                for (unsigned i = 0; i < items.size(); ++i)
+                    if (state[i].missing == 0 && !state[i].confirmed) {
+                        state[i].confirmed = true;
+                        unconfirmed -= in_image(i);
+                    }
+                queue_rebuildable();
+                return true;
+            }
+            char status;
+            const uint64_t first = strtoull(word.c_str(),NULL,0);
+            f >> word >> status;
+            const uint64_t n = strtoull(word.c_str(),NULL,0);
+            if (status == '-') {
+                bad.insert(first,first + n);
+                continue;
             }
-            // note: block_num==m.imagesize is a marker block (ignore)
-            else if (block_num > m.imagesize) {
-                // parity data
-                int col = (block_num-m.imagesize-1+
-                           m.stripesize-m.stripeoffset) % m.stripesize;
-                bm.set(m.nstripes,col);
-                memxor(&stripe[col*m.blocksize],
-                       &buf[i*m.blocksize],
-                       m.blocksize);
+            if (!load_known(first,n,status == '+' ? READ : REBUILT))
+                break;
+        }
+        std::cerr << "cdrrescue: " << file
+                  << (header ? " is incomplete" : " does not match this disc")
+                  << std::endl;
+        return false;
+    }
+
+    std::string name(unsigned i) const {
+        if (m)
+            return item_name(m,&items[i]);
+        return in_image(i) ? "stripe #" + std::to_string(items[i].num + 1) :
+            "parity";
+    }
+
+private:
+    const int fout;
+    const uint64_t image_blocks, out_blocks;
+    const v2_marker* const m;
+    const char* const marker;
+    std::vector<uint64_t> offsets;                  // of items
+    std::vector<std::vector<unsigned> > members;    // items per equation
+    std::vector<std::vector<char> > acc;            // xor of known blocks
+    std::vector<std::vector<unsigned> > missing;    // per column
+    std::vector<std::vector<unsigned> > image_missing;
+    std::vector<std::pair<int,uint64_t> > queue;    // columns to rebuild
+    RangeSet unread;
+    unsigned unconfirmed;   // image items
+    uint64_t known;         // image blocks
+    std::vector<char> buf;
+
+    // known blocks from the state file, read back for the accumulators
+    bool load_known(uint64_t first, uint64_t n, int how) {
+        for (uint64_t block = first; block < first + n; ) {
+            const uint64_t k = std::min<uint64_t>(first + n - block, MB / bb);
+            if (block + k > out_blocks ||
+                !seek_and_read(&buf[0],fout,block*bb,k*bb))
+                return false;
+            for (uint64_t j = 0; j < k; ++j, ++block) {
+                const int i = item_at(block);
+                if (i < 0)
+                    return false;
+                const uint64_t b = block - items[i].offset;
+                if (state[i].block[b] == MISSING)
+                    known_block(i,b,how,&buf[j*bb]);
             }
         }
+        return true;
+    }
+
+    bool write_block(unsigned i, uint64_t b, const char* data) {
+        const uint64_t block = items[i].offset + b;
+        return block >= out_blocks || seek_and_write(fout,data,block*bb,bb);
+    }
+
+    void queue_rebuildable() {
+        for (unsigned e = 0; e < missing.size(); ++e)
+            for (uint64_t c = 0; c < missing[e].size(); ++c)
+                if (missing[e][c] == 1)
+                    queue.push_back(std::make_pair((int)e,c));
+    }
+
+    // data is xored into the accumulators unless NULL
+    void known_block(unsigned i, uint64_t b, int how, const char* data) {
+        const v2_item& it = items[i];
+        for (int j = 0; j < 2; ++j) {
+            const int e = it.eq[j];
+            if (e < 0)
+                continue;
+            const uint64_t col = it.eq_offset + b;
+            if (data)
+                memxor(&acc[e][col*bb], data, bb);
+            if (--missing[e][col] == 1)
+                queue.push_back(std::make_pair(e,col));
+            if (in_image(i))
+                --image_missing[e][col];
+        }
+        state[i].block[b] = how;
+        --state[i].missing;
+        unread.erase(it.offset + b, it.offset + b + 1);
+        known += in_image(i);
+    }
+
+    void missing_block(unsigned i, uint64_t b, const char* data) {
+        const v2_item& it = items[i];
+        for (int j = 0; j < 2; ++j) {
+            const int e = it.eq[j];
+            if (e < 0)
+                continue;
+            const uint64_t col = it.eq_offset + b;
+            memxor(&acc[e][col*bb], data, bb);
+            ++missing[e][col];
+            if (in_image(i))
+                ++image_missing[e][col];
+        }
+        state[i].block[b] = MISSING;
+        ++state[i].missing;
+        if (!state[i].untrusted)
+            unread.insert(it.offset + b, it.offset + b + 1);
+        known -= in_image(i);
     }
 
-    // write out zero blocks if necessary
-    while(blocks_written < m.imagesize) {
-        if (write(fout,&zeroblock[0],m.blocksize) != (ssize_t)m.blocksize) {
-            std::cerr << "cdrrescue: write failed (" << strerror(errno) << ")"
+    // complete item: check hash, read back from the output file
+    bool complete(unsigned i) {
+        const v2_item& it = items[i];
+        item_state& s = state[i];
+        if (!m) {
+            s.confirmed = true;
+            unconfirmed -= in_image(i);
+            return true;
+        }
+        uint8_t key[SIPHASH_KEY_LENGTH], hash[SIPHASH_DIGEST_LENGTH];
+        siphash_ctx ctx;
+        item_key(m,&it,key);
+        siphash_init(&ctx,key);
+        for (uint64_t b = 0; b < it.blocks; ) {
+            const uint64_t n = std::min<uint64_t>(it.blocks - b, MB / bb);
+            if (!seek_and_read(&buf[0],fout,(it.offset + b)*bb,n*bb))
+                return false;
+            siphash_update(&ctx,&buf[0],n*bb);
+            b += n;
+        }
+        siphash_final(&ctx,hash);
+        if (item_hash_matches(m,marker,&it,hash)) {
+            s.confirmed = true;
+            unconfirmed -= in_image(i);
+            return true;
+        }
+
+        // wrong data: take it out of the accumulators again
+        bool was_read = false;
+        for (uint64_t b = 0; b < it.blocks; ++b)
+            was_read |= s.block[b] == READ;
+        s.untrusted |= was_read;
+        s.failed = !was_read;
+        for (uint64_t b = 0; b < it.blocks; ) {
+            const uint64_t n = std::min<uint64_t>(it.blocks - b, MB / bb);
+            if (!seek_and_read(&buf[0],fout,(it.offset + b)*bb,n*bb))
+                return false;
+            for (uint64_t k = 0; k < n; ++k, ++b)
+                missing_block(i,b,&buf[k*bb]);
+        }
+        if (was_read) {
+            std::cout << "note: " << name(i)
+                      << " read with wrong data, rebuilding from parity"
                       << std::endl;
+            // rebuilt items may have used the wrong data
+            for (auto& t : state)
+                t.failed = false;
+            queue_rebuildable();
+        }
+        return true;
+    }
+};
+
+
+// complete and valid v2 marker, from the scan or the two copies on disc
+static bool find_marker_v2_full(v2_marker& m, std::vector<char>& marker,
+                                int fd) {
+    const off64_t size = lseek64(fd,0,SEEK_END);
+    if (size == (off64_t)-1)
+        return false;
+    std::vector<char> buf(MB);
+    off_t buf_ofs = 0;
+    ssize_t len = 0;
+    ssize_t ofs = locate_marker_v2(fd,size,&buf[0],MB,&buf_ofs);
+    if (ofs >= 0)
+        len = size - buf_ofs < MB ? size - buf_ofs : MB;
+    for (off64_t pos = (size + MB - 1) / MB * MB;
+         ofs < 0 && pos > 0 && size - pos < 16*MB; ) {
+        pos -= MB;
+        len = pread64(fd,&buf[0],MB,pos);
+        if (len > 0)
+            ofs = find_marker_v2(&buf[0],len);
+    }
+    if (ofs < 0 || parse_marker_v2(stdout,&m,&buf[ofs]) != 0)
+        return false;
+
+    const uint64_t bb = m.block_bytes;
+    const size_t marker_bytes = m.marker_blocks * bb;
+    marker.assign(marker_bytes, 0);
+    if (len - ofs >= (ssize_t)marker_bytes &&
+        verify_marker_hash(&buf[ofs],bb,m.marker_blocks)) {
+        memcpy(&marker[0],&buf[ofs],marker_bytes);
+        return true;
+    }
+
+    // take each block from whichever copy has it good
+    const off64_t copy[2] = {
+        (off64_t)(m.image_blocks*bb),
+        (off64_t)((m.image_blocks + m.marker_blocks + m.parity_blocks)*bb)
+    };
+    std::vector<char> block(bb);
+    for (unsigned i = 0; i < m.marker_blocks; ++i) {
+        bool good = false;
+        for (int c = 0; c < 2 && !good; ++c)
+            good = pread64(fd,&block[0],bb,copy[c] + i*bb) == (ssize_t)bb &&
+                verify_marker_block_hash(&block[0],bb) &&
+                (i > 0 || memcmp(&block[0],&buf[ofs],bb) == 0);
+        if (!good) {
+            std::cerr << "cdrrescue: marker block " << i
+                      << " unreadable in both copies" << std::endl;
+            free_marker_v2(&m);
             return false;
         }
-        ++blocks_written;
+        memcpy(&marker[i*bb],&block[0],bb);
     }
-    assert(blocks_written == m.imagesize);
-  
-    // attempt to read remainder of parity data
-    for (unsigned int block_num = 
-             nfullbufs*blocks_per_buf; block_num < totalsize; ++block_num) {
-        off64_t block_start = m.blocksize;
-        block_start *= block_num;
-        if (!seek_and_read(buf.get(),fin,block_start,m.blocksize))
-            continue;
-        // parity data
-        int col = (block_num-m.imagesize-1+
-                   m.stripesize-m.stripeoffset)%m.stripesize;
-        bm.set(m.nstripes,col);
-        memxor(&stripe[col*m.blocksize],buf.get(),m.blocksize);
-    }
-
-    // attempt to read or reconstruct all missing blocks
-    unsigned int last_blocks_found = 0;
-    while (blocks_found<m.imagesize) {
-        for (unsigned int block_num = 0; block_num < totalsize; ++block_num) {
-            if (last_blocks_found != blocks_found) {
-                last_blocks_found = blocks_found;
-                std::cout << "cdrrescue: " << blocks_found
-                          << '/' << m.imagesize << "     \r" << std::flush;
+    return true;
+}
+
+
+/* Reads are modelled on ddrescue.  The first pass reads large chunks in
+ * disc order, skipping ahead (further after every failure in a row) past
+ * clusters of errors.  The second pass bisects every range still missing
+ * down to the bad blocks, so one bad sector costs a few reads rather than
+ * a whole chunk.  Then the bad blocks are retried, those that make the
+ * most columns rebuildable first, until each region has used up its
+ * retry budget.  Blocks that can be rebuilt, or parity that is not
+ * needed, are never read.
+ */
+struct rescue_options {
+    unsigned retries;           // failed reads per region
+    const char* mapfile;        // rescue state, NULL if none
+    const char* import_image;   // partial image from ddrescue
+    const char* import_map;     // and its mapfile
+};
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt(int) {
+    interrupted = 1;
+}
+
+class Reader {
+public:
+    Reader(Rescue& r, int fin, uint64_t image_blocks,
+           const rescue_options& opt)
+        : r(r),
+          fin(fin),
+          image_blocks(image_blocks),
+          opt(opt),
+          cluster(std::max<uint64_t>(MB / r.bb, 1)),
+          buf(cluster * r.bb),
+          failures(r.items.size(), 0),
+          rebuilt(0),
+          reads(0),
+          last_known(~0ull),
+          last_save(time(NULL)),
+          error(false) {
+    }
+
+    // state of an earlier run, blocks good in a ddrescue image
+    bool start(bool resume) {
+        if (resume) {
+            if (!r.load(opt.mapfile,bad))
+                return false;
+            std::cout << "note: resuming from " << opt.mapfile << ", "
+                      << r.image_known() << '/' << image_blocks
+                      << " blocks known" << std::endl;
+        }
+        if (opt.import_image && !import())
+            return false;
+        return r.rebuild_all(rebuilt);
+    }
+
+    // true if the image is complete
+    bool run() {
+        if (opt.mapfile) {
+            signal(SIGINT,interrupt);
+            signal(SIGTERM,interrupt);
+        }
+        copy_pass();
+        bisect_pass();
+        retry_passes();
+        // parity left unread
+        if (!error && !interrupted)
+            error |= !r.rebuild_all(rebuilt);
+        if (opt.mapfile)
+            error |= !r.save(opt.mapfile,bad);
+        if (interrupted)
+            std::cerr << std::endl << "cdrrescue: interrupted, state saved to "
+                      << opt.mapfile << std::endl;
+        if (error || interrupted)
+            return false;
+
+        std::cout << std::endl << "done." << std::endl;
+        std::cout << "note: " << reads << " reads, " << bad.size()
+                  << " bad blocks, " << rebuilt
+                  << " blocks rebuilt from parity" << std::endl;
+        bool good = true;
+        for (unsigned i = 0; i < r.items.size(); ++i)
+            if (!r.state[i].confirmed) {
+                std::cerr << "cdrrescue: " << r.name(i)
+                          << (r.state[i].failed ? " rebuilt with wrong data" :
+                              " could not be recovered") << std::endl;
+                good = false;
             }
+        if (good && !r.parity_zero())
+            std::cerr << "cdrrescue: parity data not zero (image corrupt)"
+                      << std::endl;
+        return r.image_done();
+    }
 
-            off64_t block_start = m.blocksize;
-            block_start *= block_num;
+private:
+    Rescue& r;
+    const int fin;
+    const uint64_t image_blocks;
+    const rescue_options& opt;
+    const uint64_t cluster;         // blocks per large read
+    std::vector<char> buf;
+    RangeSet bad;                   // blocks that failed to read
+    std::vector<unsigned> failures; // per item, in retry passes
+    uint64_t rebuilt, reads, last_known;
+    time_t last_save;
+    bool error;
 
-            // check if block is known or can be reconstructed
-            if (block_num < m.imagesize) {
-                // main image
-                const unsigned int stripe_num = block_num / m.stripesize;
-                const unsigned int col = block_num % m.stripesize;
-                if (bm.test(stripe_num,col))
-                    continue;
+    bool stop() const {
+        return error || interrupted || r.image_done();
+    }
 
-                // can we reconstruct?
-                bool data_known = true;
-                for (unsigned int i = 0; i <= m.nstripes; ++i) {
-                    if (i != stripe_num && !bm.test(i,col)) {
-                        data_known = false;
-                        break;
-                    }
-                }
+    // also saves the state every 30 seconds
+    void progress() {
+        if (opt.mapfile && time(NULL) - last_save >= 30) {
+            error |= !r.save(opt.mapfile,bad);
+            last_save = time(NULL);
+        }
+        if (last_known == r.image_known())
+            return;
+        last_known = r.image_known();
+        std::cout << "cdrrescue: " << last_known << '/' << image_blocks
+                  << "     \r" << std::flush;
+    }
+
+    // read up to n blocks at block, returns how many were good
+    uint64_t read_blocks(uint64_t block, uint64_t n) {
+        const uint64_t bb = r.bb;
+        ++reads;
+        const ssize_t got = pread64(fin,&buf[0],n*bb,block*bb);
+        const uint64_t good = got > 0 ? got / bb : 0;
+        for (uint64_t k = 0; k < good && !error; ++k) {
+            const int i = r.item_at(block + k);
+            if (i >= 0)
+                error |= !r.accept(i,block + k - r.items[i].offset,&buf[k*bb]);
+        }
+        if (good > 0) {
+            bad.erase(block,block + good);
+            error |= !r.rebuild_all(rebuilt);
+            progress();
+        }
+        return good;
+    }
 
-                if (data_known) {
-                    // parity array contains reconstructed data
-                    if (!seek_and_write(fout,
-                                        &stripe[col*m.blocksize],
-                                        block_start,
-                                        m.blocksize)) {
+    /* Blocks finished ('+') in a ddrescue mapfile are taken from its image
+     * instead of the drive.  Lines are "pos size status", in bytes; the
+     * first line that is not a comment is the current position.
+     */
+    bool import() {
+        const auto_file_descriptor img(
+            open(opt.import_image,O_RDONLY|O_LARGEFILE));
+        std::ifstream map(opt.import_map);
+        if (img == -1 || !map) {
+            std::cerr << "cdrrescue: failed to open "
+                      << (img == -1 ? opt.import_image : opt.import_map)
+                      << " (" << strerror(errno) << ")" << std::endl;
+            return false;
+        }
+        const uint64_t bb = r.bb;
+        const uint64_t known = r.image_known();
+        std::string line;
+        bool status_line = true;
+        while (std::getline(map,line)) {
+            if (line.empty() || line[0] == '#')
+                continue;
+            if (status_line) {
+                status_line = false;
+                continue;
+            }
+            std::istringstream f(line);
+            std::string pos, size;
+            char status;
+            if (!(f >> pos >> size >> status) || status != '+')
+                continue;
+            const uint64_t a = strtoull(pos.c_str(),NULL,0);
+            const uint64_t b = a + strtoull(size.c_str(),NULL,0);
+            // whole blocks only
+            for (uint64_t block = (a + bb - 1) / bb; block < b / bb; ) {
+                const uint64_t n = std::min(cluster, b / bb - block);
+                if (pread64(img,&buf[0],n*bb,block*bb) != (ssize_t)(n*bb)) {
+                    std::cerr << "cdrrescue: read of " << opt.import_image
+                              << " failed (" << strerror(errno) << ")"
+                              << std::endl;
+                    return false;
+                }
+                for (uint64_t k = 0; k < n; ++k) {
+                    const int i = r.item_at(block + k);
+                    if (i >= 0 &&
+                        !r.accept(i,block + k - r.items[i].offset,&buf[k*bb]))
                         return false;
-                    }
-                    memset(&stripe[col*m.blocksize],0,m.blocksize);
-                    bm.set(stripe_num,col);
-                    ++blocks_found;
-                    continue;
                 }
+                block += n;
             }
+        }
+        std::cout << "note: " << r.image_known() - known
+                  << " blocks taken from " << opt.import_image << std::endl;
+        return true;
+    }
 
-            else if (block_num > m.imagesize) {
-                // parity data
-                int col = (block_num-m.imagesize-1+
-                           m.stripesize-m.stripeoffset)%m.stripesize;
-                if (bm.test(m.nstripes,col))
-                    continue;
-                // do we need it?
-                bool data_known = true;
-                for (unsigned int i = 0; i < m.nstripes; ++i) {
-                    if (!bm.test(i,col)) {
-                        data_known = false;
-                        break;
-                    }
-                }
-                if (data_known) {
-                    memset(&stripe[col*m.blocksize],0,m.blocksize);
-                    bm.set(m.nstripes,col);
-                    continue;
-                }
+    // large reads, skipping ahead further after each failure in a row
+    void copy_pass() {
+        const uint64_t max_skip = 64 * cluster;
+        uint64_t pos = 0, skip = 0, a, end;
+        while (!stop() && r.next_unread(pos,a,end)) {
+            const uint64_t n = std::min(cluster, end - a);
+            const uint64_t good = read_blocks(a,n);
+            if (good == n) {
+                skip = 0;
+                pos = a + n;
+            }
+            else {
+                pos = a + n + skip;
+                skip = skip ? std::min(2*skip, max_skip) : cluster;
             }
+        }
+    }
 
-            else // block_num==m.imagesize is a marker block (skip)
-                continue;
+    // read [a,b), halving failed ranges down to single bad blocks
+    void bisect(uint64_t a, uint64_t b) {
+        while (a < b && !r.wanted(a))
+            ++a;
+        while (a < b && !r.wanted(b - 1))
+            --b;
+        if (a >= b || stop())
+            return;
+        const uint64_t good = read_blocks(a,b - a);
+        a += good;
+        if (a == b)
+            return;
+        if (b - a == 1) {
+            bad.insert(a,b);
+            progress();
+            return;
+        }
+        // first block after a good prefix is most likely bad
+        if (good > 0) {
+            bisect(a,a + 1);
+            ++a;
+        }
+        const uint64_t mid = a + (b - a) / 2;
+        bisect(a,mid);
+        bisect(mid,b);
+    }
 
-            // attempt to read block
-            if (!seek_and_read(buf.get(),fin,block_start,m.blocksize))
-                continue;
-      
-            if (block_num < m.imagesize) {
-                // main image
-                const int stripe_num = block_num / m.stripesize;
-                const int col = block_num % m.stripesize;
-                if (!seek_and_write(fout,buf.get(),block_start,m.blocksize))
-                    return false;
-                memxor(&stripe[col*m.blocksize],buf.get(),m.blocksize);
-                bm.set(stripe_num,col);
-                ++blocks_found;
+    void bisect_pass() {
+        uint64_t pos = 0, a, end;
+        while (!stop() && r.next_unread(pos,a,end)) {
+            const uint64_t b = std::min(a + cluster, end);
+            bisect(a,b);
+            pos = b;
+        }
+    }
+
+    // single blocks, those that unlock the most columns first
+    void retry_passes() {
+        while (!stop()) {
+            std::vector<std::pair<unsigned,uint64_t> > todo;
+            uint64_t pos = 0, a, end;
+            while (r.next_unread(pos,a,end)) {
+                for (uint64_t block = a; block < end; ++block) {
+                    const unsigned i = r.item_at(block);
+                    if (failures[i] < opt.retries && r.wanted(block))
+                        todo.push_back(std::make_pair(
+                            r.unlocks(i,block - r.items[i].offset),block));
+                }
+                pos = end;
             }
-            // note: block_num==m.imagesize is a marker block (ignore)
-            else if (block_num > m.imagesize) {
-                // parity data
-                int col = (block_num-m.imagesize-1+
-                           m.stripesize-m.stripeoffset)%m.stripesize;
-                bm.set(m.nstripes,col);
-                memxor(&stripe[col*m.blocksize],buf.get(),m.blocksize);
+            if (todo.empty())
+                break;
+            std::stable_sort(todo.begin(),todo.end(),
+                             [](const std::pair<unsigned,uint64_t>& x,
+                                const std::pair<unsigned,uint64_t>& y) {
+                                 return x.first > y.first;
+                             });
+            for (const auto& t : todo) {
+                const unsigned i = r.item_at(t.second);
+                if (stop() || failures[i] >= opt.retries ||
+                    !r.wanted(t.second))
+                    continue;
+                if (read_blocks(t.second,1) == 0) {
+                    bad.insert(t.second,t.second + 1);
+                    ++failures[i];
+                    progress();
+                }
             }
         }
     }
-  
-    std::cout << std::endl << "done." << std::endl;
-  
-    for (unsigned int i = 0; i < m.stripesize*m.blocksize; ++i)
-        if (stripe[i]) {
-            std::cerr << "cdrrescue: parity data not zero (image corrupt)"
-                      << std::endl;
-            break;
-        }
-  
+};
+
+static bool open_output(const char* destfile, off64_t bytes, bool resume,
+                        int& fd) {
+    fd = open(destfile,
+              resume ? O_RDWR|O_LARGEFILE : O_CREAT|O_TRUNC|O_RDWR|O_LARGEFILE,
+              0666);
+    if (fd == -1 || ftruncate64(fd,bytes) != 0) {
+        std::cerr << "cdrrescue: " << strerror(errno)
+                  << " '" << destfile << "'"
+                  << std::endl;
+        return false;
+    }
     return true;
 }
 
+// v2: output is the whole disc, markers and parity included
+static bool recover_image_v2(const char* destfile, int fin, const v2_marker& m,
+                             const std::vector<char>& marker,
+                             const rescue_options& opt) {
+    const uint64_t bb = m.block_bytes;
+    const uint64_t disc_blocks =
+        m.image_blocks + 2*m.marker_blocks + m.parity_blocks;
+    std::cout << "note: image file has " << m.image_blocks << " blocks of "
+              << bb << " bytes" << std::endl;
+    std::cout << "note: " << m.num_items << " hashed regions, "
+              << m.parity_blocks << " parity blocks" << std::endl;
+
+    int fd;
+    const bool resume = opt.mapfile && access(opt.mapfile,F_OK) == 0;
+    const bool opened = open_output(destfile,disc_blocks*bb,resume,fd);
+    const auto_file_descriptor fout(fd);
+    if (!opened)
+        return false;
+
+    Rescue r(fout,bb,m.image_blocks,disc_blocks,
+             std::vector<v2_item>(m.items,m.items + m.num_items),
+             std::vector<uint64_t>(m.eq_blocks,m.eq_blocks + m.num_eqs),
+             &m,&marker[0]);
+    Reader reader(r,fin,m.image_blocks,opt);
+    const bool done = reader.start(resume) && reader.run();
+    return seek_and_write(fout,&marker[0],m.image_blocks*bb,marker.size()) &&
+        seek_and_write(fout,&marker[0],(disc_blocks - m.marker_blocks)*bb,
+                       marker.size()) &&
+        done;
+}
+
+// v1: output is the image only
+static bool recover_image_v1(const char* destfile, int fin, const Marker& m,
+                             const rescue_options& opt) {
+    const size_t laststripesize = m.imagesize - m.stripesize*(m.nstripes-1);
+
+    std::cout << "note: image file has " << m.imagesize << " blocks"
+              << std::endl;
+    std::cout << "note: divided into " << m.nstripes << " stripes of "
+              << m.stripesize << " blocks each" << std::endl;
+    std::cout << "\tlast stripe has " << laststripesize << " blocks"
+              << std::endl;
+    std::cout << "\tparity offset by " << m.stripeoffset << " blocks"
+              << std::endl;
+
+    // one equation; parity follows the marker block, rotated by stripeoffset
+    std::vector<v2_item> items;
+    v2_item it;
+    memset(&it,0,sizeof(it));
+    it.eq[1] = -1;
+    it.kind = ITEM_STRIPE;
+    for (unsigned s = 0; s < m.nstripes; ++s) {
+        it.offset = s*m.stripesize;
+        it.blocks = s+1 < m.nstripes ? m.stripesize : laststripesize;
+        it.num = s;
+        items.push_back(it);
+    }
+    it.kind = ITEM_PARITY;
+    it.num = 0;
+    it.offset = m.imagesize + 1;
+    it.blocks = m.stripeoffset;
+    it.eq_offset = m.stripesize - m.stripeoffset;
+    if (it.blocks > 0)
+        items.push_back(it);
+    it.offset += it.blocks;
+    it.blocks = m.stripesize - m.stripeoffset;
+    it.eq_offset = 0;
+    if (it.blocks > 0)
+        items.push_back(it);
+
+    int fd;
+    const bool resume = opt.mapfile && access(opt.mapfile,F_OK) == 0;
+    const bool opened =
+        open_output(destfile,m.imagesize*m.blocksize,resume,fd);
+    const auto_file_descriptor fout(fd);
+    if (!opened)
+        return false;
+
+    Rescue r(fout,m.blocksize,m.imagesize,m.imagesize,items,
+             std::vector<uint64_t>(1,m.stripesize));
+    Reader reader(r,fin,m.imagesize,opt);
+    return reader.start(resume) && reader.run();
+}
+
+static bool recover_image(const char* destfile, const char* srcfile,
+                          const rescue_options& opt) {
+    // open src file
+    const auto_file_descriptor fin(open(srcfile,O_RDONLY|O_LARGEFILE));
+    if (fin == -1) {
+        std::cerr << "cdrrescue: " << strerror(errno)
+                  << " '" << srcfile << "'"
+                  << std::endl;
+        return false;
+    }
+
+    // v2 marker
+    v2_marker m2;
+    std::vector<char> marker2;
+    if (find_marker_v2_full(m2,marker2,fin)) {
+        const bool r = recover_image_v2(destfile,fin,m2,marker2,opt);
+        free_marker_v2(&m2);
+        return r;
+    }
+  
+    // find existing parity marker
+    Marker m;
+    if (!find_marker(m,fin)) {
+        std::cerr << "cdrrescue: marker not found" << std::endl;
+        return false;
+    }
+    return recover_image_v1(destfile,fin,m,opt);
+}
+
 static void usage(std::ostream& out) {
     out << "Usage:" << std::endl
-        << "  cdrrescue src_device output_file" << std::endl;
+        << "  cdrrescue [OPTIONS] src_device output_file" << std::endl
+        << "    -r n\tfailed reads to retry per region (default: 8)" << std::endl
+        << "    -m file\trescue state: saved every 30s, resumed if it exists" << std::endl
+        << "    -i image\tpartial image from ddrescue, with -M" << std::endl
+        << "    -M file\tddrescue mapfile of -i image" << std::endl;
 }
 
 
@@ -448,6 +1143,8 @@ int main(int argc, char*argv[]) {
         return -1;
     }
 
+    rescue_options opt = { 8, NULL, NULL, NULL };
+
     // parse options
     while (argc > 0 && argv[0][0] == '-') {
         if (!argv[0][1] || argv[0][2]) {
@@ -459,6 +1156,47 @@ int main(int argc, char*argv[]) {
         case '-':
             --argc; ++argv;
             break;
+
+        case 'r':
+            if (argc < 2) {
+                std::cerr << "cdrrescue: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            opt.retries = atoi(argv[1]);
+            --argc; ++argv;
+            break;
+
+        case 'm':
+            if (argc < 2) {
+                std::cerr << "cdrrescue: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            opt.mapfile = argv[1];
+            --argc; ++argv;
+            break;
+
+        case 'i':
+            if (argc < 2) {
+                std::cerr << "cdrrescue: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            opt.import_image = argv[1];
+            --argc; ++argv;
+            break;
+
+        case 'M':
+            if (argc < 2) {
+                std::cerr << "cdrrescue: argument missing value: " << argv[0]
+                          << std::endl;
+                return -1;
+            }
+            opt.import_map = argv[1];
+            --argc; ++argv;
+            break;
+
         default:
             std::cerr << "cdrrescue: invalid argument: " << argv[0]
                       << std::endl;
@@ -472,7 +1210,12 @@ int main(int argc, char*argv[]) {
         return -1;
     }
 
-    if (!recover_image(argv[1],argv[0]))
+    if (!opt.import_image != !opt.import_map) {
+        std::cerr << "cdrrescue: -i and -M go together" << std::endl;
+        return -1;
+    }
+
+    if (!recover_image(argv[1],argv[0],opt))
         return 1;
  
     return 0;
@@ -0,0 +1,801 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "large-io.h"
+#include "marker-v2.h"
+#include "siphash24.h"
+
+
+static constexpr auto MB = 1024*1024;
+
+namespace {
+    struct auto_file_descriptor {
+        const int fd;
+        explicit auto_file_descriptor(int fd) : fd(fd) {}
+        ~auto_file_descriptor() {
+            if (fd != -1) close(fd);
+        }
+        inline operator int() const {
+            return fd;
+        }
+    };
+
+    struct marker_zero {
+        uint32_t signature;
+        uint16_t block_log2;
+        uint16_t index;
+
+        uint64_t datetime;
+
+        uint32_t num_images;    // num_stripes in other layouts
+        uint32_t zero;          // first_blocks
+        uint32_t stripe_blocks; // hashed stripe size
+        uint32_t parity_blocks; // image_blocks
+
+        uint64_t parity_hash;   // zero
+    };
+    static_assert(sizeof(marker_zero) == 40, "unexpected marker size");
+
+    struct marker_one {
+        uint32_t signature;
+        uint16_t block_log2;
+        uint16_t index;
+    };
+
+    // hash of consecutive stripes of one file
+    struct stripe_hasher {
+        marker_zero key;        // first 16 bytes used as key
+        int64_t stripe_blocks;
+        int64_t total_blocks;
+        int64_t first_slot;
+        int64_t pos;            // blocks hashed so far
+        siphash_ctx ctx;
+        std::vector<uint64_t> hashes;
+    };
+
+    // one file of the set (or the parity), read by its own thread
+    struct reader {
+        std::string name;
+        int fd;
+        off64_t offset;         // bytes before image in file
+        int64_t bytes;
+        int64_t blocks;
+        stripe_hasher hasher;
+
+        // two buffers so reading continues while the other is xored
+        std::vector<unsigned char> buf[2];
+        bool full[2];
+        int error;
+        std::mutex lock;
+        std::condition_variable cv;
+        std::thread thread;
+    };
+}
+
+static int64_t div_up(int64_t a, int64_t b) {
+    return (a + b - 1) / b;
+}
+
+static unsigned ilog2(unsigned x) {
+    unsigned result = 0;
+    while (x >>= 1) ++result;
+    return result;
+}
+
+static void start_hasher(stripe_hasher& h, const marker_zero& m0,
+                         int64_t stripe_blocks, int64_t total_blocks,
+                         int64_t first_slot) {
+    memcpy(&h.key,&m0,sizeof(h.key));
+    h.stripe_blocks = stripe_blocks;
+    h.total_blocks = total_blocks;
+    h.first_slot = first_slot;
+    h.pos = 0;
+    h.hashes.assign(div_up(total_blocks,stripe_blocks),0);
+}
+
+// hash next blocks (ignoring any past the end)
+static void feed_hasher(stripe_hasher& h, const unsigned char* buf,
+                        int64_t blocks, int block_bytes) {
+    blocks = std::min(blocks,h.total_blocks - h.pos);
+    while (blocks > 0) {
+        const auto stripe = h.pos / h.stripe_blocks;
+        const auto in_stripe = h.pos % h.stripe_blocks;
+        if (in_stripe == 0) {
+            h.key.index = h.first_slot + stripe;
+            siphash_init(&h.ctx,&h.key);
+        }
+        const auto end = std::min((stripe+1)*h.stripe_blocks,h.total_blocks);
+        const auto n = std::min(blocks,end - h.pos);
+        siphash_update(&h.ctx,buf,n*block_bytes);
+        h.pos += n;
+        buf += n*block_bytes;
+        blocks -= n;
+        if (h.pos == end)
+            siphash_final(&h.ctx,&h.hashes[stripe]);
+    }
+}
+
+static bool read_at(int fd, void* buf, off64_t offset, size_t count) {
+    return lseek64(fd,offset,SEEK_SET) == offset &&
+        read_large(fd,buf,count) == ssize_t(count);
+}
+
+static bool write_at(int fd, const void* buf, off64_t offset, size_t count) {
+    if (lseek64(fd,offset,SEEK_SET) != offset ||
+        write_large(fd,buf,count) != ssize_t(count)) {
+        std::cerr << "cdrset: write failed (" << strerror(errno) << ")"
+                  << std::endl;
+        return false;
+    }
+    return true;
+}
+
+static uint64_t* hash_slot(std::vector<uint64_t>& marker,
+                           int64_t slot, int block_bytes) {
+    const int64_t per_block = block_bytes / sizeof(uint64_t);
+    const int64_t m0_lim = per_block - 6;
+    const int64_t mi_lim = per_block - 2;
+    if (slot < m0_lim)
+        return marker.data() + 5 + slot;
+    slot -= m0_lim;
+    return marker.data() + (1 + slot/mi_lim)*per_block + 1 + slot%mi_lim;
+}
+
+static int marker_blocks_for(int64_t num_slots, int block_bytes) {
+    const int64_t m0_lim = block_bytes / sizeof(uint64_t) - 6;
+    const int64_t mi_lim = block_bytes / sizeof(uint64_t) - 2;
+    return 1 + (num_slots > m0_lim ? div_up(num_slots - m0_lim,mi_lim) : 0);
+}
+
+static void hash_marker(std::vector<uint64_t>& marker,
+                        int marker_blocks, int block_bytes) {
+    auto& m0 = *reinterpret_cast<marker_zero*>(marker.data());
+    m0.index = 0;
+    for (int i = 1; i < marker_blocks; ++i) {
+        auto& mi = *reinterpret_cast<marker_one*>(
+            marker.data() + i * block_bytes / sizeof(uint64_t));
+        mi.signature = m0.signature;
+        mi.block_log2 = m0.block_log2;
+        mi.index = i;
+    }
+    static const uint8_t zero_key[SIPHASH_KEY_LENGTH] = {0};
+    for (int i = 0; i < marker_blocks; ++i) {
+        auto begin = marker.data() + i * block_bytes / sizeof(uint64_t);
+        siphash_ctx ctx;
+        siphash_init(&ctx,zero_key);
+        siphash_update(&ctx,begin,block_bytes-sizeof(uint64_t));
+        auto end = begin + (block_bytes / sizeof(uint64_t) - 1);
+        siphash_final(&ctx,end);
+    }
+}
+
+static void xor_into(void* _dest, const void* _src, size_t bytes) {
+    auto dest = static_cast<unsigned long*>(_dest);
+    auto src = static_cast<const unsigned long*>(_src);
+    for (size_t j = 0; j < bytes / sizeof(unsigned long); ++j)
+        dest[j] ^= src[j];
+}
+
+// reader thread: read and hash chunk after chunk, zero padded
+static void read_file(reader& r, int64_t rounds, int64_t chunk_blocks,
+                      int block_bytes, const std::atomic<bool>& stop) {
+    const int64_t chunk_bytes = chunk_blocks * block_bytes;
+    for (int64_t round = 0; round < rounds; ++round) {
+        const int b = round % 2;
+        {
+            std::unique_lock<std::mutex> lk(r.lock);
+            r.cv.wait(lk,[&]{ return !r.full[b] || stop; });
+            if (stop)
+                return;
+        }
+        auto& buf = r.buf[b];
+        const int64_t pos = round * chunk_bytes;
+        const int64_t n = std::max<int64_t>(0,std::min(chunk_bytes,
+                                                       r.bytes - pos));
+        if (n > 0 && !r.error &&
+            !read_at(r.fd,buf.data(),r.offset + pos,n))
+            r.error = errno ? errno : EIO;
+        memset(buf.data() + n,0,chunk_bytes - n);
+        feed_hasher(r.hasher,buf.data(),chunk_blocks,block_bytes);
+        {
+            std::lock_guard<std::mutex> lk(r.lock);
+            r.full[b] = true;
+        }
+        r.cv.notify_all();
+    }
+}
+
+// xor all files chunk by chunk, passing each result to done()
+template <typename F>
+static bool stream_files(std::vector<std::unique_ptr<reader>>& readers,
+                         int64_t total_blocks, int64_t chunk_blocks,
+                         int block_bytes, F done) {
+    const int64_t rounds = div_up(total_blocks,chunk_blocks);
+    std::atomic<bool> stop(false);
+    for (auto& r : readers) {
+        for (int b = 0; b < 2; ++b) {
+            r->buf[b].resize(chunk_blocks * block_bytes);
+            r->full[b] = false;
+        }
+        r->error = 0;
+        r->thread = std::thread(read_file,std::ref(*r),rounds,chunk_blocks,
+                                block_bytes,std::cref(stop));
+    }
+
+    std::vector<unsigned char> acc(chunk_blocks * block_bytes);
+    bool ok = true;
+    for (int64_t round = 0; ok && round < rounds; ++round) {
+        const int b = round % 2;
+        const auto pos = round * chunk_blocks;
+        std::cout << "reading block " << pos << " of " << total_blocks
+                  << "...   \r" << std::flush;
+        std::fill(acc.begin(),acc.end(),0);
+        for (auto& r : readers) {
+            std::unique_lock<std::mutex> lk(r->lock);
+            r->cv.wait(lk,[&]{ return r->full[b]; });
+            if (r->error) {
+                std::cerr << std::endl << "cdrset: read failed: " << r->name
+                          << " (" << strerror(r->error) << ")" << std::endl;
+                ok = false;
+                break;
+            }
+            xor_into(acc.data(),r->buf[b].data(),acc.size());
+            r->full[b] = false;
+            lk.unlock();
+            r->cv.notify_all();
+        }
+        if (ok)
+            ok = done(acc.data(),pos,std::min(chunk_blocks,total_blocks-pos));
+    }
+
+    stop = true;
+    for (auto& r : readers) {
+        {
+            std::lock_guard<std::mutex> lk(r->lock);
+        }
+        r->cv.notify_all();
+        r->thread.join();
+    }
+    if (ok)
+        std::cout << "reading done.                          " << std::endl;
+    return ok;
+}
+
+static bool open_reader(reader& r, const char* name, int block_bytes) {
+    r.name = name;
+    r.fd = open(name,O_RDONLY|O_LARGEFILE);
+    if (r.fd == -1) {
+        std::cerr << "cdrset: open failed: " << name
+                  << " (" << strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    struct stat64 s;
+    if (fstat64(r.fd,&s) != 0) {
+        std::cerr << "cdrset: stat failed: " << name
+                  << " (" << strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    r.offset = 0;
+    r.bytes = s.st_size;
+    r.blocks = div_up(r.bytes,block_bytes);
+    return true;
+}
+
+static void close_readers(std::vector<std::unique_ptr<reader>>& readers) {
+    for (auto& r : readers)
+        if (r && r->fd != -1) {
+            close(r->fd);
+            r->fd = -1;
+        }
+}
+
+// hash slots: image sizes, image stripes, parity stripes
+static int64_t first_stripe_slot(const std::vector<int64_t>& blocks,
+                                 size_t image, int64_t stripe_blocks) {
+    int64_t slot = blocks.size();
+    for (size_t i = 0; i < image; ++i)
+        slot += div_up(blocks[i],stripe_blocks);
+    return slot;
+}
+
+static bool create_set(const char* parity_file, char** images, int n,
+                       int block_bytes, int64_t stripe_blocks,
+                       int64_t chunk_blocks) {
+    std::vector<std::unique_ptr<reader>> readers;
+    std::vector<int64_t> blocks;
+    int64_t parity_blocks = 0;
+    for (int i = 0; i < n; ++i) {
+        readers.emplace_back(new reader);
+        if (!open_reader(*readers.back(),images[i],block_bytes)) {
+            close_readers(readers);
+            return false;
+        }
+        blocks.push_back(readers.back()->blocks);
+        parity_blocks = std::max(parity_blocks,blocks.back());
+        std::cout << "note: image #" << (i+1) << " " << images[i] << " has "
+                  << readers.back()->bytes << " bytes" << std::endl;
+    }
+    if (parity_blocks == 0) {
+        std::cerr << "cdrset: all images are empty" << std::endl;
+        close_readers(readers);
+        return false;
+    }
+
+    // parity size is stored in 32 bits
+    if ((parity_blocks>>32) != 0) {
+        std::cerr << "cdrset: largest image has " << parity_blocks
+                  << " blocks, at most 2^32-1 (use larger blocks)"
+                  << std::endl;
+        close_readers(readers);
+        return false;
+    }
+
+    // hash index is 16 bits: grow stripes until all hashes fit
+    int64_t num_slots;
+    for (;;) {
+        num_slots = first_stripe_slot(blocks,n,stripe_blocks)
+            + div_up(parity_blocks,stripe_blocks);
+        if (num_slots <= 0xffff)
+            break;
+        if (stripe_blocks >= parity_blocks) {
+            std::cerr << "cdrset: too many images (" << n << ")" << std::endl;
+            close_readers(readers);
+            return false;
+        }
+        stripe_blocks = std::min(2*stripe_blocks,parity_blocks);
+    }
+    const int marker_blocks = marker_blocks_for(num_slots,block_bytes);
+    const off64_t marker_bytes = off64_t(marker_blocks) * block_bytes;
+    std::cout << "note: parity has " << parity_blocks << " blocks, hashed in "
+              << "stripes of " << stripe_blocks << " blocks" << std::endl
+              << "\tmarker has " << marker_blocks << " blocks" << std::endl;
+
+    // marker
+    std::vector<uint64_t> marker(marker_bytes / sizeof(uint64_t));
+    auto& m0 = *reinterpret_cast<marker_zero*>(marker.data());
+    m0.signature = SIG;
+    m0.block_log2 = ilog2(block_bytes) | (LAYOUT_SET << 8);
+    m0.index = 0;
+    struct timeval tv;
+    if (gettimeofday(&tv, nullptr) != 0) {
+        std::cerr << "cdrset: gettimeofday (" << strerror(errno) << ")"
+                  << std::endl;
+        close_readers(readers);
+        return false;
+    }
+    m0.datetime = tv.tv_sec;
+    m0.datetime = (m0.datetime*(1000*1000) + tv.tv_usec)*1000;
+    m0.num_images = n;
+    m0.zero = 0;
+    m0.stripe_blocks = stripe_blocks;
+    m0.parity_blocks = parity_blocks;
+    m0.parity_hash = 0;
+    for (int i = 0; i < n; ++i) {
+        *hash_slot(marker,i,block_bytes) = readers[i]->bytes;
+        start_hasher(readers[i]->hasher,m0,stripe_blocks,blocks[i],
+                     first_stripe_slot(blocks,i,stripe_blocks));
+    }
+    stripe_hasher parity_hasher;
+    start_hasher(parity_hasher,m0,stripe_blocks,parity_blocks,
+                 first_stripe_slot(blocks,n,stripe_blocks));
+
+    const auto fd = auto_file_descriptor(
+        open(parity_file,O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE,0666));
+    if (fd == -1) {
+        std::cerr << "cdrset: open failed: " << parity_file
+                  << " (" << strerror(errno) << ")" << std::endl;
+        close_readers(readers);
+        return false;
+    }
+
+    const bool ok = stream_files(
+        readers,parity_blocks,chunk_blocks,block_bytes,
+        [&](const unsigned char* parity, int64_t pos, int64_t n) {
+            feed_hasher(parity_hasher,parity,n,block_bytes);
+            return write_at(fd,parity,marker_bytes + pos*block_bytes,
+                            n*block_bytes);
+        });
+    if (!ok) {
+        close_readers(readers);
+        return false;
+    }
+
+    // store hashes and write both markers
+    for (const auto& r : readers)
+        for (size_t s = 0; s < r->hasher.hashes.size(); ++s)
+            *hash_slot(marker,r->hasher.first_slot + s,block_bytes) =
+                r->hasher.hashes[s];
+    for (size_t s = 0; s < parity_hasher.hashes.size(); ++s)
+        *hash_slot(marker,parity_hasher.first_slot + s,block_bytes) =
+            parity_hasher.hashes[s];
+    hash_marker(marker,marker_blocks,block_bytes);
+    close_readers(readers);
+    std::cout << "writing marker..." << std::endl;
+    if (!write_at(fd,marker.data(),0,marker_bytes) ||
+        !write_at(fd,marker.data(),
+                  marker_bytes + parity_blocks*block_bytes,marker_bytes))
+        return false;
+    std::cout << "done." << std::endl;
+    return true;
+}
+
+// marker copy at pos, sized by the image sizes in it
+static bool read_marker_at(std::vector<uint64_t>& marker, int& block_bytes,
+                           int fd, off64_t pos) {
+    marker_zero head;
+    if (!read_at(fd,&head,pos,sizeof(head)))
+        return false;
+    const unsigned block_log2 = head.block_log2 & 0xff;
+    if (head.signature != SIG || (head.block_log2 >> 8) != LAYOUT_SET ||
+        head.index != 0 || block_log2 < 6 || block_log2 > 20 ||
+        head.num_images < 1 || head.num_images > 0xffff ||
+        head.stripe_blocks < 1 || head.parity_blocks < 1)
+        return false;
+    block_bytes = 1 << block_log2;
+
+    // image sizes are in the first hash slots
+    const int size_blocks = marker_blocks_for(head.num_images,block_bytes);
+    marker.resize(size_blocks * block_bytes / sizeof(uint64_t));
+    if (!read_at(fd,marker.data(),pos,size_blocks * block_bytes))
+        return false;
+    int64_t num_slots = head.num_images;
+    for (int64_t i = 0; i < head.num_images && num_slots <= 0xffff; ++i) {
+        const auto bytes = *hash_slot(marker,i,block_bytes);
+        num_slots += div_up(div_up(bytes,block_bytes),head.stripe_blocks);
+    }
+    num_slots += div_up(head.parity_blocks,head.stripe_blocks);
+    if (num_slots > 0xffff)
+        return false;
+    const int marker_blocks = marker_blocks_for(num_slots,block_bytes);
+    marker.resize(off64_t(marker_blocks) * block_bytes / sizeof(uint64_t));
+    return read_at(fd,marker.data(),pos,marker.size() * sizeof(uint64_t));
+}
+
+static bool marker_hash_good(const std::vector<uint64_t>& marker,
+                             int block_bytes) {
+    auto check = marker;
+    hash_marker(check,check.size() * sizeof(uint64_t) / block_bytes,
+                block_bytes);
+    return check == marker;
+}
+
+// marker #2 ends the file: scan back for its block 0
+static bool find_marker_2(std::vector<uint64_t>& marker, int& block_bytes,
+                          int fd) {
+    const off64_t end = lseek64(fd,0,SEEK_END);
+    if (end == off64_t(-1))
+        return false;
+    std::vector<uint64_t> buf(MB / sizeof(uint64_t));
+    const auto* bytes = reinterpret_cast<const char*>(buf.data());
+    for (off64_t pos = end; pos > 0 && end - pos < 16*MB; ) {
+        const off64_t len = std::min<off64_t>(pos, MB);
+        pos -= len;
+        if (!read_at(fd,buf.data(),pos,len))
+            return false;
+        // blocks are at least 64 bytes, counted back from the end
+        for (off64_t k = len - 64; k >= 0; k -= 64) {
+            marker_zero head;
+            memcpy(&head,bytes + k,sizeof(head));
+            if (head.signature == SIG && head.index == 0 &&
+                read_marker_at(marker,block_bytes,fd,pos + k) &&
+                pos + k + off64_t(marker.size() * sizeof(uint64_t)) == end)
+                return true;
+        }
+    }
+    return false;
+}
+
+// read marker of parity file
+static bool read_set_marker(std::vector<uint64_t>& marker, int& block_bytes,
+                            int fd) {
+    const bool found = read_marker_at(marker,block_bytes,fd,0);
+    if (found && marker_hash_good(marker,block_bytes)) {
+        const auto& m0 = *reinterpret_cast<const marker_zero*>(marker.data());
+        const off64_t marker_bytes = marker.size() * sizeof(uint64_t);
+        std::vector<uint64_t> copy(marker.size());
+        if (!read_at(fd,copy.data(),
+                     marker_bytes + off64_t(m0.parity_blocks)*block_bytes,
+                     marker_bytes) || copy != marker)
+            std::cout << "note: marker #2 CORRUPT, using marker #1"
+                      << std::endl;
+        return true;
+    }
+
+    // sizes of marker #1 cannot be trusted, find marker #2 on its own
+    std::vector<uint64_t> copy;
+    int copy_block_bytes;
+    if (!find_marker_2(copy,copy_block_bytes,fd)) {
+        if (found)
+            std::cerr << "cdrset: marker #1 CORRUPT, marker #2 not found"
+                      << std::endl;
+        else
+            std::cerr << "cdrset: not a parity set file" << std::endl;
+        return false;
+    }
+    std::cerr << "cdrset: marker #1 CORRUPT" << std::endl;
+    if (!marker_hash_good(copy,copy_block_bytes)) {
+        std::cerr << "cdrset: marker #2 CORRUPT" << std::endl;
+        return false;
+    }
+    marker.swap(copy);
+    block_bytes = copy_block_bytes;
+    return true;
+}
+
+// verify set, or rebuild the image given as "-" into output
+static bool check_set(const char* parity_file, char** images, int n,
+                      const char* output, size_t buffer_bytes) {
+    const auto pfd = auto_file_descriptor(open(parity_file,O_RDONLY|O_LARGEFILE));
+    if (pfd == -1) {
+        std::cerr << "cdrset: open failed: " << parity_file
+                  << " (" << strerror(errno) << ")" << std::endl;
+        return false;
+    }
+    std::vector<uint64_t> marker;
+    int block_bytes;
+    if (!read_set_marker(marker,block_bytes,pfd))
+        return false;
+    const auto& m0 = *reinterpret_cast<const marker_zero*>(marker.data());
+    const int64_t stripe_blocks = m0.stripe_blocks;
+    const int64_t parity_blocks = m0.parity_blocks;
+    const off64_t marker_bytes =
+        off64_t(marker.size()) * sizeof(uint64_t);
+    if (n != int(m0.num_images)) {
+        std::cerr << "cdrset: parity is for " << m0.num_images
+                  << " images, " << n << " given" << std::endl;
+        return false;
+    }
+    const int64_t chunk_blocks =
+        std::max<int64_t>(1,buffer_bytes / block_bytes);
+
+    std::vector<int64_t> blocks;
+    std::vector<int64_t> bytes;
+    for (int i = 0; i < n; ++i) {
+        bytes.push_back(*hash_slot(marker,i,block_bytes));
+        blocks.push_back(div_up(bytes.back(),block_bytes));
+    }
+
+    // one reader per image present, plus parity
+    std::vector<std::unique_ptr<reader>> readers;
+    int missing = -1;
+    for (int i = 0; i < n; ++i) {
+        if (strcmp(images[i],"-") == 0) {
+            if (missing >= 0) {
+                std::cerr << "cdrset: only one image can be rebuilt"
+                          << std::endl;
+                close_readers(readers);
+                return false;
+            }
+            missing = i;
+            continue;
+        }
+        readers.emplace_back(new reader);
+        auto& r = *readers.back();
+        if (!open_reader(r,images[i],block_bytes)) {
+            close_readers(readers);
+            return false;
+        }
+        if (r.bytes != bytes[i]) {
+            std::cerr << "cdrset: image #" << (i+1) << " " << images[i]
+                      << " has " << r.bytes << " bytes, expected "
+                      << bytes[i] << std::endl;
+            close_readers(readers);
+            return false;
+        }
+        start_hasher(r.hasher,m0,stripe_blocks,blocks[i],
+                     first_stripe_slot(blocks,i,stripe_blocks));
+    }
+    if (output && missing < 0) {
+        std::cerr << "cdrset: no image to rebuild (give it as -)"
+                  << std::endl;
+        close_readers(readers);
+        return false;
+    }
+    if (!output && missing >= 0) {
+        std::cerr << "cdrset: image #" << (missing+1) << " missing"
+                  << " (use -o to rebuild)" << std::endl;
+        close_readers(readers);
+        return false;
+    }
+    readers.emplace_back(new reader);
+    auto& pr = *readers.back();
+    pr.name = parity_file;
+    pr.fd = dup(pfd);
+    pr.offset = marker_bytes;
+    pr.bytes = parity_blocks * block_bytes;
+    pr.blocks = parity_blocks;
+    start_hasher(pr.hasher,m0,stripe_blocks,parity_blocks,
+                 first_stripe_slot(blocks,n,stripe_blocks));
+
+    // output for rebuilt image
+    auto_file_descriptor ofd(output ?
+        open(output,O_WRONLY|O_CREAT|O_TRUNC|O_LARGEFILE,0666) : -1);
+    if (output && ofd == -1) {
+        std::cerr << "cdrset: open failed: " << output
+                  << " (" << strerror(errno) << ")" << std::endl;
+        close_readers(readers);
+        return false;
+    }
+    stripe_hasher rebuilt;
+    if (missing >= 0)
+        start_hasher(rebuilt,m0,stripe_blocks,blocks[missing],
+                     first_stripe_slot(blocks,missing,stripe_blocks));
+
+    int64_t parity_errors = 0;
+    const bool ok = stream_files(
+        readers,parity_blocks,chunk_blocks,block_bytes,
+        [&](const unsigned char* acc, int64_t pos, int64_t n) {
+            if (missing < 0) {
+                for (int64_t j = 0; j < n*block_bytes; ++j)
+                    parity_errors += acc[j] != 0;
+                return true;
+            }
+            feed_hasher(rebuilt,acc,n,block_bytes);
+            const auto end = std::min<int64_t>(
+                (pos+n)*block_bytes,bytes[missing]);
+            if (end <= pos*block_bytes)
+                return true;
+            return write_at(ofd,acc,pos*block_bytes,end - pos*block_bytes);
+        });
+    close_readers(readers);
+    if (!ok)
+        return false;
+
+    // compare hashes
+    int bad = 0;
+    auto check = [&](const stripe_hasher& h, const std::string& name) {
+        for (size_t s = 0; s < h.hashes.size(); ++s)
+            if (h.hashes[s] != *hash_slot(marker,h.first_slot + s,block_bytes)) {
+                std::cout << name << " stripe #" << (s+1) << " CORRUPT."
+                          << std::endl;
+                ++bad;
+            }
+    };
+    for (size_t i = 0, k = 0; i < size_t(n); ++i)
+        if (int(i) != missing) {
+            check(readers[k]->hasher,"image #" + std::to_string(i+1));
+            ++k;
+        }
+    check(pr.hasher,"parity");
+    if (missing >= 0) {
+        const int before = bad;
+        check(rebuilt,"rebuilt image #" + std::to_string(missing+1));
+        if (bad)
+            std::cout << "rebuild FAILED." << std::endl;
+        else
+            std::cout << "image #" << (missing+1) << " rebuilt and verified."
+                      << std::endl;
+        return bad == 0 && before == 0;
+    }
+    if (bad)
+        std::cout << bad << " stripes CORRUPT." << std::endl;
+    else if (parity_errors)
+        std::cout << "INVALID PARITY (" << parity_errors << " errors)"
+                  << std::endl;
+    else
+        std::cout << "valid parity." << std::endl;
+    return bad == 0 && parity_errors == 0;
+}
+
+static off64_t parse_size(const char* s) {
+    char* end;
+    off64_t result = strtol(s,&end,10);
+    if (strcasecmp(end,"k") == 0)
+        result *= 1024;
+    else if (strcasecmp(end,"m") == 0)
+        result *= 1024*1024;
+    return result;
+}
+
+static void usage(std::ostream& out) {
+    out << "Usage:" << std::endl
+        << "  cdrset [OPTIONS] parity_file image ..." << std::endl
+        << "    -b size\tset block size (default: 2k)" << std::endl
+        << "    -B size\tread size per image (default: 4M)" << std::endl
+        << "    -H size\thashed stripe size (default: 16M)" << std::endl
+        << "    -v  \tverify images against parity" << std::endl
+        << "    -o file\trebuild the image given as - into file" << std::endl;
+}
+
+int main(int argc, char*argv[]) {
+    ++argv; --argc;
+    if (argc < 1) {
+        usage(std::cout);
+        return -1;
+    }
+
+    off_t block_size = 2048;
+    off_t buffer_size = 4*MB;
+    off_t stripe_size = 16*MB;
+    auto verify = false;
+    const char* output = nullptr;
+
+    // parse options
+    while (argc > 0 && argv[0][0] == '-' && argv[0][1]) {
+        if (argv[0][2]) {
+            std::cerr << "cdrset: invalid argument: " << argv[0]
+                      << std::endl;
+            return -1;
+        }
+        const char opt = argv[0][1];
+        if (opt == '-') {
+            --argc; ++argv;
+            break;
+        }
+        if (opt == 'v') {
+            verify = true;
+            --argc; ++argv;
+            continue;
+        }
+        if (argc < 2 || !strchr("bBHo",opt)) {
+            std::cerr << "cdrset: invalid argument: " << argv[0]
+                      << std::endl;
+            return -1;
+        }
+        if (opt == 'b')
+            block_size = parse_size(argv[1]);
+        else if (opt == 'B')
+            buffer_size = parse_size(argv[1]);
+        else if (opt == 'H')
+            stripe_size = parse_size(argv[1]);
+        else
+            output = argv[1];
+        argc -= 2; argv += 2;
+    }
+
+    if (argc < 2) {
+        std::cerr << "cdrset: need parity file and at least one image"
+                  << std::endl;
+        return -1;
+    }
+    if (block_size < 64 || (block_size & (block_size-1)) || block_size > MB) {
+        std::cerr << "cdrset: invalid block size: " << block_size
+                  << std::endl;
+        return -1;
+    }
+    if (buffer_size < block_size || stripe_size < block_size) {
+        std::cerr << "cdrset: buffer and stripe size must be at least "
+                  << "one block" << std::endl;
+        return -1;
+    }
+
+    if (verify || output)
+        return check_set(argv[0],argv+1,argc-1,output,buffer_size) ? 0 : 1;
+    return create_set(argv[0],argv+1,argc-1,block_size,
+                      stripe_size / block_size,
+                      buffer_size / block_size) ? 0 : 1;
+}
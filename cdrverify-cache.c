@@ -0,0 +1,136 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "cdrverify.h"
+
+/* State file of images verified earlier, one line per image:
+ *   dev ino size mtime ctime date_time parity_hash verified name
+ * (times in ns, verified in seconds since the epoch).  Any change to the
+ * file (or a new marker) gives a different key.  An extended attribute
+ * is not used since setting it would change ctime.
+ */
+
+void cache_key(struct cache_key* key, const struct stat* s,
+               const void* marker) {
+    memset(key,0,sizeof(*key));
+    key->dev = s->st_dev;
+    key->ino = s->st_ino;
+    key->size = s->st_size;
+    key->mtime = s->st_mtim.tv_sec * 1000000000ULL + s->st_mtim.tv_nsec;
+    key->ctime = s->st_ctim.tv_sec * 1000000000ULL + s->st_ctim.tv_nsec;
+    memcpy(&key->date_time,(const char*)marker + 8,8);
+    memcpy(&key->parity_hash,(const char*)marker + 32,8);
+}
+
+static int parse_line(const char* line, struct cache_key* key,
+                      long long* verified, int* name_ofs) {
+    unsigned long long v[7];
+    if (sscanf(line,"%llu %llu %llu %llu %llu %llx %llx %lld %n",
+               &v[0],&v[1],&v[2],&v[3],&v[4],&v[5],&v[6],
+               verified,name_ofs) < 8)
+        return 0;
+    memset(key,0,sizeof(*key));
+    key->dev = v[0];
+    key->ino = v[1];
+    key->size = v[2];
+    key->mtime = v[3];
+    key->ctime = v[4];
+    key->date_time = v[5];
+    key->parity_hash = v[6];
+    return 1;
+}
+
+// time of last successful verify with this key, 0 if none or too old
+time_t cache_lookup(const char* file, const struct cache_key* key,
+                    long max_age) {
+    FILE* f = fopen(file,"r");
+    if (!f)
+        return 0;
+    time_t r = 0;
+    char line[4096];
+    while (fgets(line,sizeof(line),f)) {
+        struct cache_key k;
+        long long verified;
+        int name_ofs;
+        if (parse_line(line,&k,&verified,&name_ofs) &&
+            memcmp(&k,key,sizeof(k)) == 0 &&
+            (max_age <= 0 || time(NULL) - verified <= max_age))
+            r = verified;
+    }
+    fclose(f);
+    return r;
+}
+
+// discs verified in parallel finish at any time
+static pthread_mutex_t store_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int store(const char* file, const struct cache_key* key,
+                 const char* name) {
+    const size_t len = strlen(file);
+    char* tmp = malloc(len + 5);
+    memcpy(tmp,file,len);
+    strcpy(tmp + len,".tmp");
+    FILE* out = fopen(tmp,"w");
+    if (!out) {
+        fprintf(stderr,"cdrverify: failed to create %s (%s)\n",tmp,strerror(errno));
+        free(tmp);
+        return 1;
+    }
+    FILE* in = fopen(file,"r");
+    if (in) {
+        char line[4096];
+        while (fgets(line,sizeof(line),in)) {
+            struct cache_key k;
+            long long verified;
+            int name_ofs;
+            if (parse_line(line,&k,&verified,&name_ofs) &&
+                k.dev == key->dev && k.ino == key->ino)
+                continue;
+            fputs(line,out);
+        }
+        fclose(in);
+    }
+    fprintf(out,"%llu %llu %llu %llu %llu %016llx %016llx %lld %s\n",
+            (unsigned long long)key->dev, (unsigned long long)key->ino,
+            (unsigned long long)key->size, (unsigned long long)key->mtime,
+            (unsigned long long)key->ctime,
+            (unsigned long long)key->date_time,
+            (unsigned long long)key->parity_hash,
+            (long long)time(NULL), name);
+    int r = 0;
+    if (fclose(out) != 0 || rename(tmp,file) != 0) {
+        fprintf(stderr,"cdrverify: failed to write %s (%s)\n",file,strerror(errno));
+        r = 1;
+    }
+    free(tmp);
+    return r;
+}
+
+// record successful verify, replacing any earlier entry for the image
+int cache_store(const char* file, const struct cache_key* key,
+                const char* name) {
+    pthread_mutex_lock(&store_lock);
+    const int r = store(file,key,name);
+    pthread_mutex_unlock(&store_lock);
+    return r;
+}
@@ -0,0 +1,244 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/sysmacros.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cdrverify.h"
+
+/* Several devices at once: the devices are grouped by the drive that
+ * holds them, and each drive gets one reader thread that verifies its
+ * devices one after another, so no drive is asked for two streams at
+ * once.  All readers share one pool of hashing threads, which work on
+ * whichever device has data ready.  The report of each device is printed
+ * when it is done; meanwhile a progress line shows every device.
+ */
+
+struct device {
+    const char* name;
+    dev_t drive;
+    struct verify_progress progress;
+    int state;              // 0 waiting, 1 reading, 2 done
+    int result;
+};
+
+struct farm {
+    const struct verify_options* opt;
+    struct hash_pool* pool;
+    struct device* devices;
+    int num_devices;
+    pthread_mutex_t lock;   // stdout and device state
+    pthread_cond_t cond;
+    int remaining;
+    int progress_shown;
+};
+
+struct drive {
+    struct farm* farm;
+    int* devices;           // indices, in command line order
+    int num_devices;
+    pthread_t thread;
+};
+
+// read "major:minor" from a sysfs file, 0 if none
+static dev_t sysfs_dev(const char* path) {
+    unsigned a, b;
+    FILE* f = fopen(path,"r");
+    if (!f)
+        return 0;
+    const int n = fscanf(f,"%u:%u",&a,&b);
+    fclose(f);
+    return n == 2 ? makedev(a,b) : 0;
+}
+
+/* Drive holding a disc drive, partition, loop device or image file: a
+ * partition belongs to its disk, a loop device to the drive holding its
+ * backing file.
+ */
+static dev_t drive_of(const struct stat* s) {
+    dev_t d = S_ISBLK(s->st_mode) || S_ISCHR(s->st_mode) ?
+        s->st_rdev : s->st_dev;
+    char path[4096];
+    snprintf(path,sizeof(path),"/sys/dev/block/%u:%u/loop/backing_file",
+             major(d),minor(d));
+    FILE* f = fopen(path,"r");
+    if (f) {
+        struct stat b;
+        char file[4096];
+        if (fgets(file,sizeof(file),f)) {
+            file[strcspn(file,"\n")] = 0;
+            if (stat(file,&b) == 0)
+                d = b.st_dev;
+        }
+        fclose(f);
+    }
+    snprintf(path,sizeof(path),"/sys/dev/block/%u:%u/partition",
+             major(d),minor(d));
+    if (access(path,F_OK) == 0) {
+        snprintf(path,sizeof(path),"/sys/dev/block/%u:%u/../dev",
+                 major(d),minor(d));
+        const dev_t disk = sysfs_dev(path);
+        if (disk)
+            d = disk;
+    }
+    return d;
+}
+
+// one line for all devices being read (lock held)
+static void show_progress(struct farm* f) {
+    char line[256];
+    size_t n = 0;
+    int i, waiting = 0, done = 0;
+    line[0] = 0;
+    for (i = 0; i < f->num_devices; ++i) {
+        const struct device* d = &f->devices[i];
+        if (d->state == 0)
+            ++waiting;
+        else if (d->state == 2)
+            ++done;
+        else if (n < sizeof(line)) {
+            const uint64_t total =
+                __atomic_load_n(&d->progress.total,__ATOMIC_RELAXED);
+            const uint64_t bytes =
+                __atomic_load_n(&d->progress.bytes,__ATOMIC_RELAXED);
+            n += snprintf(line + n, sizeof(line) - n, "%s %.0f%%  ", d->name,
+                          total ? 100.0 * bytes / total : 0.0);
+        }
+    }
+    printf("\r%s(%d waiting, %d done)    ",line,waiting,done);
+    fflush(stdout);
+    f->progress_shown = 1;
+}
+
+static void clear_progress(struct farm* f) {
+    if (f->progress_shown)
+        printf("\r%79s\r","");
+    f->progress_shown = 0;
+}
+
+static void* verify_drive(void* arg) {
+    struct drive* dr = arg;
+    struct farm* f = dr->farm;
+    int i;
+    for (i = 0; i < dr->num_devices; ++i) {
+        struct device* d = &f->devices[dr->devices[i]];
+        char* text = NULL;
+        size_t len = 0;
+        FILE* log = open_memstream(&text,&len);
+        struct verify_options opt = *f->opt;
+        opt.out = log ? log : stdout;
+        opt.pool = f->pool;
+        opt.progress = &d->progress;
+
+        pthread_mutex_lock(&f->lock);
+        d->state = 1;
+        pthread_mutex_unlock(&f->lock);
+
+        const int r = verify_device(d->name,&opt);
+        if (log)
+            fclose(log);
+
+        pthread_mutex_lock(&f->lock);
+        clear_progress(f);
+        printf("==> %s <==\n%s%s: %s\n\n", d->name, text ? text : "",
+               d->name, r ? "FAILED" : "good");
+        fflush(stdout);
+        d->state = 2;
+        d->result = r;
+        --f->remaining;
+        pthread_cond_broadcast(&f->cond);
+        pthread_mutex_unlock(&f->lock);
+        free(text);
+    }
+    return NULL;
+}
+
+int verify_farm(char* const* names, int n, const struct verify_options* opt) {
+    struct farm f;
+    memset(&f,0,sizeof(f));
+    f.opt = opt;
+    f.devices = calloc(n, sizeof(struct device));
+    f.num_devices = n;
+    f.remaining = n;
+    pthread_mutex_init(&f.lock,NULL);
+    pthread_cond_init(&f.cond,NULL);
+
+    // group devices by drive
+    struct drive* drives = calloc(n, sizeof(struct drive));
+    int num_drives = 0, i, j;
+    for (i = 0; i < n; ++i) {
+        struct stat s;
+        f.devices[i].name = names[i];
+        f.devices[i].drive = stat(names[i],&s) == 0 ? drive_of(&s) : 0;
+        for (j = 0; j < num_drives; ++j)
+            if (f.devices[drives[j].devices[0]].drive == f.devices[i].drive)
+                break;
+        if (j == num_drives) {
+            drives[j].farm = &f;
+            drives[j].devices = malloc(n * sizeof(int));
+            ++num_drives;
+        }
+        drives[j].devices[drives[j].num_devices++] = i;
+    }
+    const unsigned threads = opt->threads > 0 ? opt->threads : 1;
+    printf("verifying %d devices on %d drives (%u hashing threads)\n\n",
+           n, num_drives, threads);
+    fflush(stdout);
+
+    f.pool = pool_start(threads);
+    for (j = 0; j < num_drives; ++j)
+        pthread_create(&drives[j].thread,NULL,verify_drive,&drives[j]);
+
+    const int tty = isatty(STDOUT_FILENO);
+    pthread_mutex_lock(&f.lock);
+    while (f.remaining > 0) {
+        if (tty)
+            show_progress(&f);
+        struct timespec t;
+        clock_gettime(CLOCK_REALTIME,&t);
+        ++t.tv_sec;
+        pthread_cond_timedwait(&f.cond,&f.lock,&t);
+    }
+    clear_progress(&f);
+    pthread_mutex_unlock(&f.lock);
+
+    for (j = 0; j < num_drives; ++j) {
+        pthread_join(drives[j].thread,NULL);
+        free(drives[j].devices);
+    }
+    pool_stop(f.pool);
+
+    int good = 0;
+    for (i = 0; i < n; ++i)
+        good += f.devices[i].result == 0;
+    printf("%d of %d devices good.\n",good,n);
+    for (i = 0; i < n; ++i)
+        if (f.devices[i].result)
+            printf("  %s FAILED\n",f.devices[i].name);
+
+    free(drives);
+    free(f.devices);
+    pthread_mutex_destroy(&f.lock);
+    pthread_cond_destroy(&f.cond);
+    return good != n;
+}
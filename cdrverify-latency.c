@@ -0,0 +1,167 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "cdrverify.h"
+#include "marker-v2.h"
+
+#define LATENCY_RANGE (16*1024*1024)    // bytes per heatmap row
+
+/* Read latency by position on disc.  Every read of the verify pass is
+ * timed; each heatmap row covers LATENCY_RANGE bytes and the histogram
+ * counts reads by latency (powers of two, in microseconds).  Rows with
+ * a read slower than the threshold are reported as slow, together with
+ * the state of the regions they overlap.
+ */
+
+void latency_init(struct latency_map* lm, off_t device_bytes) {
+    memset(lm,0,sizeof(*lm));
+    lm->num_rows = (device_bytes + LATENCY_RANGE - 1) / LATENCY_RANGE;
+    lm->rows = calloc(lm->num_rows ? lm->num_rows : 1, sizeof(*lm->rows));
+}
+
+void latency_free(struct latency_map* lm) {
+    free(lm->rows);
+    lm->rows = NULL;
+}
+
+uint64_t latency_now(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC,&t);
+    return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+void latency_add(struct latency_map* lm, off_t ofs, size_t bytes,
+                 uint64_t ns) {
+    const size_t row = ofs / LATENCY_RANGE;
+    if (row >= lm->num_rows)
+        return;
+    struct latency_row* r = &lm->rows[row];
+    ++r->reads;
+    r->bytes += bytes;
+    r->ns += ns;
+    if (ns > r->max_ns)
+        r->max_ns = ns;
+
+    unsigned h = 0;
+    uint64_t us = ns / 1000;
+    while (us > 1 && h + 1 < LATENCY_BINS) {
+        us >>= 1;
+        ++h;
+    }
+    ++lm->histogram[h];
+}
+
+// "stripe #3 good, parity tile #2 CORRUPT" for regions overlapping a row
+static void print_regions(FILE* f, const struct v2_marker* m, const int* bad,
+                          const int* checked, off_t a, off_t b,
+                          const char* sep) {
+    unsigned i;
+    int first = 1;
+    for (i = 0; i < m->num_items; ++i) {
+        const struct v2_item* item = &m->items[i];
+        const off_t ia = item->offset * m->block_bytes;
+        const off_t ib = ia + item->blocks * m->block_bytes;
+        if (ia >= b || ib <= a)
+            continue;
+        fprintf(f,"%s%s %s", first ? "" : sep, item_name(m,item),
+                !checked[i] ? "unchecked" : bad[i] ? "CORRUPT" : "good");
+        first = 0;
+    }
+}
+
+int latency_report(FILE* out, const struct latency_map* lm,
+                   const struct v2_marker* m,
+                   const int* bad, const int* checked,
+                   const char* file, unsigned slow_ms) {
+    size_t k;
+    const uint64_t slow_ns = slow_ms * 1000000ULL;
+    for (k = 0; k < lm->num_rows; ++k) {
+        const struct latency_row* r = &lm->rows[k];
+        if (r->max_ns < slow_ns)
+            continue;
+        fprintf(out,"slow %ld %ld (%.0f ms): ", (long)(k*LATENCY_RANGE),
+               (long)((k+1)*LATENCY_RANGE), r->max_ns / 1e6);
+        print_regions(out,m,bad,checked,k*(off_t)LATENCY_RANGE,
+                      (k+1)*(off_t)LATENCY_RANGE,", ");
+        fprintf(out,"\n");
+    }
+    if (!file)
+        return 0;
+
+    FILE* f = fopen(file,"w");
+    if (!f) {
+        fprintf(stderr,"cdrverify: failed to create %s (%s)\n",file,strerror(errno));
+        return 1;
+    }
+    const size_t len = strlen(file);
+    const int json = len >= 5 && strcmp(file + len - 5,".json") == 0;
+    fprintf(f, json ? "{\"rows\": [\n" :
+            "start,end,reads,bytes,seconds,max_ms,mb_per_s,slow,regions\n");
+    for (k = 0; k < lm->num_rows; ++k) {
+        const struct latency_row* r = &lm->rows[k];
+        const off_t a = k*(off_t)LATENCY_RANGE;
+        const off_t b = a + LATENCY_RANGE;
+        const double rate = r->ns ? r->bytes * 1e3 / r->ns : 0;
+        if (json) {
+            fprintf(f,"  {\"start\": %ld, \"end\": %ld, \"reads\": %lu, "
+                    "\"bytes\": %lu, \"seconds\": %.6f, \"max_ms\": %.3f, "
+                    "\"mb_per_s\": %.2f, \"slow\": %s, \"regions\": \"",
+                    (long)a, (long)b, (unsigned long)r->reads,
+                    (unsigned long)r->bytes, r->ns / 1e9, r->max_ns / 1e6,
+                    rate, r->max_ns >= slow_ns ? "true" : "false");
+            print_regions(f,m,bad,checked,a,b,"; ");
+            fprintf(f,"\"}%s\n", k + 1 < lm->num_rows ? "," : "");
+        }
+        else {
+            fprintf(f,"%ld,%ld,%lu,%lu,%.6f,%.3f,%.2f,%d,\"",
+                    (long)a, (long)b, (unsigned long)r->reads,
+                    (unsigned long)r->bytes, r->ns / 1e9, r->max_ns / 1e6,
+                    rate, r->max_ns >= slow_ns);
+            print_regions(f,m,bad,checked,a,b,"; ");
+            fprintf(f,"\"\n");
+        }
+    }
+
+    // histogram bin h holds reads of [2^h, 2^(h+1)) us (bin 0 from 0)
+    unsigned h, last = 0;
+    for (h = 0; h < LATENCY_BINS; ++h)
+        if (lm->histogram[h])
+            last = h;
+    fprintf(f, json ? "],\n\"histogram\": [\n" :
+            "\nmin_us,max_us,reads\n");
+    for (h = 0; h <= last; ++h) {
+        const unsigned long lo = h ? 1ul << h : 0, hi = 2ul << h;
+        if (json)
+            fprintf(f,"  {\"min_us\": %lu, \"max_us\": %lu, \"reads\": %lu}%s\n",
+                    lo, hi, (unsigned long)lm->histogram[h],
+                    h < last ? "," : "");
+        else
+            fprintf(f,"%lu,%lu,%lu\n", lo, hi,
+                    (unsigned long)lm->histogram[h]);
+    }
+    if (json)
+        fprintf(f,"]}\n");
+    if (fclose(f) != 0) {
+        fprintf(stderr,"cdrverify: failed to write %s (%s)\n",file,strerror(errno));
+        return 1;
+    }
+    return 0;
+}
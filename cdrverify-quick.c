@@ -0,0 +1,314 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "cdrverify.h"
+#include "marker-v2.h"
+#include "volume.h"
+
+#define CHUNK (1024*1024)
+
+/* Quick verify: both markers, the parity regions and a random sample of
+ * the other regions are checked against their hashes.  The parity
+ * equations are not checked.  Regions overlapping byte ranges listed in
+ * the hint file (slow or failed areas from earlier runs) are sampled
+ * first.  To verify a single file, only the regions holding the file's
+ * extents are checked.
+ */
+
+static uint64_t splitmix64(uint64_t* state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+/* byte ranges "start end" per line, '#' starts a comment; or the CSV
+ * written by cdrverify -L, of which the slow rows are taken */
+static size_t read_hints(const char* file, off_t** hints) {
+    FILE* f = fopen(file,"r");
+    if (!f) {
+        fprintf(stderr,"cdrverify: failed to open %s (%s)\n",file,strerror(errno));
+        return 0;
+    }
+    size_t n = 0, max = 0;
+    char line[256];
+    while (fgets(line,sizeof(line),f)) {
+        long long a, b;
+        int slow;
+        if (line[0] == '#')
+            continue;
+        if (sscanf(line,"%lli,%lli,%*u,%*u,%*f,%*f,%*f,%d",&a,&b,&slow) == 3) {
+            if (!slow)
+                continue;
+        }
+        else if (sscanf(line,"%lli %lli",&a,&b) != 2)
+            continue;
+        if (n == max) {
+            max = max ? 2*max : 16;
+            *hints = realloc(*hints, 2*max*sizeof(off_t));
+        }
+        (*hints)[2*n] = a;
+        (*hints)[2*n+1] = b;
+        ++n;
+    }
+    fclose(f);
+    return n;
+}
+
+struct file_extents {
+    const char* path;
+    size_t n, max;
+    off_t* extents;         // offset, bytes
+};
+
+// compare without ";1" versions and case (as ISO9660 names are upper case)
+static int add_extent(const char* path, off_t offset, off_t bytes,
+                      void* arg) {
+    struct file_extents* f = arg;
+    if (strcasecmp(path,f->path) != 0)
+        return 0;
+    if (f->n == f->max) {
+        f->max = f->max ? 2*f->max : 4;
+        f->extents = realloc(f->extents, 2*f->max*sizeof(off_t));
+    }
+    f->extents[2*f->n] = offset;
+    f->extents[2*f->n+1] = bytes;
+    ++f->n;
+    return 0;
+}
+
+// hash item read in chunks, 0 if unreadable
+static int read_item_hash(int in, const struct v2_marker* m,
+                          const struct v2_item* item, uint8_t* buf,
+                          uint8_t* hash) {
+    uint8_t key[SIPHASH_KEY_LENGTH];
+    siphash_ctx ctx;
+    item_key(m,item,key);
+    siphash_init(&ctx,key);
+    off_t ofs = item->offset * m->block_bytes;
+    uint64_t left = item->blocks * m->block_bytes;
+    while (left > 0) {
+        const size_t n = left < CHUNK ? left : CHUNK;
+        if (pread(in,buf,n,ofs) != (ssize_t)n)
+            return 0;
+        siphash_update(&ctx,buf,n);
+        ofs += n;
+        left -= n;
+    }
+    siphash_final(&ctx,hash);
+    return 1;
+}
+
+// with 95% confidence at most this many of total regions are damaged
+static unsigned damage_bound(unsigned total, unsigned sampled) {
+    unsigned d;
+    for (d = 1; d <= total - sampled; ++d) {
+        // chance that a sample misses all d damaged regions
+        double miss = 1;
+        unsigned i;
+        for (i = 0; i < sampled && miss >= 0.05; ++i)
+            miss *= (double)(total - d - i) / (total - i);
+        if (miss < 0.05)
+            return d - 1;
+    }
+    return total - sampled;
+}
+
+int quick_verify_v2(int in, void* _marker, size_t avail,
+                    const struct verify_options* opt) {
+    FILE* const out = opt->out;
+    struct v2_marker m;
+    if (*(uint32_t*)_marker == SIGR)
+        fprintf(out,"marker needs to be byte-swapped\n");
+    if (parse_marker_v2(out,&m,_marker) != 0)
+        return 1;
+    print_marker_v2(out,&m);
+
+    const uint64_t block_bytes = m.block_bytes;
+    const int64_t marker_bytes = m.marker_blocks * block_bytes;
+    const off_t marker2_offset = m.image_blocks*block_bytes;
+    const off_t marker1_offset = marker2_offset + marker_bytes
+        + m.parity_blocks*block_bytes;
+    void* marker1 = malloc(marker_bytes);
+    void* marker2 = malloc(marker_bytes);
+    const int marker2_good =
+        read_marker(out,in,marker2_offset,marker2,_marker,&m,"marker #2");
+    const int marker1_good =
+        read_marker(out,in,marker1_offset,marker1,_marker,&m,"marker #1");
+    const void* marker = marker2_good ? marker2 : marker1_good ? marker1 :
+        (int64_t)avail >= marker_bytes &&
+        verify_marker_hash(_marker,block_bytes,m.marker_blocks) ? _marker :
+        NULL;
+    int r = !marker1_good || !marker2_good ||
+        memcmp(marker1,marker2,marker_bytes) != 0;
+    if (!marker) {
+        fprintf(out,"no valid marker, stripes NOT checked.\n");
+        free(marker1);
+        free(marker2);
+        free_marker_v2(&m);
+        return 1;
+    }
+
+    unsigned i, j;
+    unsigned* population = malloc(m.num_items * sizeof(unsigned));
+    int* selected = calloc(m.num_items, sizeof(int));
+    unsigned total = 0;
+    if (opt->file_path) {
+        struct file_extents f = { opt->file_path, 0, 0, NULL };
+        char* path = NULL;
+        if (opt->file_path[0] != '/') {
+            path = malloc(strlen(opt->file_path) + 2);
+            path[0] = '/';
+            strcpy(path + 1,opt->file_path);
+            f.path = path;
+        }
+        if (iso9660_walk(in,add_extent,&f) < 0)
+            fprintf(out,"no ISO9660 filesystem found.\n");
+        else if (f.n == 0)
+            fprintf(out,"%s not found.\n",f.path);
+        for (i = 0; i < m.num_items; ++i) {
+            const struct v2_item* item = &m.items[i];
+            const off_t a = item->offset * block_bytes;
+            const off_t b = a + item->blocks * block_bytes;
+            size_t k;
+            if (item->kind == ITEM_PARITY || item->kind == ITEM_PARITY_TILE ||
+                item->kind == ITEM_ROW || item->kind == ITEM_LOCAL)
+                continue;
+            for (k = 0; k < f.n; ++k)
+                if (f.extents[2*k] < b && f.extents[2*k] + f.extents[2*k+1] > a)
+                    selected[i] = 1;
+            total += selected[i];
+        }
+        for (j = 0; j < f.n; ++j)
+            fprintf(out,"extent at byte %ld: %ld bytes\n",
+                   (long)f.extents[2*j],(long)f.extents[2*j+1]);
+        fprintf(out,"checking %u of %u regions for %s\n",total,m.num_items,f.path);
+        if (f.n == 0)
+            r = 1;
+        free(f.extents);
+        free(path);
+    }
+
+    // parity regions are always checked, the others are sampled
+    for (i = 0; !opt->file_path && i < m.num_items; ++i) {
+        if (m.items[i].kind == ITEM_PARITY ||
+            m.items[i].kind == ITEM_PARITY_TILE)
+            selected[i] = 1;
+        else
+            population[total++] = i;
+    }
+    unsigned sample = opt->quick_percent ?
+        (total * (uint64_t)opt->quick + 99) / 100 : opt->quick;
+
+    // hinted regions go to the front, then a partial shuffle
+    off_t* hints = NULL;
+    const size_t num_hints = opt->hint_file ?
+        read_hints(opt->hint_file,&hints) : 0;
+    unsigned hinted = 0;
+    for (i = 0; !opt->file_path && i < total; ++i) {
+        const struct v2_item* item = &m.items[population[i]];
+        const off_t a = item->offset * block_bytes;
+        const off_t b = a + item->blocks * block_bytes;
+        size_t h;
+        for (h = 0; h < num_hints; ++h)
+            if (hints[2*h] < b && hints[2*h+1] > a)
+                break;
+        if (h < num_hints) {
+            const unsigned t = population[hinted];
+            population[hinted++] = population[i];
+            population[i] = t;
+        }
+    }
+    free(hints);
+    if (sample < hinted)
+        sample = hinted;
+    if (sample > total)
+        sample = total;
+    uint64_t state = opt->seed;
+    for (i = hinted; !opt->file_path && i < sample; ++i) {
+        j = i + splitmix64(&state) % (total - i);
+        const unsigned t = population[i];
+        population[i] = population[j];
+        population[j] = t;
+    }
+    if (!opt->file_path) {
+        for (i = 0; i < sample; ++i)
+            selected[population[i]] = 1;
+        fprintf(out,"quick check: %u of %u regions (seed %llu",sample,total,
+               (unsigned long long)opt->seed);
+        if (hinted)
+            fprintf(out,", %u hinted",hinted);
+        fprintf(out,")\n");
+    }
+
+    // read in disc order
+    uint8_t* buf = malloc(CHUNK);
+    unsigned bad_count = 0, unreadable = 0;
+    for (i = 0; i < m.num_items; ++i) {
+        if (!selected[i])
+            continue;
+        const struct v2_item* item = &m.items[i];
+        uint8_t hash[SIPHASH_DIGEST_LENGTH];
+        if (out == stdout) {
+            printf("reading %s...    \r",item_name(&m,item));
+            fflush(stdout);
+        }
+        if (!read_item_hash(in,&m,item,buf,hash)) {
+            fprintf(out,"%s UNREADABLE.   \n",item_name(&m,item));
+            ++unreadable;
+        }
+        else if (!item_hash_matches(&m,marker,item,hash)) {
+            fprintf(out,"%s CORRUPT.   \n",item_name(&m,item));
+            ++bad_count;
+        }
+    }
+    fprintf(out,"reading done.                          \n");
+
+    if (bad_count || unreadable) {
+        fprintf(out,"%u regions CORRUPT, %u UNREADABLE; run a full verify.\n",
+               bad_count,unreadable);
+        r = 1;
+    }
+    else if (opt->file_path) {
+        if (r == 0)
+            fprintf(out,"%s good.\n",opt->file_path);
+    }
+    else if (sample < total) {
+        // hinted regions were not chosen at random
+        const unsigned rest = total - hinted;
+        const unsigned d = damage_bound(rest,sample - hinted);
+        fprintf(out,"no damage found; with 95%% confidence at most %u of %u "
+               "%sregions (%.1f%%) are damaged.\n",
+               d, rest, hinted ? "other " : "", 100.0 * d / rest);
+    }
+    else
+        fprintf(out,"all regions good (parity NOT checked).\n");
+
+    free(buf);
+    free(population);
+    free(selected);
+    free(marker1);
+    free(marker2);
+    free_marker_v2(&m);
+    return r;
+}
@@ -0,0 +1,276 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <byteswap.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "cdrverify.h"
+#include "marker-v2.h"
+
+#define CHUNK (4*1024*1024)
+#define OVERLAP 64          // v1 marker, start of v2 marker
+
+/* Deep scan: every 4-byte word of the device is compared with the v2
+ * signature and the first word of the v1 signature (either byte order).
+ * Candidates are confirmed with the marker hash (v2) or checksum (v1).
+ * The device is split into one contiguous range per reader thread.
+ */
+
+struct found {
+    off_t offset;
+    int version;
+    uint64_t block_bytes;
+    uint64_t image_blocks;
+    uint64_t tail_blocks;   // marker and parity between the two copies
+    uint64_t date_time;     // v2 only
+    uint8_t head[24];       // identifies copies of the same marker
+};
+
+struct scanner {
+    int in;
+    off_t start, end;
+    pthread_t thread;
+    struct found* found;
+    size_t num_found, max_found;
+    int failed;
+};
+
+static const uint32_t sig_words[4] = {
+    SIG, SIGR, (uint32_t)SIG1, (uint32_t)SIG1R
+};
+
+// offset of next word in [i,n) matching one of sig_words, n if none
+static size_t next_candidate(const uint8_t* buf, size_t i, size_t n) {
+#ifdef __SSE2__
+    const __m128i s0 = _mm_set1_epi32(sig_words[0]);
+    const __m128i s1 = _mm_set1_epi32(sig_words[1]);
+    const __m128i s2 = _mm_set1_epi32(sig_words[2]);
+    const __m128i s3 = _mm_set1_epi32(sig_words[3]);
+    for (; i + 16 <= n; i += 16) {
+        const __m128i v = _mm_loadu_si128((const __m128i*)(buf + i));
+        const __m128i eq =
+            _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi32(v,s0),
+                                      _mm_cmpeq_epi32(v,s1)),
+                         _mm_or_si128(_mm_cmpeq_epi32(v,s2),
+                                      _mm_cmpeq_epi32(v,s3)));
+        const int mask = _mm_movemask_epi8(eq);
+        if (mask)
+            return i + (__builtin_ctz(mask) & ~3);
+    }
+#endif
+    for (; i + 4 <= n; i += 4) {
+        uint32_t w;
+        memcpy(&w,buf + i,4);
+        if (w == sig_words[0] || w == sig_words[1] ||
+            w == sig_words[2] || w == sig_words[3])
+            return i;
+    }
+    return n;
+}
+
+static void add_found(struct scanner* s, const struct found* f) {
+    if (s->num_found == s->max_found) {
+        s->max_found = s->max_found ? 2*s->max_found : 16;
+        s->found = realloc(s->found, s->max_found * sizeof(struct found));
+    }
+    s->found[s->num_found++] = *f;
+}
+
+// v2 marker block 0 at buf (avail bytes, read from ofs); 1 if valid
+static int check_v2(struct scanner* s, const uint8_t* buf, size_t avail,
+                    off_t ofs, struct found* f) {
+    uint16_t block_log2, index;
+    uint32_t sig;
+    memcpy(&sig,buf,4);
+    memcpy(&block_log2,buf + 4,2);
+    memcpy(&index,buf + 6,2);
+    if (index != 0)
+        return 0;
+    if (sig == SIGR)
+        block_log2 = bswap_16(block_log2);
+    if ((block_log2 & 0xff) < 6 || (block_log2 & 0xff) >= 30 ||
+        (block_log2 >> 8) > LAYOUT_LOCAL)
+        return 0;
+
+    const size_t block_bytes = (size_t)1 << (block_log2 & 0xff);
+    uint8_t* block = NULL;
+    if (avail < block_bytes) {
+        block = malloc(block_bytes);
+        if (pread(s->in,block,block_bytes,ofs) != (ssize_t)block_bytes) {
+            free(block);
+            return 0;
+        }
+        buf = block;
+    }
+    int r = 0;
+    struct v2_marker m;
+    if (verify_marker_block_hash(buf,block_bytes) &&
+        parse_marker_v2(NULL,&m,buf) == 0) {
+        f->version = 2;
+        f->block_bytes = m.block_bytes;
+        f->image_blocks = m.image_blocks;
+        f->tail_blocks = m.marker_blocks + m.parity_blocks;
+        f->date_time = m.date_time;
+        memcpy(f->head,buf,sizeof(f->head));
+        free_marker_v2(&m);
+        r = 1;
+    }
+    free(block);
+    return r;
+}
+
+// v1 marker at buf (at least 64 bytes); 1 if valid
+static int check_v1(const uint8_t* buf, struct found* f) {
+    uint64_t p[8];
+    if (!marker_v1_block_bytes(buf))
+        return 0;
+    memcpy(p,buf,sizeof(p));
+    int i;
+    if (p[0] == SIG1R)
+        for (i = 0; i < 8; ++i)
+            p[i] = bswap_64(p[i]);
+    f->version = 1;
+    f->block_bytes = p[2];
+    f->image_blocks = p[3];
+    f->tail_blocks = 1 + p[4];
+    f->date_time = 0;
+    memcpy(f->head,buf,sizeof(f->head));
+    return 1;
+}
+
+static void* scan_range(void* arg) {
+    struct scanner* s = arg;
+    uint8_t* buf = malloc(CHUNK + OVERLAP);
+    off_t pos, skip_to = 0;
+    for (pos = s->start; pos < s->end; pos += CHUNK) {
+        const ssize_t n = pread(s->in,buf,CHUNK + OVERLAP,pos);
+        if (n <= 0) {
+            fprintf(stderr,"cdrverify: read() failed at %ld (%s)\n",
+                    (long)pos,strerror(errno));
+            s->failed = 1;
+            break;
+        }
+        // candidates must start in this chunk and range
+        size_t lim = n < CHUNK ? n : CHUNK;
+        if (pos + (off_t)lim > s->end)
+            lim = s->end - pos;
+        size_t i = 0;
+        while ((i = next_candidate(buf,i,lim)) < lim) {
+            const off_t ofs = pos + i;
+            struct found f;
+            f.offset = ofs;
+            if (ofs >= skip_to &&
+                ((i + 16 <= (size_t)n &&
+                  check_v2(s,buf + i,n - i,ofs,&f)) ||
+                 (i + 64 <= (size_t)n && check_v1(buf + i,&f)))) {
+                add_found(s,&f);
+                // rest of a v1 marker block holds copies of the marker
+                if (f.version == 1)
+                    skip_to = ofs + f.block_bytes;
+            }
+            i += 4;
+        }
+    }
+    free(buf);
+    return NULL;
+}
+
+static int compare_found(const void* a, const void* b) {
+    const off_t x = ((const struct found*)a)->offset;
+    const off_t y = ((const struct found*)b)->offset;
+    return x < y ? -1 : x > y;
+}
+
+int deep_scan(int in, off_t device_size, const struct verify_options* opt) {
+    const unsigned threads = opt->threads > 0 ? opt->threads : 1;
+    printf("scanning whole device for markers (%u readers)...\n",threads);
+    fflush(stdout);
+
+    // split at multiples of 4 bytes
+    struct scanner* s = calloc(threads, sizeof(struct scanner));
+    const off_t range = ((device_size / threads) + 3) & ~(off_t)3;
+    unsigned t;
+    for (t = 0; t < threads; ++t) {
+        s[t].in = in;
+        s[t].start = t*range < device_size ? t*range : device_size;
+        s[t].end = (t+1)*range < device_size ? (t+1)*range : device_size;
+        pthread_create(&s[t].thread,NULL,scan_range,&s[t]);
+    }
+
+    // collect, then drop v1 copies split between two readers
+    struct found* all = NULL;
+    size_t n = 0, i, j;
+    int failed = 0;
+    for (t = 0; t < threads; ++t) {
+        pthread_join(s[t].thread,NULL);
+        failed |= s[t].failed;
+        all = realloc(all, (n + s[t].num_found + 1) * sizeof(struct found));
+        memcpy(all + n, s[t].found, s[t].num_found * sizeof(struct found));
+        n += s[t].num_found;
+        free(s[t].found);
+    }
+    free(s);
+    qsort(all,n,sizeof(struct found),compare_found);
+    for (i = j = 0; i < n; ++i)
+        if (j == 0 || all[i].version != 1 || all[j-1].version != 1 ||
+            memcmp(all[i].head,all[j-1].head,sizeof(all[i].head)) != 0 ||
+            all[i].offset >= all[j-1].offset + (off_t)all[j-1].block_bytes)
+            all[j++] = all[i];
+    n = j;
+
+    /* The first copy of a marker follows the image, the second follows the
+     * parity.  A marker found only once could be either copy.
+     */
+    for (i = 0; i < n; ++i) {
+        const struct found* f = &all[i];
+        int copy = 0;
+        for (j = 0; j < n; ++j)
+            if (j != i && memcmp(f->head,all[j].head,sizeof(f->head)) == 0)
+                copy = j < i ? 2 : 1;
+        const off_t first = f->offset - f->image_blocks*f->block_bytes;
+        const off_t second = first - f->tail_blocks*f->block_bytes;
+        printf("v%d marker at byte %ld: image of %lu blocks of %lu bytes",
+               f->version, (long)f->offset,
+               (unsigned long)f->image_blocks, (unsigned long)f->block_bytes);
+        if (f->version == 2) {
+            const time_t dt = f->date_time / (1000*1000*1000);
+            char created[32];
+            strftime(created,sizeof(created),"%Y-%m-%d %H:%M:%S",
+                     localtime(&dt));
+            printf(", created %s",created);
+        }
+        if (copy == 1)
+            printf("\n\tfirst copy, image at byte %ld\n",(long)first);
+        else if (copy == 2)
+            printf("\n\tsecond copy, image at byte %ld\n",(long)second);
+        else
+            printf("\n\tsingle copy, image at byte %ld (first) or %ld (second)\n",
+                   (long)first,(long)second);
+    }
+    printf("%lu markers found.\n",(unsigned long)n);
+
+    free(all);
+    return failed || n == 0;
+}
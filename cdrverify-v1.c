@@ -34,11 +34,6 @@
 #define MARKER_INTS (8)
 #define MARKER_BYTES (MARKER_INTS*(int)sizeof(uint64_t))
 
-#define SIG1 0xc56a5d888149eee7ULL
-#define SIG2 0x4139ef05dda34f80ULL
-#define SIG1R 0xe7ee4981885d6ac5ULL
-#define SIG2R 0x804fa3dd05ef3941ULL
-
 /* Marker format:
  *   uint64_t signature1;
  *   uint64_t signature2;
@@ -88,7 +83,7 @@ static void memxor(void* dest, const void* src, size_t n) {
     }
 }
 
-static int read_and_xor(void* dest, int in, ssize_t n) {
+static int read_and_xor(FILE* out, void* dest, int in, ssize_t n) {
     unsigned char* buf = malloc(BUF_SIZE);
     while (n > 0) {
         ssize_t n_buf;
@@ -97,7 +92,7 @@ static int read_and_xor(void* dest, int in, ssize_t n) {
         else
             n_buf = BUF_SIZE;
         if (read(in,buf,n_buf) != n_buf) {
-            fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
+            fprintf(out,"cdrverify: read() failed (%s)\n",strerror(errno));
             free(buf);
             return 1;
         }
@@ -109,6 +104,17 @@ static int read_and_xor(void* dest, int in, ssize_t n) {
     return 0;
 }
 
+// block size if src is a valid marker, 0 otherwise
+uint64_t marker_v1_block_bytes(const void* src) {
+    uint64_t p[MARKER_INTS];
+    memcpy(p,src,MARKER_BYTES);
+    if (((p[0] == SIG1  && p[1] == SIG2) ||
+         (p[0] == SIG1R && p[1] == SIG2R)) &&
+        p[7] == checksum_marker(p))
+        return bswap_marker(p[2],p[0]);
+    return 0;
+}
+
 // -1 if not found, offset otherwise
 ssize_t find_marker_v1(const void* src, size_t len) {
     size_t i = len & ~(size_t)(MARKER_BYTES-1);
@@ -117,15 +123,13 @@ ssize_t find_marker_v1(const void* src, size_t len) {
     while (i > 0) {
         i -= MARKER_BYTES;
         p -= MARKER_INTS;
-        if (((p[0] == SIG1  && p[1] == SIG2) ||
-             (p[0] == SIG1R && p[1] == SIG2R)) &&
-            p[7] == checksum_marker(p))
+        if (marker_v1_block_bytes(p))
             return i;
     }
     return -1;
 }
 
-int verify_v1(int in, void* _marker) {
+int verify_v1(FILE* out, int in, void* _marker) {
 
     size_t i;
     size_t parity_errors;
@@ -133,7 +137,7 @@ int verify_v1(int in, void* _marker) {
 
     marker = (uint64_t*)_marker;
     if (marker[0] == SIG1R)
-        printf("marker needs to be byte-swapped\n");
+        fprintf(out,"marker needs to be byte-swapped\n");
 
     const int64_t blocksize = bswap_marker(marker[2],marker[0]);     // bytes
     const uint64_t imagesize = bswap_marker(marker[3],marker[0]);    // blocks
@@ -147,23 +151,23 @@ int verify_v1(int in, void* _marker) {
     const int64_t offsetbytes = stripeoffset * blocksize;
 
     if (blocksize < MARKER_BYTES || (blocksize & (blocksize-1))) {
-        printf("INVALID BLOCK SIZE (%ld)\n",blocksize);
+        fprintf(out,"INVALID BLOCK SIZE (%ld)\n",blocksize);
         return 1;
     }
-    printf("block size:  %ld bytes\n", blocksize);
-    printf("image size:  %ld blocks (%ld kiB)\n", imagesize, imagebytes/1024);
+    fprintf(out,"block size:  %ld bytes\n", blocksize);
+    fprintf(out,"image size:  %ld blocks (%ld kiB)\n", imagesize, imagebytes/1024);
     if (stripesize > imagesize) {
-        printf("INVALID STRIPE SIZE (%ld)\n",stripesize);
+        fprintf(out,"INVALID STRIPE SIZE (%ld)\n",stripesize);
         return 1;
     }
-    printf("stripe size: %ld blocks (%ld kiB)\n", stripesize, stripebytes/1024);
+    fprintf(out,"stripe size: %ld blocks (%ld kiB)\n", stripesize, stripebytes/1024);
     if (nstripes != (imagesize + stripesize - 1) / stripesize) {
-        printf("INVALID NUMBER OF STRIPES (%ld)\n",nstripes);
+        fprintf(out,"INVALID NUMBER OF STRIPES (%ld)\n",nstripes);
         return 1;
     }
-    printf("num stripes: %ld\n", nstripes);
+    fprintf(out,"num stripes: %ld\n", nstripes);
     if (stripeoffset >= stripesize) {
-        printf("INVALID STRIPE OFFSET (%ld)\n",stripeoffset);
+        fprintf(out,"INVALID STRIPE OFFSET (%ld)\n",stripeoffset);
         return 1;
     }
 
@@ -175,71 +179,75 @@ int verify_v1(int in, void* _marker) {
     unsigned char* buf_large = malloc(stripebytes);
 
     // verify markers
-    printf("checking marker #1...");
+    fprintf(out,"checking marker #1...");
     if (lseek(in,(imagesize+1+stripesize)*blocksize,SEEK_SET) == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+        fprintf(out,"cdrverify: lseek() failed (%s)\n",strerror(errno));
         return 1;
     }
     if (read(in,buf_large,blocksize) != blocksize) {
-        fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
+        fprintf(out,"cdrverify: read() failed (%s)\n",strerror(errno));
         return 1;
     }
     if (memcmp(full_marker,buf_large,blocksize) != 0) {
-        printf(" CORRUPT.\n");
+        fprintf(out," CORRUPT.\n");
         return 1;
     }
-    printf(" good.\n");
-    printf("checking marker #2...");
+    fprintf(out," good.\n");
+    fprintf(out,"checking marker #2...");
     if (lseek(in,imagesize*blocksize,SEEK_SET) == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+        fprintf(out,"cdrverify: lseek() failed (%s)\n",strerror(errno));
         return 1;
     }
     if (read(in,buf_large,blocksize) != blocksize) {
-        fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
+        fprintf(out,"cdrverify: read() failed (%s)\n",strerror(errno));
         return 1;
     }
     if (memcmp(full_marker,buf_large,blocksize) != 0) {
-        printf(" CORRUPT.\n");
+        fprintf(out," CORRUPT.\n");
         return 1;
     }
-    printf(" good.\n");
+    fprintf(out," good.\n");
     free(full_marker);
 
     // read parity
-    printf("reading parity...");
-    fflush(stdout);
+    fprintf(out,"reading parity...");
+    fflush(out);
     if (lseek(in,(imagesize+1)*blocksize,SEEK_SET) == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+        fprintf(out,"cdrverify: lseek() failed (%s)\n",strerror(errno));
         return 1;
     }
     if (stripeoffset > 0) {
         if (read(in,buf_large+mainbytes,offsetbytes) != offsetbytes) {
-            fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
+            fprintf(out,"cdrverify: read() failed (%s)\n",strerror(errno));
             return 1;
         }
     }
     if (read(in,buf_large,mainbytes) != mainbytes) {
-        fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
+        fprintf(out,"cdrverify: read() failed (%s)\n",strerror(errno));
         return 1;
     }
-    printf(" done.\n");
+    fprintf(out," done.\n");
 
     // read stripes
     if (lseek(in,0,SEEK_SET) == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+        fprintf(out,"cdrverify: lseek() failed (%s)\n",strerror(errno));
         return 1;
     }
     for (i = 1; i < nstripes; ++i) {
-        printf("reading stripe #%ld...\r",i);
-        fflush(stdout);
-        if (read_and_xor(buf_large,in,stripebytes) != 0)
+        if (out == stdout) {
+            printf("reading stripe #%ld...\r",i);
+            fflush(stdout);
+        }
+        if (read_and_xor(out,buf_large,in,stripebytes) != 0)
             return 1;
     }
-    printf("reading last stripe...    \r");
-    fflush(stdout);
-    if (read_and_xor(buf_large,in,imagebytes - (nstripes-1)*stripebytes) != 0)
+    if (out == stdout) {
+        printf("reading last stripe...    \r");
+        fflush(stdout);
+    }
+    if (read_and_xor(out,buf_large,in,imagebytes - (nstripes-1)*stripebytes) != 0)
         return 1;
-    printf("reading done.             \n");
+    fprintf(out,"reading done.             \n");
 
     // parity should be all zero
     parity_errors = 0;
@@ -247,9 +255,9 @@ int verify_v1(int in, void* _marker) {
         if (buf_large[i])
             ++parity_errors;
     if (!parity_errors)
-        printf("valid parity.\n");
+        fprintf(out,"valid parity.\n");
     else
-        printf("INVALID PARITY (%ld errors)\n",parity_errors);
+        fprintf(out,"INVALID PARITY (%ld errors)\n",parity_errors);
     
     free(buf_large);
     return parity_errors > 0;
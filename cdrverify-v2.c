@@ -15,48 +15,21 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <assert.h>
-#include <byteswap.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
-#include <time.h>
 #include <unistd.h>
 
 #include "cdrverify.h"
-#include "siphash24.h"
-
-
-/* Marker format (block zero):
- *   uint32_t signature;       // 0x972fae43
- *   uint16_t log2_blocksize;  // min 6
- *   uint16_t index;           // 0
- *   uint64_t date_time;
- *
- *   uint32_t num_stripes;
- *   uint32_t first_blocks;
- *   uint32_t stripe_blocks;
- *   uint32_t image_blocks;
- *
- *   uint64_t parity_hash;
- *   uint64_t stripe_hashes[];
- *   uint64_t checksum;    
- *
- * Block one and later (i):
- *   uint32_t signature;       // 0x972fae43
- *   uint16_t log2_blocksize;
- *   uint16_t index;           // i
- *
- *   uint64_t stripe_hashes[];
- *   uint64_t checksum;    
- */
+#include "large-io.h"
+#include "marker-v2.h"
+#include "volume.h"
 
-#define SIG  0x972fae43u
-#define SIGR 0x43ae2f97u
 
 // dest/src must be aligned on some machines
 static void memxor(void* dest, const void* src, size_t n) {
@@ -74,252 +47,529 @@ static void memxor(void* dest, const void* src, size_t n) {
     }
 }
 
-static ssize_t read_large(int fd, void *buf, size_t count) {
-    ssize_t result = 0;
-    while (count > 1024*1024*1024) {
-        ssize_t r = read(fd, buf, 1024*1024*1024);
-        if (r < 0) return r;
-        result += r;
-        if (r != 1024*1024*1024) return result;
-        buf = ((char*)buf) + 1024*1024*1024;
-        count -= 1024*1024*1024;
+/* Items are read in chunks, in disc order, by one reader thread per
+ * device into a ring of buffers.  A pool of worker threads, shared by all
+ * devices being verified, adds each chunk to its item's hash and xors it
+ * into the syndrome.  The chunks of an item are hashed in order, one at a
+ * time, while other items (and other devices) are hashed in parallel.
+ * Hashes are compared and reported by the reader in disc order, as soon
+ * as a valid copy of the marker is known.
+ */
+enum { CHUNK_READ, CHUNK_BUSY, CHUNK_DONE };
+
+struct chunk {
+    unsigned item;
+    uint64_t blocks;
+    uint64_t col;           // first column, relative to tile
+    int last;               // final chunk of item
+    uint64_t seq;           // order in which the pool got chunks
+};
+
+struct pipeline {
+    struct hash_pool* pool;
+    struct pipeline* next;  // other pipelines of the pool
+    const struct v2_marker* m;
+    const void* marker;     // NULL until a valid marker has been read
+    int fail_fast;
+    FILE* out;
+
+    unsigned nbuf;
+    uint8_t** buf;          // chunk n is in buf[n % nbuf]
+    struct chunk* chunks;
+    int* state;             // per buffer
+    uint64_t num_chunks;    // chunks read so far
+    uint64_t num_done;      // chunks before this one are done
+    int stop;               // fail-fast
+
+    uint8_t* syndrome;      // of current tile
+    uint64_t tile_blocks;
+    pthread_mutex_t* eq_lock;   // per equation
+
+    siphash_ctx* ctx;       // per item
+    int* busy;              // chunk of item being hashed
+    int* done;
+    uint8_t (*hash)[SIPHASH_DIGEST_LENGTH];
+    int* bad;
+    unsigned next_report;
+};
+
+struct hash_pool {
+    pthread_mutex_t lock;   // also protects the pipelines
+    pthread_cond_t cond;
+    struct pipeline* pipelines;
+    uint64_t seq;           // chunks read, of all devices
+    int finished;
+    unsigned threads;
+    pthread_t* thread;
+};
+
+static void hash_chunk(struct pipeline* p, const struct chunk* c,
+                       const uint8_t* buf) {
+    const uint64_t block_bytes = p->m->block_bytes;
+    const struct v2_item* item = &p->m->items[c->item];
+    siphash_update(&p->ctx[c->item],buf,c->blocks*block_bytes);
+    if (c->last)
+        siphash_final(&p->ctx[c->item],p->hash[c->item]);
+    int j;
+    for (j = 0; j < 2; ++j) {
+        if (item->eq[j] < 0)
+            continue;
+        pthread_mutex_lock(&p->eq_lock[item->eq[j]]);
+        memxor(p->syndrome + (item->eq[j]*p->tile_blocks + c->col)
+               * block_bytes, buf, c->blocks*block_bytes);
+        pthread_mutex_unlock(&p->eq_lock[item->eq[j]]);
     }
-    ssize_t r = read(fd, buf, count);
-    if (r < 0) return r;
-    return result += r;
-}
-
-static int verify_stripe_hash(const void* stripe, size_t stripe_bytes,
-                              void* marker, unsigned index,
-                              const void* expected_hash) {
-    const int need_bswap = *(uint32_t*)marker == SIGR;
-    ((uint16_t*)marker)[3] = need_bswap ? bswap_16(index) : index;
-    uint8_t hash[SIPHASH_DIGEST_LENGTH];
-    siphash(hash, stripe, stripe_bytes, marker);
-    return memcmp(hash, expected_hash, SIPHASH_DIGEST_LENGTH) == 0;
 }
 
-static int verify_marker_block_hash(const void* src, size_t block_bytes) {
-    static const uint8_t zero_key[SIPHASH_KEY_LENGTH] = {0};
-    uint8_t hash[SIPHASH_DIGEST_LENGTH];
-    siphash(hash, src, block_bytes - 8, zero_key);
-    const void* expected_hash = ((char*)src) + block_bytes - 8;
-    return memcmp(hash, expected_hash, SIPHASH_DIGEST_LENGTH) == 0;
-}
-
-static int verify_marker_hash(const void* src, size_t block_bytes,
-                              unsigned marker_blocks) {
-    while (marker_blocks > 0) {
-        if (!verify_marker_block_hash(src, block_bytes))
-            return 0;
-        src = ((char*)src) + block_bytes;
-        --marker_blocks;
-    }
-    return 1;
-}
-    
-// -1 if not found, offset otherwise
-ssize_t find_marker_v2(const void* src, size_t len) {
-    size_t i = len & ~(size_t)63;
-    const uint32_t* p = src;
-    p += i / 4;
-    while (i > 0) {
-        i -= 64;
-        p -= 16;
-        if (*p == SIG && ((const uint16_t*)p)[3] == 0) {
-            const int block_log2 = ((const uint16_t*)p)[2];
-            if (block_log2 < 30) {
-                const size_t block_bytes = 1 << block_log2;
-                if (i + block_bytes <= len &&
-                    verify_marker_block_hash(p, block_bytes))
-                    return i;
+static void* pool_worker(void* arg) {
+    struct hash_pool* pool = arg;
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        // oldest chunk, of any device, whose item is not being hashed
+        struct pipeline* p = NULL;
+        struct pipeline* q;
+        uint64_t n = 0;
+        for (q = pool->pipelines; q; q = q->next) {
+            uint64_t k;
+            for (k = q->num_done; k < q->num_chunks; ++k)
+                if (q->state[k % q->nbuf] == CHUNK_READ &&
+                    !q->busy[q->chunks[k % q->nbuf].item])
+                    break;
+            if (k < q->num_chunks && (!p || q->chunks[k % q->nbuf].seq <
+                                      p->chunks[n % p->nbuf].seq)) {
+                p = q;
+                n = k;
             }
         }
-        else if (*p == SIGR && ((const uint16_t*)p)[3] == 0) {
-            const int block_log2 = bswap_16(((const uint16_t*)p)[2]);
-            if (block_log2 < 30) {
-                const size_t block_bytes = 1 << block_log2;
-                if (i + block_bytes <= len &&
-                    verify_marker_block_hash(p, block_bytes))
-                    return i;
-            }
+        if (!p) {
+            if (pool->finished)
+                break;
+            pthread_cond_wait(&pool->cond,&pool->lock);
+            continue;
         }
+        const unsigned k = n % p->nbuf;
+        const struct chunk c = p->chunks[k];
+        p->state[k] = CHUNK_BUSY;
+        p->busy[c.item] = 1;
+        pthread_mutex_unlock(&pool->lock);
+
+        hash_chunk(p,&c,p->buf[k]);
+
+        pthread_mutex_lock(&pool->lock);
+        p->state[k] = CHUNK_DONE;
+        p->busy[c.item] = 0;
+        if (c.last)
+            p->done[c.item] = 1;
+        while (p->num_done < p->num_chunks &&
+               p->state[p->num_done % p->nbuf] == CHUNK_DONE)
+            ++p->num_done;
+        pthread_cond_broadcast(&pool->cond);
     }
-    return -1;
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
 }
 
-// returns 0 if successful
-int verify_v2(int in, void* _marker) {
-    uint16_t* m16 = (uint16_t*)_marker;
-    uint32_t* m32 = (uint32_t*)_marker;
-    uint64_t* m64 = (uint64_t*)_marker;
+struct hash_pool* pool_start(unsigned threads) {
+    struct hash_pool* pool = calloc(1, sizeof(struct hash_pool));
+    pthread_mutex_init(&pool->lock,NULL);
+    pthread_cond_init(&pool->cond,NULL);
+    pool->threads = threads > 0 ? threads : 1;
+    pool->thread = malloc(pool->threads * sizeof(pthread_t));
+    unsigned i;
+    for (i = 0; i < pool->threads; ++i)
+        pthread_create(&pool->thread[i],NULL,pool_worker,pool);
+    return pool;
+}
 
-    const int need_bswap = m32[0] == SIGR;
-    if (need_bswap)
-        printf("marker needs to be byte-swapped\n");
+void pool_stop(struct hash_pool* pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->finished = 1;
+    pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+    unsigned i;
+    for (i = 0; i < pool->threads; ++i)
+        pthread_join(pool->thread[i],NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->cond);
+    free(pool->thread);
+    free(pool);
+}
 
-    const int block_log2 = need_bswap ? bswap_16(m16[2]) : m16[2];
-    const uint64_t block_bytes = 1 << block_log2;
+// wait until every chunk read so far is hashed (lock held)
+static void wait_hashed(struct pipeline* p) {
+    while (p->num_done < p->num_chunks)
+        pthread_cond_wait(&p->pool->cond,&p->pool->lock);
+}
 
-    if (block_bytes < 64 || (block_bytes & (block_bytes-1))) {
-        printf("INVALID BLOCK SIZE (%ld)\n",block_bytes);
-        return 1;
+// compare hashes of finished items in disc order (lock held)
+static void report_items(struct pipeline* p) {
+    if (!p->marker || p->stop)
+        return;
+    while (p->next_report < p->m->num_items && p->done[p->next_report]) {
+        const unsigned i = p->next_report++;
+        const struct v2_item* item = &p->m->items[i];
+        if (!item_hash_matches(p->m,p->marker,item,p->hash[i])) {
+            fprintf(p->out,"%s CORRUPT.   \n",item_name(p->m,item));
+            p->bad[i] = 1;
+            if (p->fail_fast) {
+                p->stop = 1;
+                return;
+            }
+        }
     }
+}
 
-    const uint64_t date_time = need_bswap ? bswap_64(m64[1]) : m64[1];
-    const time_t dt = date_time / (1000*1000*1000);
-    printf("created:     %s", ctime(&dt));
-
-    printf("block size:  %ld bytes\n", block_bytes);
-    
-    const unsigned num_stripes   = need_bswap ? bswap_32(m32[4]) : m32[4];
-    const unsigned first_blocks  = need_bswap ? bswap_32(m32[5]) : m32[5];
-    const unsigned stripe_blocks = need_bswap ? bswap_32(m32[6]) : m32[6];
-    const unsigned image_blocks  = need_bswap ? bswap_32(m32[7]) : m32[7];
-
-    const uint64_t image_bytes = image_blocks * block_bytes;
-    const int64_t first_bytes  = first_blocks * block_bytes;
-    const int64_t stripe_bytes = stripe_blocks * block_bytes;
-    
-    printf("num stripes: %d\n", num_stripes);
-    printf("stripe size: %d blocks (%ld kiB)\n",
-           stripe_blocks, stripe_bytes/1024);
-    printf("image size:  %d blocks (%ld kiB)\n",
-           image_blocks, image_bytes/1024);
-
-    if (first_blocks > stripe_blocks) {
-        printf("INVALID FIRST STRIPE (%d)\n",first_blocks);
-        return 1;
-    }
-    if (stripe_blocks > image_blocks) {
-        printf("INVALID STRIPE SIZE (%d)\n",stripe_blocks);
-        return 1;
+// read marker copy at ofs, returns 1 if it is valid and matches block 0
+int read_marker(FILE* out, int in, off_t ofs, void* dest, const void* block0,
+                const struct v2_marker* m, const char* name) {
+    const int64_t marker_bytes = m->marker_blocks * m->block_bytes;
+    fprintf(out,"checking %s...",name);
+    if (lseek(in,ofs,SEEK_SET) == (off_t)-1 ||
+        read_large(in,dest,marker_bytes) != marker_bytes) {
+        fprintf(out," unreadable (%s).\n",strerror(errno));
+        return 0;
     }
-    if (image_blocks != first_blocks + stripe_blocks*(num_stripes-1)) {
-        printf("INVALID NUMBER OF STRIPES (%d)\n",num_stripes);
-        return 1;
+    if (memcmp(dest,block0,m->block_bytes) != 0 ||
+        !verify_marker_hash(dest,m->block_bytes,m->marker_blocks)) {
+        fprintf(out," CORRUPT.\n");
+        return 0;
     }
+    fprintf(out," good.\n");
+    return 1;
+}
 
-    // stripe hashes per marker block
-    const unsigned m0_lim = block_bytes / sizeof(uint64_t) - 6;
-    const unsigned mi_lim = block_bytes / sizeof(uint64_t) - 2;
-
-    unsigned marker_blocks = 0;
-    while (num_stripes > m0_lim + marker_blocks * mi_lim)
-        ++marker_blocks;
-    ++marker_blocks;
-    printf("marker size: %d blocks\n", marker_blocks);
-    const int64_t marker_bytes  = marker_blocks * block_bytes;
-    void* marker = malloc(marker_bytes);
-
-    unsigned hash_lim = m0_lim;
-    const uint64_t* stripe_hash = ((uint64_t*)marker) + 5;
-
-    // verify markers
-    printf("checking marker #1...");
-    if (lseek(in,(image_blocks+marker_blocks+stripe_blocks)*block_bytes,SEEK_SET) == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-    if (read(in,marker,marker_bytes) != marker_bytes) {
-        fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-    if (memcmp(marker,m32,block_bytes) != 0 ||
-        !verify_marker_hash(marker,block_bytes,marker_blocks)) {
-        printf(" CORRUPT.\n");
+/* The disc is read from start to end: image, marker #2, parity, marker #1.
+ * If the syndrome of all parity equations does not fit in the memory
+ * budget, it is computed in column tiles, one pass over the disc per tile
+ * (each pass reads only the columns of the tile).  If the whole marker
+ * was found by the scan, hashes are checked as stripes are read,
+ * otherwise once a marker copy is reached.
+ * returns 0 if successful
+ */
+int verify_v2(int in, void* _marker, size_t avail,
+              const struct verify_options* opt) {
+    FILE* const out = opt->out;
+    struct v2_marker m;
+    if (*(uint32_t*)_marker == SIGR)
+        fprintf(out,"marker needs to be byte-swapped\n");
+    if (parse_marker_v2(out,&m,_marker) != 0)
         return 1;
+    print_marker_v2(out,&m);
+
+    const uint64_t block_bytes = m.block_bytes;
+    const int64_t marker_bytes = m.marker_blocks * block_bytes;
+    const off_t marker2_offset = m.image_blocks*block_bytes;
+    const off_t marker1_offset = marker2_offset + marker_bytes
+        + m.parity_blocks*block_bytes;
+    void* marker1 = malloc(marker_bytes);
+    void* marker2 = malloc(marker_bytes);
+    void* scanned = NULL;
+    if ((int64_t)avail >= marker_bytes &&
+        verify_marker_hash(_marker,block_bytes,m.marker_blocks)) {
+        scanned = malloc(marker_bytes);
+        memcpy(scanned,_marker,marker_bytes);
     }
-    printf(" good.\n");
-
-    uint8_t* stripe =
-        malloc(stripe_bytes > marker_bytes ? stripe_bytes : marker_bytes);
 
-    printf("checking marker #2...");
-    if (lseek(in,image_blocks*block_bytes,SEEK_SET) == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-    if (read(in,stripe,marker_bytes) != marker_bytes) {
-        fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
-        return 1;
+    // chunks of at most 1 MiB, column tiles in the rest of the budget
+    unsigned i;
+    const unsigned threads = opt->threads > 0 ? opt->threads : 1;
+    const unsigned nbuf = 2*threads + 2;
+    uint64_t chunk_blocks = (1024*1024) / block_bytes;
+    if (chunk_blocks * block_bytes * nbuf * 2 > opt->buffer_bytes)
+        chunk_blocks = opt->buffer_bytes / (2 * nbuf * block_bytes);
+    if (chunk_blocks < 1)
+        chunk_blocks = 1;
+    uint64_t max_eq_blocks = 1;
+    for (i = 0; i < m.num_eqs; ++i)
+        if (m.eq_blocks[i] > max_eq_blocks)
+            max_eq_blocks = m.eq_blocks[i];
+    const uint64_t buffers_bytes = nbuf * chunk_blocks * block_bytes;
+    uint64_t tile_blocks = 1;
+    if (opt->buffer_bytes > buffers_bytes)
+        tile_blocks = (opt->buffer_bytes - buffers_bytes)
+            / (m.num_eqs * block_bytes);
+    if (tile_blocks < 1)
+        tile_blocks = 1;
+    if (tile_blocks > max_eq_blocks)
+        tile_blocks = max_eq_blocks;
+    const uint64_t num_tiles = (max_eq_blocks + tile_blocks - 1) / tile_blocks;
+    if (num_tiles > 1)
+        fprintf(out,"note: checking parity in %lu passes of %lu blocks (-B)\n",
+               (unsigned long)num_tiles, (unsigned long)tile_blocks);
+    uint8_t* syndrome = malloc(m.num_eqs * tile_blocks * block_bytes);
+
+    // workers of the farm, or of this device only
+    struct hash_pool* own_pool = opt->pool ? NULL : pool_start(threads);
+    struct pipeline p;
+    memset(&p,0,sizeof(p));
+    p.pool = opt->pool ? opt->pool : own_pool;
+    p.m = &m;
+    p.marker = scanned;
+    p.fail_fast = opt->fail_fast;
+    p.out = out;
+    p.nbuf = nbuf;
+    p.buf = malloc(p.nbuf * sizeof(uint8_t*));
+    for (i = 0; i < p.nbuf; ++i)
+        p.buf[i] = malloc(chunk_blocks * block_bytes);
+    p.chunks = calloc(p.nbuf, sizeof(struct chunk));
+    p.state = calloc(p.nbuf, sizeof(int));
+    p.syndrome = syndrome;
+    p.tile_blocks = tile_blocks;
+    p.eq_lock = malloc(m.num_eqs * sizeof(pthread_mutex_t));
+    for (i = 0; i < m.num_eqs; ++i)
+        pthread_mutex_init(&p.eq_lock[i],NULL);
+    p.busy = calloc(m.num_items, sizeof(int));
+    p.ctx = malloc(m.num_items * sizeof(siphash_ctx));
+    for (i = 0; i < m.num_items; ++i) {
+        uint8_t key[SIPHASH_KEY_LENGTH];
+        item_key(&m,&m.items[i],key);
+        siphash_init(&p.ctx[i],key);
     }
-    if (memcmp(stripe,marker,marker_bytes) != 0) {
-        printf(" CORRUPT.\n");
-        return 1;
+    p.done = calloc(m.num_items, sizeof(int));
+    p.hash = malloc(m.num_items * SIPHASH_DIGEST_LENGTH);
+    p.bad = calloc(m.num_items, sizeof(int));
+
+    pthread_mutex_lock(&p.pool->lock);
+    p.next = p.pool->pipelines;
+    p.pool->pipelines = &p;
+    pthread_mutex_unlock(&p.pool->lock);
+
+    struct latency_map lm;
+    latency_init(&lm,marker1_offset + marker_bytes);
+    uint64_t bytes_read = 0;
+    if (opt->progress)
+        __atomic_store_n(&opt->progress->total,
+                         (uint64_t)(marker1_offset + marker_bytes),
+                         __ATOMIC_RELAXED);
+
+    // xor of each parity equation should be zero
+    size_t parity_errors = 0;
+    off_t pos = 0;
+    int read_failed = 0;
+    off_t read_error[2] = { -1, -1 };   // bytes of failed read
+    int stop = 0;
+    int marker2_good = -1;
+    uint64_t tile;
+    if (lseek(in,0,SEEK_SET) == (off_t)-1) {
+        fprintf(out,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+        read_failed = 1;
     }
-    printf(" good.\n");
+    for (tile = 0; tile < num_tiles && !read_failed && !stop; ++tile) {
+        const uint64_t t0 = tile * tile_blocks;
+        const uint64_t t1 = t0 + tile_blocks;
+        memset(syndrome, 0, m.num_eqs * tile_blocks * block_bytes);
+
+        for (i = 0; i < m.num_items && !read_failed && !stop; ++i) {
+            const struct v2_item* item = &m.items[i];
+            const uint64_t lo = item->eq_offset > t0 ? item->eq_offset : t0;
+            const uint64_t end = item->eq_offset + item->blocks;
+            const uint64_t hi = end < t1 ? end : t1;
+
+            if (tile == 0 && marker2_good < 0 &&
+                (off_t)(item->offset * block_bytes) >= marker2_offset) {
+                marker2_good = read_marker(out,in,marker2_offset,marker2,
+                                           _marker,&m,"marker #2");
+                pos = marker2_offset + marker_bytes;
+                bytes_read += marker_bytes;
+                pthread_mutex_lock(&p.pool->lock);
+                if (marker2_good && !p.marker)
+                    p.marker = marker2;
+                pthread_mutex_unlock(&p.pool->lock);
+            }
+            if (lo >= hi)
+                continue;
+            if (out == stdout &&
+                (i == 0 || item->kind != item[-1].kind ||
+                 item->num != item[-1].num)) {
+                if (num_tiles > 1)
+                    fprintf(out,"pass %lu: ",(unsigned long)tile+1);
+                fprintf(out,"reading %s...    \r",region_name(&m,item));
+                fflush(out);
+            }
 
-    uint8_t* parity = malloc(stripe_bytes);
+            uint64_t b;
+            for (b = lo; b < hi && !read_failed; ) {
+                const uint64_t n = hi - b < chunk_blocks ? hi - b : chunk_blocks;
+                const uint64_t c = p.num_chunks;
+                uint8_t* buf = p.buf[c % p.nbuf];
+
+                // wait until buffer is free
+                pthread_mutex_lock(&p.pool->lock);
+                while (!p.stop && c >= p.num_done + p.nbuf)
+                    pthread_cond_wait(&p.pool->cond,&p.pool->lock);
+                report_items(&p);
+                stop = p.stop;
+                pthread_mutex_unlock(&p.pool->lock);
+                if (stop)
+                    break;
+
+                const off_t ofs =
+                    (item->offset + b - item->eq_offset) * block_bytes;
+                if (ofs != pos && lseek(in,ofs,SEEK_SET) == (off_t)-1) {
+                    fprintf(out,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+                    read_failed = 1;
+                    break;
+                }
+                const uint64_t started = latency_now();
+                const ssize_t got = read_large(in,buf,n*block_bytes);
+                latency_add(&lm,ofs,n*block_bytes,latency_now() - started);
+                if (got != (ssize_t)(n*block_bytes)) {
+                    fprintf(out,"cdrverify: read() failed (%s)\n",strerror(errno));
+                    read_error[0] = ofs + (got > 0 ? got : 0);
+                    read_error[1] = ofs + n*block_bytes;
+                    read_failed = 1;
+                    break;
+                }
+                pos = ofs + n*block_bytes;
+                bytes_read += n*block_bytes;
+                if (opt->progress)
+                    __atomic_store_n(&opt->progress->bytes,bytes_read,
+                                     __ATOMIC_RELAXED);
+
+                pthread_mutex_lock(&p.pool->lock);
+                p.chunks[c % p.nbuf].item = i;
+                p.chunks[c % p.nbuf].blocks = n;
+                p.chunks[c % p.nbuf].col = b - t0;
+                p.chunks[c % p.nbuf].last = b + n == end;
+                p.chunks[c % p.nbuf].seq = p.pool->seq++;
+                p.state[c % p.nbuf] = CHUNK_READ;
+                p.num_chunks = c + 1;
+                pthread_cond_broadcast(&p.pool->cond);
+                pthread_mutex_unlock(&p.pool->lock);
+                b += n;
+            }
+        }
 
-    // read parity
-    printf("reading parity...");
-    fflush(stdout);
-    if (lseek(in,(image_blocks+marker_blocks)*block_bytes,SEEK_SET) == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-    if (read_large(in,parity,stripe_bytes) != stripe_bytes) {
-        fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
-        return 1;
-    }
-    if (!verify_stripe_hash(parity,stripe_bytes,m16,num_stripes,m64+4)) {
-        printf(" CORRUPT.\n");
-        return 1;
+        // syndrome is complete once the tile is hashed
+        pthread_mutex_lock(&p.pool->lock);
+        wait_hashed(&p);
+        pthread_mutex_unlock(&p.pool->lock);
+        if (!read_failed && !stop) {
+            uint64_t j;
+            for (j = 0; j < m.num_eqs * tile_blocks * block_bytes; ++j)
+                if (syndrome[j])
+                    ++parity_errors;
+        }
     }
-    printf(" done.\n");
 
-    // read stripes
-    if (lseek(in,0,SEEK_SET) == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
-        return 1;
+    // leave the pool once everything read is hashed
+    pthread_mutex_lock(&p.pool->lock);
+    wait_hashed(&p);
+    struct pipeline** pp = &p.pool->pipelines;
+    while (*pp != &p)
+        pp = &(*pp)->next;
+    *pp = p.next;
+    pthread_mutex_unlock(&p.pool->lock);
+    if (own_pool)
+        pool_stop(own_pool);
+
+    // marker #1 (last thing on disc)
+    int marker1_good = 0;
+    if (!read_failed && !stop) {
+        fprintf(out,"reading done.                          \n");
+        marker1_good = read_marker(out,in,marker1_offset,marker1,_marker,
+                                   &m,"marker #1");
+        if (marker1_good && !p.marker)
+            p.marker = marker1;
     }
-    printf("reading first stripe... \r");
-    fflush(stdout);
-    if (read_large(in,stripe,first_bytes) != first_bytes) {
-        fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
+    report_items(&p);
+    if (p.stop)
+        fprintf(out,"stopped at first corrupt region.\n");
+    else if (!read_failed && !p.marker)
+        fprintf(out,"no valid marker, stripes NOT checked.\n");
+    int r = read_failed || p.stop || !p.marker || !marker1_good ||
+        marker2_good != 1 ||
+        memcmp(marker1,marker2,marker_bytes) != 0;
+
+    for (i = 0; i < p.nbuf; ++i)
+        free(p.buf[i]);
+    free(p.buf);
+    free(p.chunks);
+    free(p.state);
+    for (i = 0; i < m.num_eqs; ++i)
+        pthread_mutex_destroy(&p.eq_lock[i]);
+    free(p.eq_lock);
+    free(p.busy);
+    free(p.ctx);
+    free(p.done);
+    free(p.hash);
+    free(marker1);
+    free(marker2);
+    free(scanned);
+    free(syndrome);
+
+    int* bad = p.bad;
+    unsigned bad_count = 0;
+    for (i = 0; i < m.num_items; ++i)
+        bad_count += bad[i];
+
+    // slow reads, with the regions they belong to
+    int* checked = calloc(m.num_items, sizeof(int));
+    for (i = 0; p.marker && i < p.next_report; ++i)
+        checked[i] = 1;
+    if (latency_report(out,&lm,&m,bad,checked,opt->latency_file,opt->slow_ms))
+        r = 1;
+    free(checked);
+    latency_free(&lm);
+    if (read_error[0] >= 0)
+        print_damaged_files(out,in,read_error,1);
+    if (read_failed || p.stop || !p.marker) {
+        free(bad);
+        free_marker_v2(&m);
         return 1;
     }
-    if (!verify_stripe_hash(stripe,first_bytes,m16,0,stripe_hash++)) {
-        printf("first stripe CORRUPT.   \n");
-        return 1;
-    }
-    memxor(parity+stripe_bytes-first_bytes,stripe,first_bytes);
-    --hash_lim;
 
-    unsigned i;
-    for (i = 1; i < num_stripes; ++i) {
-        printf("reading stripe #%d...    \r",i+1);
-        fflush(stdout);
-        if (read_large(in,stripe,stripe_bytes) != stripe_bytes) {
-            fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
-            return 1;
-        }
-        if (!verify_stripe_hash(stripe,stripe_bytes,m16,i,stripe_hash++)) {
-            printf("stripe #%d CORRUPT.   \n",i+1);
-            return 1;
+    if (bad_count > 0) {
+        unsigned* order = malloc(bad_count * sizeof(unsigned));
+        int* order_eq = malloc(bad_count * sizeof(int));
+        const size_t peeled = peel_items(&m,bad,order,order_eq);
+        if (peeled == bad_count)
+            fprintf(out,"%d regions CORRUPT (repairable).\n",bad_count);
+        else {
+            fprintf(out,"%d regions CORRUPT (NOT repairable).\n",bad_count);
+            // files in the regions that stay lost
+            int* lost = malloc(m.num_items * sizeof(int));
+            memcpy(lost,bad,m.num_items * sizeof(int));
+            for (i = 0; i < peeled; ++i)
+                lost[order[i]] = 0;
+            print_damaged_files_v2(out,in,&m,lost);
+            free(lost);
         }
-        if (--hash_lim == 0) {
-            hash_lim = mi_lim;
-            stripe_hash += 2;
+        free(order);
+        free(order_eq);
+        r = 1;
+
+        // each local group can be repaired separately, if it lost one region
+        unsigned g;
+        for (g = 0; m.layout == LAYOUT_LOCAL && g < m.num_groups; ++g) {
+            unsigned group_bad = 0;
+            for (i = 0; i < m.num_items; ++i)
+                if (bad[i] && m.items[i].kind != ITEM_PARITY &&
+                    m.items[i].col == g)
+                    ++group_bad;
+            if (group_bad == 0)
+                continue;
+            const unsigned last = (g+1)*m.param < m.num_stripes ?
+                (g+1)*m.param : m.num_stripes;
+            if (group_bad == 1)
+                fprintf(out,"local group #%d affected (stripes #%d-#%d, cdrrepair -g %d)\n",
+                        g+1, g*m.param+1, last, g+1);
+            else
+                fprintf(out,"local group #%d affected (stripes #%d-#%d, %d regions, too many for cdrrepair -g)\n",
+                        g+1, g*m.param+1, last, group_bad);
         }
-        memxor(parity,stripe,stripe_bytes);
     }
-    printf("reading done.             \n");
-    free(marker);
-    free(stripe);
+    else {
+        // parity should be all zero
+        if (!parity_errors)
+            fprintf(out,"valid parity.\n");
+        else
+            fprintf(out,"INVALID PARITY (%ld errors)\n",parity_errors);
+        if (parity_errors > 0)
+            r = 1;
+    }
 
-    // parity should be all zero
-    size_t parity_errors = 0;
-    for (i = 0; i < stripe_bytes; ++i)
-        if (parity[i])
-            ++parity_errors;
-    if (!parity_errors)
-        printf("valid parity.\n");
-    else
-        printf("INVALID PARITY (%ld errors)\n",parity_errors);
-    free(parity);
-
-    return parity_errors > 0;
+    free(bad);
+    free_marker_v2(&m);
+    return r;
 }
-
@@ -17,12 +17,14 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "cdrverify.h"
@@ -30,53 +32,60 @@
 #define BUF_SIZE (1024*1024)
 #define MAX_SCAN (16*1024*1024)
 
-int main(int argc, char*argv[]) {
+// verify one disc or image, returns 0 if good
+int verify_device(const char* name, const struct verify_options* opt) {
 
+    FILE* const out = opt->out;
     int in;
     off_t device_size, nio, total_read;
     uint8_t* buf;
-    ssize_t marker_ofs;
+    ssize_t marker_ofs, marker_len = 0;
     int marker_ver;
 
-    if (argc <= 1) {
-        printf("Usage:\n  cdrverify device\n");
-        return 1;
-    }
-
     // open cdrom device
-    in = open(argv[1],O_RDONLY);
+    in = open(name,O_RDONLY);
     if (in == -1) {
-        fprintf(stderr,"cdrverify: failed to open device %s\n",argv[1]);
+        fprintf(out,"cdrverify: failed to open device %s\n",name);
         return 1;
     }
 
     // figure out size of image on media
     device_size = lseek(in,0,SEEK_END);
     if (device_size == (off_t)-1) {
-        fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+        fprintf(out,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+        close(in);
         return 1;
     }
     //printf("device_size = %ld\n",device_size);
 
     buf = malloc(BUF_SIZE);
 
-    // scan for marker
+    // try right after the filesystem first, then scan from the end
     nio = (device_size+BUF_SIZE-1) / BUF_SIZE;
     marker_ver = 0;
     marker_ofs = -1;
     total_read = 0;
-    printf("scanning for marker...");
-    fflush(stdout);
+    fprintf(out,"scanning for marker...");
+    fflush(out);
+    off_t buf_ofs;
+    if ((marker_ofs = locate_marker_v2(in,device_size,buf,BUF_SIZE,&buf_ofs)) >= 0) {
+        marker_ver = 2;
+        marker_len = device_size - buf_ofs < BUF_SIZE ?
+            device_size - buf_ofs : BUF_SIZE;
+        nio = 0;
+    }
     while (nio > 0 && total_read < MAX_SCAN) {
         ssize_t len, m1, m2;
         --nio;
         if (lseek(in,nio*BUF_SIZE,SEEK_SET) == (off_t)-1) {
-            fprintf(stderr,"cdrverify: lseek() failed (%s)\n",strerror(errno));
-            return 1;
+            fprintf(out,"cdrverify: lseek() failed (%s)\n",strerror(errno));
+            marker_ver = -1;    // read error
+            break;
         }
         if ((len = read(in,buf,BUF_SIZE)) <= 0) {
-            fprintf(stderr,"cdrverify: read() failed (%s)\n",strerror(errno));
-            return 1;
+            fprintf(out,"cdrverify: read() failed (%s)\n",strerror(errno));
+            marker_ver = -1;    // read error
+            break;
         }
         total_read += len;
         m1 = find_marker_v1(buf, len);
@@ -84,6 +93,7 @@ int main(int argc, char*argv[]) {
         if (m2 >= 0 && m2 >= m1) {
             marker_ver = 2;
             marker_ofs = m2;
+            marker_len = len;
             break;
         }
         else if (m1 >= 0) {
@@ -96,18 +106,188 @@ int main(int argc, char*argv[]) {
     int r = 1;
     switch (marker_ver) {
     case 1:
-        printf(" found v1.\n");
-        r = verify_v1(in, buf + marker_ofs);
+        fprintf(out," found v1.\n");
+        if (opt->quick || opt->file_path)
+            fprintf(out,"note: partial check not supported for v1, full verify\n");
+        r = verify_v1(out, in, buf + marker_ofs);
         break;
     case 2:
-        printf(" found v2.\n");
-        r = verify_v2(in, buf + marker_ofs);
+        fprintf(out," found v2.\n");
+        if (opt->quick || opt->file_path) {
+            r = quick_verify_v2(in, buf + marker_ofs, marker_len - marker_ofs, opt);
+            break;
+        }
+
+        // unchanged image files need not be read again
+        struct stat s;
+        struct cache_key key;
+        const int cached = opt->cache_file && fstat(in,&s) == 0 &&
+            S_ISREG(s.st_mode);
+        if (cached) {
+            cache_key(&key, &s, buf + marker_ofs);
+            const time_t when = opt->force ? 0 :
+                cache_lookup(opt->cache_file, &key, opt->max_age);
+            if (when) {
+                char verified[32];
+                fprintf(out,"unchanged since verified on %s",
+                        ctime_r(&when,verified));
+                r = 0;
+                break;
+            }
+        }
+        else if (opt->cache_file)
+            fprintf(out,"note: not a regular file, not cached\n");
+        r = verify_v2(in, buf + marker_ofs, marker_len - marker_ofs, opt);
+        if (r == 0 && cached)
+            cache_store(opt->cache_file, &key, name);
         break;
-    default:
-        printf(" not found\n");
+    case 0:
+        fprintf(out," not found\n");
     }
 
     free(buf);
+    close(in);
     return r;
 }
 
+
+int main(int argc, char*argv[]) {
+
+    // hashing threads default to number of cores (at most 4)
+    struct verify_options opt;
+    opt.threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (opt.threads < 1)
+        opt.threads = 1;
+    if (opt.threads > 4)
+        opt.threads = 4;
+    opt.fail_fast = 0;
+    opt.buffer_bytes = 512*1024*1024;
+    opt.deep_scan = 0;
+    opt.quick = 0;
+    opt.quick_percent = 0;
+    opt.seed = time(NULL);
+    opt.hint_file = NULL;
+    opt.file_path = NULL;
+    opt.cache_file = NULL;
+    opt.force = 0;
+    opt.max_age = 0;
+    opt.latency_file = NULL;
+    opt.slow_ms = 500;
+    opt.out = stdout;
+    opt.pool = NULL;
+    opt.progress = NULL;
+
+    static const struct option long_options[] = {
+        { "file", required_argument, NULL, 'p' },
+        { NULL, 0, NULL, 0 }
+    };
+    int c;
+    while ((c = getopt_long(argc,argv,"j:fB:dq:S:H:C:FA:L:t:p:",
+                            long_options,NULL)) != -1) {
+        switch (c) {
+        case 'j':
+            opt.threads = atoi(optarg);
+            if (opt.threads < 1) {
+                fprintf(stderr,"cdrverify: invalid number of threads: %s\n",optarg);
+                return 1;
+            }
+            break;
+        case 'f':
+            opt.fail_fast = 1;
+            break;
+        case 'd':
+            opt.deep_scan = 1;
+            break;
+        case 'q': {
+            char* end;
+            opt.quick = strtoul(optarg,&end,10);
+            opt.quick_percent = *end == '%';
+            if (opt.quick < 1) {
+                fprintf(stderr,"cdrverify: invalid sample size: %s\n",optarg);
+                return 1;
+            }
+            break;
+        }
+        case 'S':
+            opt.seed = strtoull(optarg,NULL,0);
+            break;
+        case 'H':
+            opt.hint_file = optarg;
+            break;
+        case 'p':
+            opt.file_path = optarg;
+            break;
+        case 'C':
+            opt.cache_file = optarg;
+            break;
+        case 'F':
+            opt.force = 1;
+            break;
+        case 'A':
+            opt.max_age = atol(optarg) * 24*60*60;
+            break;
+        case 'L':
+            opt.latency_file = optarg;
+            break;
+        case 't':
+            opt.slow_ms = atoi(optarg);
+            break;
+        case 'B': {
+            char* end;
+            opt.buffer_bytes = strtoul(optarg,&end,10);
+            if (*end == 'k' || *end == 'K')
+                opt.buffer_bytes <<= 10;
+            else if (*end == 'm' || *end == 'M')
+                opt.buffer_bytes <<= 20;
+            else if (*end == 'g' || *end == 'G')
+                opt.buffer_bytes <<= 30;
+            break;
+        }
+        default:
+            return 1;
+        }
+    }
+
+    if (optind >= argc) {
+        printf("Usage:\n  cdrverify [-j threads] [-f] [-B size] [-L file] [-t ms] device\n"
+               "  cdrverify [-j threads] [options] device device...\n"
+               "  cdrverify -q n[%%] [-S seed] [-H file] device\n"
+               "  cdrverify -C state [-F] [-A days] device\n"
+               "  cdrverify --file path device\n"
+               "  cdrverify -d [-j threads] device\n"
+               "    -j n\thashing or reading threads (default: cores, max 4)\n"
+               "    -B size\tmemory use (default: 512M)\n"
+               "    -f  \tstop at first corrupt region\n"
+               "    -L file\twrite read latency map (CSV, or JSON if *.json)\n"
+               "    -t ms\treport regions with slower reads (default: 500)\n"
+               "    -q n\tquick check of n (or n%%) random regions, no parity\n"
+               "    -S seed\tfor quick check (default: time)\n"
+               "    -H file\tquick check these byte ranges first\n"
+               "    -p, --file path\tcheck only regions holding this file\n"
+               "    -C file\tskip images verified before (state file)\n"
+               "    -F  \tverify even if unchanged since last verify\n"
+               "    -A days\tre-verify after this many days\n"
+               "    -d  \tlist all markers on device\n");
+        return 1;
+    }
+
+    // several devices share the hashing threads
+    if (argc - optind > 1) {
+        if (opt.deep_scan || opt.latency_file) {
+            fprintf(stderr,"cdrverify: -d and -L need a single device\n");
+            return 1;
+        }
+        return verify_farm(argv + optind, argc - optind, &opt);
+    }
+
+    if (opt.deep_scan) {
+        const int in = open(argv[optind],O_RDONLY);
+        const off_t device_size = in == -1 ? -1 : lseek(in,0,SEEK_END);
+        if (device_size == (off_t)-1) {
+            fprintf(stderr,"cdrverify: failed to open device %s\n",argv[optind]);
+            return 1;
+        }
+        return deep_scan(in, device_size, &opt);
+    }
+    return verify_device(argv[optind], &opt);
+}
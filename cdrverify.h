@@ -2,11 +2,94 @@
 #define __CDRVERIFY_H
 
 #include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "marker-v2.h"
+
+#define SIG1 0xc56a5d888149eee7ULL
+#define SIG2 0x4139ef05dda34f80ULL
+#define SIG1R 0xe7ee4981885d6ac5ULL
+#define SIG2R 0x804fa3dd05ef3941ULL
 
 ssize_t find_marker_v1(const void* src, size_t len);
-int verify_v1(int in, void* marker);
+uint64_t marker_v1_block_bytes(const void* src);
+int verify_v1(FILE* out, int in, void* marker);
+
+struct hash_pool;           // hashing and xor threads, shared by devices
+struct hash_pool* pool_start(unsigned threads);
+void pool_stop(struct hash_pool* pool);
+
+struct verify_progress {
+    uint64_t bytes, total;  // read so far, to be read
+};
+
+struct verify_options {
+    int threads;            // hashing threads
+    int fail_fast;          // stop at first corrupt region
+    size_t buffer_bytes;    // memory for buffers and parity check
+    int deep_scan;          // list markers anywhere on device
+    unsigned quick;         // sample this many regions (0: full verify)
+    unsigned quick_percent; // quick is a percentage of regions
+    uint64_t seed;          // for sampling
+    const char* hint_file;  // byte ranges to sample first
+    const char* file_path;  // verify only this file in ISO9660 filesystem
+    const char* cache_file; // state file of earlier results
+    int force;              // verify even if cached
+    long max_age;           // seconds a cached result is valid (0: forever)
+    const char* latency_file; // heatmap (CSV, or JSON if *.json)
+    unsigned slow_ms;       // report reads slower than this
+    FILE* out;              // report
+    struct hash_pool* pool; // NULL: own pool of threads
+    struct verify_progress* progress;   // may be NULL
+};
+
+int verify_v2(int in, void* marker, size_t avail,
+              const struct verify_options* opt);
+
+int read_marker(FILE* out, int in, off_t ofs, void* dest, const void* block0,
+                const struct v2_marker* m, const char* name);
+int quick_verify_v2(int in, void* marker, size_t avail,
+                    const struct verify_options* opt);
+
+struct cache_key {
+    uint64_t dev, ino, size, mtime, ctime;
+    uint64_t date_time, parity_hash;    // from marker block 0
+};
+
+void cache_key(struct cache_key* key, const struct stat* s,
+               const void* marker);
+time_t cache_lookup(const char* file, const struct cache_key* key,
+                    long max_age);
+int cache_store(const char* file, const struct cache_key* key,
+                const char* name);
+
+#define LATENCY_BINS 32
+
+struct latency_row {
+    uint64_t reads, bytes, ns, max_ns;
+};
+
+struct latency_map {
+    size_t num_rows;
+    struct latency_row* rows;
+    uint64_t histogram[LATENCY_BINS];
+};
+
+void latency_init(struct latency_map* lm, off_t device_bytes);
+void latency_free(struct latency_map* lm);
+uint64_t latency_now(void);
+void latency_add(struct latency_map* lm, off_t ofs, size_t bytes,
+                 uint64_t ns);
+int latency_report(FILE* out, const struct latency_map* lm,
+                   const struct v2_marker* m,
+                   const int* bad, const int* checked,
+                   const char* file, unsigned slow_ms);
+
+int deep_scan(int in, off_t device_size, const struct verify_options* opt);
 
-ssize_t find_marker_v2(const void* src, size_t len);
-int verify_v2(int in, void* marker);
+int verify_device(const char* name, const struct verify_options* opt);
+int verify_farm(char* const* names, int n, const struct verify_options* opt);
 
 #endif
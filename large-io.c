@@ -0,0 +1,52 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+
+#include <unistd.h>
+
+#include "large-io.h"
+
+#define GB (1024*1024*1024)
+
+ssize_t read_large(int fd, void *buf, size_t count) {
+    ssize_t result = 0;
+    while (count > GB) {
+        ssize_t r = read(fd, buf, GB);
+        if (r < 0) return r;
+        result += r;
+        if (r != GB) return result;
+        buf = ((char*)buf) + GB;
+        count -= GB;
+    }
+    ssize_t r = read(fd, buf, count);
+    if (r < 0) return r;
+    return result += r;
+}
+
+ssize_t write_large(int fd, const void *buf, size_t count) {
+    ssize_t result = 0;
+    while (count > GB) {
+        ssize_t r = write(fd, buf, GB);
+        if (r < 0) return r;
+        result += r;
+        if (r != GB) return result;
+        buf = ((const char*)buf) + GB;
+        count -= GB;
+    }
+    ssize_t r = write(fd, buf, count);
+    if (r < 0) return r;
+    return result += r;
+}
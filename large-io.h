@@ -0,0 +1,20 @@
+#ifndef __LARGE_IO_H
+#define __LARGE_IO_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* read() and write() of any size, in pieces of at most 1 GiB;
+     * bytes transferred, or -1 on error */
+    ssize_t read_large(int fd, void *buf, size_t count);
+    ssize_t write_large(int fd, const void *buf, size_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,511 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <byteswap.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "marker-v2.h"
+#include "volume.h"
+
+
+/* Marker format (block zero):
+ *   uint32_t signature;       // 0x972fae43
+ *   uint16_t log2_blocksize;  // min 6, high byte is layout
+ *   uint16_t index;           // 0
+ *   uint64_t date_time;
+ *
+ *   uint32_t num_stripes;
+ *   uint32_t first_blocks;
+ *   uint32_t stripe_blocks;
+ *   uint32_t image_blocks;
+ *
+ *   uint64_t parity_hash;
+ *   uint64_t hashes[];
+ *   uint64_t checksum;
+ *
+ * Block one and later (i):
+ *   uint32_t signature;       // 0x972fae43
+ *   uint16_t log2_blocksize;
+ *   uint16_t index;           // i
+ *
+ *   uint64_t hashes[];
+ *   uint64_t checksum;
+ *
+ * For LAYOUT_XOR, hashes[] are the stripe hashes.  For other layouts,
+ * hashes[0] is the layout parameter and the remaining entries are
+ * described in spec.txt.
+ */
+
+static uint64_t div_up(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+}
+
+int verify_marker_block_hash(const void* src, size_t block_bytes) {
+    static const uint8_t zero_key[SIPHASH_KEY_LENGTH] = {0};
+    uint8_t hash[SIPHASH_DIGEST_LENGTH];
+    siphash(hash, src, block_bytes - 8, zero_key);
+    const void* expected_hash = ((char*)src) + block_bytes - 8;
+    return memcmp(hash, expected_hash, SIPHASH_DIGEST_LENGTH) == 0;
+}
+
+int verify_marker_hash(const void* src, size_t block_bytes,
+                       unsigned marker_blocks) {
+    while (marker_blocks > 0) {
+        if (!verify_marker_block_hash(src, block_bytes))
+            return 0;
+        src = ((char*)src) + block_bytes;
+        --marker_blocks;
+    }
+    return 1;
+}
+
+// marker block 0 (with good hash) at p, len bytes available
+static int marker_v2_at(const uint32_t* p, size_t len) {
+    if ((*p != SIG && *p != SIGR) || ((const uint16_t*)p)[3] != 0)
+        return 0;
+    int block_log2 = ((const uint16_t*)p)[2];
+    if (*p == SIGR)
+        block_log2 = bswap_16(block_log2);
+    // set files are found too, so parse_marker_v2 can name them
+    if ((block_log2 & 0xff) >= 30 || (block_log2 >> 8) > LAYOUT_SET)
+        return 0;
+    const size_t block_bytes = 1 << (block_log2 & 0xff);
+    return block_bytes <= len && verify_marker_block_hash(p, block_bytes);
+}
+
+// -1 if not found, offset otherwise
+ssize_t find_marker_v2(const void* src, size_t len) {
+    size_t i = len & ~(size_t)63;
+    const uint32_t* p = src;
+    p += i / 4;
+    while (i > 0) {
+        i -= 64;
+        p -= 16;
+        if (marker_v2_at(p, len - i))
+            return i;
+    }
+    return -1;
+}
+
+/* Look for the marker right after the filesystem in the image, following
+ * any further parity layers added on top, instead of scanning.  Each
+ * marker must start exactly where its image ends.  On success buf holds
+ * len bytes read at *buf_ofs, starting with the outermost marker, and 0 is
+ * returned, -1 otherwise.
+ */
+ssize_t locate_marker_v2(int fd, off_t device_size,
+                         void* buf, size_t len, off_t* buf_ofs) {
+    off_t pos = volume_bytes(fd);
+    off_t found_pos = -1;
+    ssize_t found = -1, n = 0;
+    while (pos > 0 && pos < device_size) {
+        if ((n = pread(fd,buf,len,pos)) < 64 || !marker_v2_at(buf,n))
+            break;
+        struct v2_marker m;
+        if (parse_marker_v2(NULL,&m,buf) != 0)
+            break;
+        const off_t image_end = m.image_blocks * m.block_bytes;
+        const off_t end = (m.image_blocks + 2*m.marker_blocks
+                           + m.parity_blocks) * m.block_bytes;
+        free_marker_v2(&m);
+        if (image_end != pos || end <= pos)
+            break;
+        found_pos = pos;
+        found = 0;
+        pos = end;
+    }
+    // buf was overwritten by the search for another layer
+    if (found >= 0 && pos < device_size &&
+        pread(fd,buf,len,found_pos) <= found)
+        return -1;
+    *buf_ofs = found_pos;
+    return found;
+}
+
+// files of an ISO9660 image stored in damaged items
+int print_damaged_files_v2(FILE* out, int fd, const struct v2_marker* m,
+                           const int* damaged) {
+    off_t* ranges = malloc(2 * m->num_items * sizeof(off_t));
+    size_t n = 0;
+    unsigned i;
+    for (i = 0; i < m->num_items; ++i) {
+        if (!damaged[i])
+            continue;
+        ranges[2*n] = m->items[i].offset * m->block_bytes;
+        ranges[2*n+1] = ranges[2*n] + m->items[i].blocks * m->block_bytes;
+        ++n;
+    }
+    const int r = print_damaged_files(out,fd,ranges,n);
+    free(ranges);
+    return r;
+}
+
+static void add_item(struct v2_marker* m, unsigned kind,
+                     uint64_t offset, uint64_t blocks,
+                     unsigned num, unsigned col, unsigned slot,
+                     int eq0, int eq1, uint64_t eq_offset) {
+    struct v2_item* item = &m->items[m->num_items++];
+    item->offset = offset;
+    item->blocks = blocks;
+    item->eq_offset = eq_offset;
+    item->eq[0] = eq0;
+    item->eq[1] = eq1;
+    item->kind = kind;
+    item->num = num;
+    item->col = col;
+    item->slot = slot;
+}
+
+static void build_items(struct v2_marker* m) {
+    const uint64_t sb = m->stripe_blocks;
+    const uint64_t first_offset = sb - m->first_blocks;
+    const uint64_t parity_offset = m->image_blocks + m->marker_blocks;
+    const unsigned S = m->num_stripes;
+    const unsigned G = m->num_groups;
+    const uint64_t W = m->param;   // column group width
+    const uint64_t K = m->param;   // stripes per local group
+    unsigned s, g;
+
+    switch (m->layout) {
+    case LAYOUT_XOR:
+        m->num_eqs = 1;
+        m->eq_blocks = malloc(sizeof(uint64_t));
+        m->eq_blocks[0] = sb;
+        m->items = malloc((S + 1) * sizeof(struct v2_item));
+        add_item(m, ITEM_STRIPE, 0, m->first_blocks, 0, 0, 0,
+                 0, -1, first_offset);
+        for (s = 1; s < S; ++s)
+            add_item(m, ITEM_STRIPE, m->first_blocks + (s-1)*sb, sb,
+                     s, 0, s, 0, -1, 0);
+        add_item(m, ITEM_PARITY, parity_offset, sb, 0, 0, PARITY_SLOT,
+                 0, -1, 0);
+        break;
+
+    case LAYOUT_PRODUCT:
+        // column equations 0..G-1, row equations G..G+S-1
+        m->num_eqs = G + S;
+        m->eq_blocks = malloc(m->num_eqs * sizeof(uint64_t));
+        for (g = 0; g < G; ++g)
+            m->eq_blocks[g] = (g+1)*W <= sb ? W : sb - g*W;
+        for (s = 0; s < S; ++s)
+            m->eq_blocks[G+s] = W;
+        m->items = malloc((S*G + G + S) * sizeof(struct v2_item));
+        for (s = 0; s < S; ++s) {
+            const uint64_t c0 = s == 0 ? first_offset : 0;
+            const uint64_t start = s == 0 ? 0 : m->first_blocks + (s-1)*sb;
+            for (g = 0; g < G; ++g) {
+                const uint64_t lo = g*W > c0 ? g*W : c0;
+                const uint64_t hi = (g+1)*W < sb ? (g+1)*W : sb;
+                if (hi <= lo)
+                    continue;
+                add_item(m, ITEM_TILE, start + lo - c0, hi - lo,
+                         s, g, 1 + s*G + g, g, G + s, lo - g*W);
+            }
+        }
+        for (g = 0; g < G; ++g)
+            add_item(m, ITEM_PARITY_TILE, parity_offset + g*W,
+                     m->eq_blocks[g], 0, g, 1 + S*G + g, g, -1, 0);
+        for (s = 0; s < S; ++s)
+            add_item(m, ITEM_ROW, parity_offset + sb + s*W, W,
+                     s, 0, 1 + S*G + G + s, G + s, -1, 0);
+        break;
+
+    case LAYOUT_LOCAL:
+        // local equations 0..G-1, global equation G
+        m->num_eqs = G + 1;
+        m->eq_blocks = malloc(m->num_eqs * sizeof(uint64_t));
+        for (g = 0; g <= G; ++g)
+            m->eq_blocks[g] = sb;
+        m->items = malloc((S + 1 + G) * sizeof(struct v2_item));
+        add_item(m, ITEM_STRIPE, 0, m->first_blocks, 0, 0, 1,
+                 0, -1, first_offset);
+        for (s = 1; s < S; ++s)
+            add_item(m, ITEM_STRIPE, m->first_blocks + (s-1)*sb, sb,
+                     s, s / K, 1 + s, s / K, -1, 0);
+        add_item(m, ITEM_PARITY, parity_offset, sb, 0, 0, PARITY_SLOT,
+                 G, -1, 0);
+        for (g = 0; g < G; ++g)
+            add_item(m, ITEM_LOCAL, parity_offset + sb + g*sb, sb,
+                     g, g, 1 + S + g, g, G, 0);
+        break;
+    }
+}
+
+// returns 0 if successful, errors are printed to out unless NULL
+int parse_marker_v2(FILE* out, struct v2_marker* m, const void* block0) {
+    const uint16_t* m16 = (const uint16_t*)block0;
+    const uint32_t* m32 = (const uint32_t*)block0;
+    const uint64_t* m64 = (const uint64_t*)block0;
+
+    memset(m, 0, sizeof(*m));
+    m->need_bswap = m32[0] == SIGR;
+
+    const unsigned log2_field = m->need_bswap ? bswap_16(m16[2]) : m16[2];
+    m->block_log2 = log2_field & 0xff;
+    m->layout = log2_field >> 8;
+    m->block_bytes = (uint64_t)1 << m->block_log2;
+    if (m->block_bytes < 64 || m->block_log2 >= 30) {
+        if (out)
+            fprintf(out,"INVALID BLOCK SIZE (%ld)\n",m->block_bytes);
+        return 1;
+    }
+    if (m->layout == LAYOUT_SET) {
+        if (out)
+            fprintf(out,"PARITY FILE OF AN IMAGE SET (check with cdrset -v)\n");
+        return 1;
+    }
+    if (m->layout > LAYOUT_LOCAL) {
+        if (out)
+            fprintf(out,"UNKNOWN LAYOUT (%d)\n",m->layout);
+        return 1;
+    }
+    memcpy(m->key, block0, SIPHASH_KEY_LENGTH);
+
+    m->date_time     = m->need_bswap ? bswap_64(m64[1]) : m64[1];
+    m->num_stripes   = m->need_bswap ? bswap_32(m32[4]) : m32[4];
+    m->first_blocks  = m->need_bswap ? bswap_32(m32[5]) : m32[5];
+    m->stripe_blocks = m->need_bswap ? bswap_32(m32[6]) : m32[6];
+    m->image_blocks  = m->need_bswap ? bswap_32(m32[7]) : m32[7];
+
+    if (m->first_blocks > m->stripe_blocks || m->first_blocks == 0) {
+        if (out)
+            fprintf(out,"INVALID FIRST STRIPE (%d)\n",m->first_blocks);
+        return 1;
+    }
+    if (m->stripe_blocks > m->image_blocks) {
+        if (out)
+            fprintf(out,"INVALID STRIPE SIZE (%d)\n",m->stripe_blocks);
+        return 1;
+    }
+    if (m->num_stripes == 0 ||
+        m->image_blocks != m->first_blocks +
+        (uint64_t)m->stripe_blocks*(m->num_stripes-1)) {
+        if (out)
+            fprintf(out,"INVALID NUMBER OF STRIPES (%d)\n",m->num_stripes);
+        return 1;
+    }
+
+    const uint64_t S = m->num_stripes;
+    const uint64_t sb = m->stripe_blocks;
+    uint64_t param = 0, groups = 0, slots = S, parity = sb;
+    if (m->layout != LAYOUT_XOR) {
+        param = m->need_bswap ? bswap_64(m64[5]) : m64[5];
+        if (param == 0 || param > (m->layout == LAYOUT_PRODUCT ? sb : S)) {
+            if (out)
+                fprintf(out,"INVALID LAYOUT PARAMETER (%ld)\n",param);
+            return 1;
+        }
+    }
+    switch (m->layout) {
+    case LAYOUT_PRODUCT:
+        groups = div_up(sb, param);
+        slots = 1 + S*groups + groups + S;
+        parity = sb + S*param;
+        break;
+    case LAYOUT_LOCAL:
+        groups = div_up(S, param);
+        slots = 1 + S + groups;
+        parity = sb * (1 + groups);
+        break;
+    }
+    // hash index is 16 bits
+    if (slots > 0xffff) {
+        if (out)
+            fprintf(out,"TOO MANY HASHES (%ld)\n",slots);
+        return 1;
+    }
+    m->param = param;
+    m->num_groups = groups;
+    m->num_slots = slots;
+    m->parity_blocks = parity;
+
+    // hashes per marker block
+    const uint64_t m0_lim = m->block_bytes / sizeof(uint64_t) - 6;
+    const uint64_t mi_lim = m->block_bytes / sizeof(uint64_t) - 2;
+    m->marker_blocks = 1;
+    if (slots > m0_lim)
+        m->marker_blocks += div_up(slots - m0_lim, mi_lim);
+
+    build_items(m);
+    return 0;
+}
+
+void print_marker_v2(FILE* out, const struct v2_marker* m) {
+    const time_t dt = m->date_time / (1000*1000*1000);
+    char created[32];
+    fprintf(out,"created:     %s", ctime_r(&dt,created));
+    fprintf(out,"block size:  %ld bytes\n", m->block_bytes);
+    fprintf(out,"num stripes: %d\n", m->num_stripes);
+    fprintf(out,"stripe size: %d blocks (%ld kiB)\n", m->stripe_blocks,
+           m->stripe_blocks*m->block_bytes/1024);
+    fprintf(out,"image size:  %d blocks (%ld kiB)\n", m->image_blocks,
+           m->image_blocks*m->block_bytes/1024);
+    switch (m->layout) {
+    case LAYOUT_PRODUCT:
+        fprintf(out,"layout:      product (%d column groups of %d blocks)\n",
+               m->num_groups, m->param);
+        break;
+    case LAYOUT_LOCAL:
+        fprintf(out,"layout:      local (%d groups of %d stripes)\n",
+               m->num_groups, m->param);
+        break;
+    }
+    fprintf(out,"marker size: %d blocks\n", m->marker_blocks);
+}
+
+void free_marker_v2(struct v2_marker* m) {
+    free(m->items);
+    free(m->eq_blocks);
+    m->items = 0;
+    m->eq_blocks = 0;
+}
+
+// pointer to hash in full marker
+const void* marker_v2_hash(const struct v2_marker* m, const void* marker,
+                           unsigned slot) {
+    const uint64_t* m64 = (const uint64_t*)marker;
+    if (slot == PARITY_SLOT)
+        return m64 + 4;
+    const unsigned per_block = m->block_bytes / sizeof(uint64_t);
+    const unsigned m0_lim = per_block - 6;
+    const unsigned mi_lim = per_block - 2;
+    if (slot < m0_lim)
+        return m64 + 5 + slot;
+    slot -= m0_lim;
+    return m64 + (1 + slot/mi_lim)*per_block + 1 + slot%mi_lim;
+}
+
+void item_key(const struct v2_marker* m, const struct v2_item* item,
+              uint8_t* key) {
+    // slot 0 is not a hash in the other layouts, so its index is free
+    const unsigned index = item->slot != PARITY_SLOT ? item->slot :
+        m->layout == LAYOUT_XOR ? m->num_stripes : 0;
+    memcpy(key, m->key, SIPHASH_KEY_LENGTH);
+    ((uint16_t*)key)[3] = m->need_bswap ? bswap_16(index) : index;
+}
+
+void item_hash(const struct v2_marker* m, const struct v2_item* item,
+               const void* data, uint8_t* hash) {
+    uint8_t key[SIPHASH_KEY_LENGTH];
+    item_key(m, item, key);
+    siphash(hash, data, item->blocks * m->block_bytes, key);
+}
+
+int item_hash_matches(const struct v2_marker* m, const void* marker,
+                      const struct v2_item* item, const uint8_t* hash) {
+    return memcmp(hash, marker_v2_hash(m, marker, item->slot),
+                  SIPHASH_DIGEST_LENGTH) == 0;
+}
+
+int verify_item_hash(const struct v2_marker* m, const void* marker,
+                     const struct v2_item* item, const void* data) {
+    uint8_t hash[SIPHASH_DIGEST_LENGTH];
+    item_hash(m, item, data, hash);
+    return item_hash_matches(m, marker, item, hash);
+}
+
+const char* item_name(const struct v2_marker* m, const struct v2_item* item) {
+    static __thread char name[64];     // discs may be verified in parallel
+    switch (item->kind) {
+    case ITEM_STRIPE:
+        if (m->num_stripes > 1 || m->layout != LAYOUT_XOR)
+            snprintf(name, sizeof(name), "stripe #%d", item->num+1);
+        else
+            snprintf(name, sizeof(name), "stripe");
+        break;
+    case ITEM_TILE:
+        snprintf(name, sizeof(name), "stripe #%d column group #%d",
+                 item->num+1, item->col+1);
+        break;
+    case ITEM_PARITY:
+        snprintf(name, sizeof(name), "parity");
+        break;
+    case ITEM_PARITY_TILE:
+        snprintf(name, sizeof(name), "parity column group #%d",
+                 item->col+1);
+        break;
+    case ITEM_ROW:
+        snprintf(name, sizeof(name), "row parity #%d", item->num+1);
+        break;
+    case ITEM_LOCAL:
+        snprintf(name, sizeof(name), "local parity #%d", item->num+1);
+        break;
+    default:
+        snprintf(name, sizeof(name), "item");
+    }
+    return name;
+}
+
+// name without column group (for progress)
+const char* region_name(const struct v2_marker* m, const struct v2_item* item) {
+    struct v2_item region = *item;
+    if (region.kind == ITEM_TILE)
+        region.kind = ITEM_STRIPE;
+    else if (region.kind == ITEM_PARITY_TILE)
+        region.kind = ITEM_PARITY;
+    return item_name(m, &region);
+}
+
+/* Determine an order in which bad items can be recovered: repeatedly
+ * find an equation with exactly one bad member and recover it from the
+ * others.  Returns number of items placed in order[] (and equation used
+ * in order_eq[]); if less than the number of bad items, the remainder
+ * cannot be recovered.
+ */
+size_t peel_items(const struct v2_marker* m, const int* bad,
+                  unsigned* order, int* order_eq) {
+    unsigned* count = calloc(m->num_eqs, sizeof(unsigned));
+    int* left = malloc(m->num_items * sizeof(int));
+    unsigned i, e;
+    int j;
+    for (i = 0; i < m->num_items; ++i) {
+        left[i] = bad[i];
+        if (left[i])
+            for (j = 0; j < 2; ++j)
+                if (m->items[i].eq[j] >= 0)
+                    ++count[m->items[i].eq[j]];
+    }
+
+    size_t n = 0;
+    int progress = 1;
+    while (progress) {
+        progress = 0;
+        for (e = 0; e < m->num_eqs; ++e) {
+            if (count[e] != 1)
+                continue;
+            for (i = 0; i < m->num_items; ++i)
+                if (left[i] && (m->items[i].eq[0] == (int)e ||
+                                m->items[i].eq[1] == (int)e))
+                    break;
+            order[n] = i;
+            order_eq[n] = e;
+            ++n;
+            left[i] = 0;
+            for (j = 0; j < 2; ++j)
+                if (m->items[i].eq[j] >= 0)
+                    --count[m->items[i].eq[j]];
+            progress = 1;
+        }
+    }
+
+    free(count);
+    free(left);
+    return n;
+}
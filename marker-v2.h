@@ -0,0 +1,111 @@
+#ifndef __MARKER_V2_H
+#define __MARKER_V2_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/types.h>
+
+#include "siphash24.h"
+
+#define SIG  0x972fae43u
+#define SIGR 0x43ae2f97u
+
+/* parity layouts (high byte of log2_blocksize) */
+#define LAYOUT_XOR      0   /* single parity stripe */
+#define LAYOUT_PRODUCT  1   /* plus row parity over column groups */
+#define LAYOUT_LOCAL    2   /* plus local parity per group of stripes */
+#define LAYOUT_SET      3   /* parity file of an image set (cdrset) */
+
+/* kinds of hashed regions */
+#define ITEM_STRIPE     0
+#define ITEM_TILE       1   /* part of stripe within one column group */
+#define ITEM_PARITY     2
+#define ITEM_PARITY_TILE 3
+#define ITEM_ROW        4   /* row parity of one stripe */
+#define ITEM_LOCAL      5   /* local parity of one group */
+
+/* hash slot of parity_hash field */
+#define PARITY_SLOT     (~0u)
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A region of the disc protected by its own hash.  Every item is a
+ * member of one or two parity equations (the xor of all members of an
+ * equation, each aligned at eq_offset, is zero).
+ */
+struct v2_item {
+    uint64_t offset;        // blocks from start of disc
+    uint64_t blocks;
+    uint64_t eq_offset;     // blocks
+    int eq[2];              // -1 if unused
+    unsigned kind;
+    unsigned num;           // stripe or group number
+    unsigned col;           // column group (tiles) or local group
+    unsigned slot;          // position in hash list
+};
+
+struct v2_marker {
+    int need_bswap;
+    unsigned block_log2;
+    unsigned layout;
+    uint64_t block_bytes;
+    uint64_t date_time;
+
+    unsigned num_stripes;
+    unsigned first_blocks;
+    unsigned stripe_blocks;
+    unsigned image_blocks;
+
+    unsigned param;         // column group width or stripes per group
+    unsigned num_groups;
+    unsigned num_slots;
+    unsigned marker_blocks;
+    uint64_t parity_blocks; // blocks between the two markers
+
+    uint8_t key[SIPHASH_KEY_LENGTH];
+
+    unsigned num_items;
+    struct v2_item* items;
+    unsigned num_eqs;
+    uint64_t* eq_blocks;
+};
+
+ssize_t find_marker_v2(const void* src, size_t len);
+ssize_t locate_marker_v2(int fd, off_t device_size,
+                         void* buf, size_t len, off_t* buf_ofs);
+
+int verify_marker_block_hash(const void* src, size_t block_bytes);
+int verify_marker_hash(const void* src, size_t block_bytes,
+                       unsigned marker_blocks);
+
+int parse_marker_v2(FILE* out, struct v2_marker* m, const void* block0);
+void print_marker_v2(FILE* out, const struct v2_marker* m);
+void free_marker_v2(struct v2_marker* m);
+
+const void* marker_v2_hash(const struct v2_marker* m, const void* marker,
+                           unsigned slot);
+void item_key(const struct v2_marker* m, const struct v2_item* item,
+              uint8_t* key);
+void item_hash(const struct v2_marker* m, const struct v2_item* item,
+               const void* data, uint8_t* hash);
+int item_hash_matches(const struct v2_marker* m, const void* marker,
+                      const struct v2_item* item, const uint8_t* hash);
+int verify_item_hash(const struct v2_marker* m, const void* marker,
+                     const struct v2_item* item, const void* data);
+const char* item_name(const struct v2_marker* m, const struct v2_item* item);
+const char* region_name(const struct v2_marker* m, const struct v2_item* item);
+
+int print_damaged_files_v2(FILE* out, int fd, const struct v2_marker* m,
+                           const int* damaged);
+
+size_t peel_items(const struct v2_marker* m, const int* bad,
+                  unsigned* order, int* order_eq);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -31,6 +31,25 @@ if ! ./cdrrepair test_02.tmp || ! diff -q test_01.tmp test_02.tmp; then
     exit 1
 fi
 
+# ISO9660 directory record: name lba bytes flags (2: directory)
+le32() {
+    printf '\\x%02x' $(( $1 & 255 )) $(( ($1>>8) & 255 )) \
+	$(( ($1>>16) & 255 )) $(( ($1>>24) & 255 ))
+}
+be32() {
+    printf '\\x%02x' $(( ($1>>24) & 255 )) $(( ($1>>16) & 255 )) \
+	$(( ($1>>8) & 255 )) $(( $1 & 255 ))
+}
+dir_record() {
+    local n=${#1} len=$(( 33 + ${#1} + (${#1} % 2 == 0) ))
+    [ "$1" = . ] && n=1 len=34
+    printf "%b" "\\x$(printf %02x $len)\\x00$(le32 $2)$(be32 $2)$(le32 $3)$(be32 $3)"
+    printf "%b" "\\x00\\x00\\x00\\x00\\x00\\x00\\x00\\x$(printf %02x $4)\\x00\\x00"
+    printf "%b" "\\x01\\x00\\x00\\x01\\x$(printf %02x $n)"
+    if [ "$1" = . ]; then printf "%b" "\\x00"; else printf "%s" "$1"; fi
+    [ $(( n % 2 )) = 0 ] && printf "%b" "\\x00"
+}
+
 modify_byte() {
     dd if=$1 bs=1 skip=$2 count=1 status=none \
 	|tr '\000-\377' '\100-\377\000-\077' \
@@ -81,6 +100,267 @@ if ! ./cdrrepair test_02.tmp || ! diff -q test_01.tmp test_02.tmp; then
     exit 1
 fi
 
+echo
+cat test_00.tmp >test_03.tmp
+echo cdrparity -b $BS -s 1300k -x 8 test_03.tmp
+./cdrparity -b $BS -s 1300k -x 8 test_03.tmp
+echo
+if ! ./cdrverify test_03.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+echo cdrverify -C test_03.state test_03.tmp
+if ! ./cdrverify -C test_03.state test_03.tmp >/dev/null \
+    || ! ./cdrverify -C test_03.state test_03.tmp |grep -q '^unchanged'; then
+    echo 'FAILED!'
+    exit 1
+fi
+rm test_03.state
+
+echo cdrverify -L test_03.csv test_03.tmp
+if ! ./cdrverify -L test_03.csv test_03.tmp >/dev/null \
+    || ! grep -q '^0,' test_03.csv; then
+    echo 'FAILED!'
+    exit 1
+fi
+rm test_03.csv
+
+echo cdrverify -B 16k test_03.tmp
+if ! ./cdrverify -B 16k test_03.tmp >/dev/null; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+echo
+cat test_03.tmp >test_04.tmp
+modify_byte test_04.tmp 0
+modify_byte test_04.tmp $(( $data_bytes / 2 ))
+modify_byte test_04.tmp $(( $data_bytes - 1 ))
+cat test_04.tmp >test_20.tmp
+echo cdrverify -j 2 test_03.tmp test_04.tmp
+if ./cdrverify -j 2 test_03.tmp test_04.tmp >test_04.log \
+    || ! grep -q '^1 of 2 devices good' test_04.log \
+    || ! grep -q '^test_04.tmp: FAILED' test_04.log; then
+    echo 'FAILED!'
+    exit 1
+fi
+rm test_04.log
+if ! ./cdrrepair test_04.tmp || ! diff -q test_03.tmp test_04.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+if ! ./cdrrepair test_20.tmp test_21.tmp || ! diff -q test_03.tmp test_21.tmp ||
+   cmp -s test_03.tmp test_20.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+if ! ./cdrrepair -M 0 test_20.tmp || ! diff -q test_03.tmp test_20.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+if ./cdrrepair -M -1 test_20.tmp 2>/dev/null \
+    || ./cdrrepair -M 64x test_20.tmp 2>/dev/null; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+# too much damage for parity alone on either copy, none in common
+echo cdrrepair -c test_23.tmp test_22.tmp test_21.tmp
+cat test_03.tmp >test_22.tmp
+cat test_03.tmp >test_23.tmp
+for ofs in $(seq 0 16384 $(( $data_bytes / 2 - 1 ))); do
+    modify_byte test_22.tmp $ofs
+    modify_byte test_23.tmp $(( $ofs + $data_bytes / 2 ))
+done
+if ./cdrrepair test_22.tmp test_21.tmp >/dev/null 2>&1 \
+    || ! ./cdrrepair -c test_23.tmp test_22.tmp test_21.tmp >/dev/null \
+    || ! diff -q test_03.tmp test_21.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+# reads that succeed with wrong data are caught by the hashes
+echo cdrrescue test_24.tmp test_25.tmp
+cat test_03.tmp >test_24.tmp
+modify_byte test_24.tmp 0
+modify_byte test_24.tmp $(( $data_bytes / 2 ))
+modify_byte test_24.tmp $(( $data_bytes - 1 ))
+if ! ./cdrrescue test_24.tmp test_25.tmp >/dev/null \
+    || ! diff -q test_03.tmp test_25.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+echo cdrrescue -m test_25.map test_24.tmp test_25.tmp
+rm -f test_25.map
+if ! ./cdrrescue -m test_25.map test_24.tmp test_25.tmp >/dev/null \
+    || ! ./cdrrescue -m test_25.map test_24.tmp test_25.tmp \
+        |grep -q '^note: resuming' \
+    || ! diff -q test_03.tmp test_25.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+rm test_25.map
+
+# blocks good in a ddrescue image are not read again
+echo cdrrescue -i test_03.tmp -M test_03.map test_24.tmp test_25.tmp
+printf '0x0 +\n0x0 0x%x +\n' $(( `wc -c <test_03.tmp` )) >test_03.map
+if ! ./cdrrescue -i test_03.tmp -M test_03.map test_24.tmp test_25.tmp \
+        |grep -q '^note: 0 reads' \
+    || ! diff -q test_03.tmp test_25.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+rm test_03.map
+
+echo
+cat test_00.tmp >test_05.tmp
+echo cdrparity -b $BS -s 1300k -g 4 test_05.tmp
+./cdrparity -b $BS -s 1300k -g 4 test_05.tmp
+echo
+cat test_05.tmp >test_06.tmp
+modify_byte test_06.tmp $(( $data_bytes - 1 ))
+if ./cdrverify test_06.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+echo "$(( $data_bytes - 1 )) $data_bytes" >test_06.hint
+if ! ./cdrverify -q 25% -S 1 test_05.tmp >/dev/null \
+    || ./cdrverify -q 1 -H test_06.hint test_06.tmp >/dev/null; then
+    echo 'FAILED!'
+    exit 1
+fi
+# slow rows of the -L CSV as hints (every row is slow with -t 0)
+echo cdrverify -q 1 -H test_06.csv test_06.tmp
+./cdrverify -t 0 -L test_06.csv test_06.tmp >/dev/null
+if ./cdrverify -q 1 -H test_06.csv test_06.tmp >/dev/null; then
+    echo 'FAILED!'
+    exit 1
+fi
+if ! ./cdrrepair -g 4 test_06.tmp || ! diff -q test_05.tmp test_06.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+# stripe #1 alone in group #1, stripes #17-#19 of group #4 corrupt:
+# only group #1 can be repaired with -g
+stripe_bytes=$(( 220 * $BS ))
+cat test_05.tmp >test_26.tmp
+modify_byte test_26.tmp 0
+modify_byte test_26.tmp $(( $data_bytes - 1 ))
+modify_byte test_26.tmp $(( $data_bytes - 1 - $stripe_bytes ))
+modify_byte test_26.tmp $(( $data_bytes - 1 - 2 * $stripe_bytes ))
+echo cdrverify test_26.tmp, one repairable group
+./cdrverify test_26.tmp >test_26.log
+if ! grep -q '^4 regions CORRUPT (NOT repairable)' test_26.log \
+    || ! grep -q '^local group #1 affected .*cdrrepair -g 1)' test_26.log \
+    || ! grep -q '^local group #4 affected .*too many' test_26.log \
+    || ! ./cdrrepair -g 1 test_26.tmp >/dev/null \
+    || ! cmp -s -n $stripe_bytes test_05.tmp test_26.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+rm test_26.log
+
+echo
+cat test_00.tmp >test_07.tmp
+modify_byte test_07.tmp 1000
+modify_byte test_07.tmp $(( $data_bytes - 1 ))
+cat test_05.tmp >test_08.tmp
+echo cdrparity -b $BS -u test_07.tmp test_08.tmp
+if ! ./cdrparity -b $BS -u test_07.tmp test_08.tmp || ! ./cdrverify test_08.tmp \
+    || ! cmp -s -n $data_bytes test_07.tmp test_08.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+echo
+cat test_00.tmp >test_09.tmp
+echo cdrparity -b $BS -s 1044k,1300k test_09.tmp
+./cdrparity -b $BS -s 1044k,1300k test_09.tmp
+cat test_00.tmp test_09.tmp.parity-1300k >test_10.tmp
+if ! diff -q test_00.tmp test_09.tmp || ! ./cdrverify test_10.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+cat test_00.tmp test_09.tmp.parity-1044k >test_10.tmp
+if ! ./cdrverify test_10.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+echo
+echo cdrset test_11.tmp test_00.tmp test_03.tmp test_05.tmp
+if ! ./cdrset -b $BS -H 16k test_11.tmp test_00.tmp test_03.tmp test_05.tmp \
+    || ! ./cdrset -v test_11.tmp test_00.tmp test_03.tmp test_05.tmp \
+    || ! ./cdrset -o test_12.tmp test_11.tmp test_00.tmp - test_05.tmp \
+    || ! diff -q test_03.tmp test_12.tmp \
+    || ! ./cdrverify test_11.tmp |grep -q 'cdrset -v'; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+# image size in marker #1 corrupt: sizes come from marker #2
+echo cdrset -v test_11.tmp, marker \#1 corrupt
+modify_byte test_11.tmp 43
+if ! ./cdrset -v test_11.tmp test_00.tmp test_03.tmp test_05.tmp \
+    || ! ./cdrset -o test_12.tmp test_11.tmp test_00.tmp - test_05.tmp \
+    || ! diff -q test_03.tmp test_12.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+echo
+T=1000000000000000000
+cat test_00.tmp >test_13.tmp
+cat test_00.tmp >test_14.tmp
+./cdrparity -b $BS -s 1300k -x 8 -T $T test_13.tmp
+echo cdrparity -w 1/2 / -w 2/2 / -m
+./cdrparity -b $BS -s 1300k -x 8 -T $T -w 1/2 -o test_15.tmp test_14.tmp &
+./cdrparity -b $BS -s 1300k -x 8 -T $T -w 2/2 -o test_16.tmp test_14.tmp
+wait
+if ! ./cdrparity -b $BS -m test_14.tmp test_15.tmp test_16.tmp \
+    || ! cmp test_13.tmp test_14.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+
+echo
+# ISO9660 volume of 512 sectors, followed by junk the end scan won't reach
+cat test_00.tmp >test_17.tmp
+printf '\001CD001' |dd of=test_17.tmp bs=1 seek=32768 conv=notrunc status=none
+printf '\000\002\000\000' |dd of=test_17.tmp bs=1 seek=32848 conv=notrunc status=none
+printf '\000\010' |dd of=test_17.tmp bs=1 seek=32896 conv=notrunc status=none
+dir_record . 18 2048 2 |dd of=test_17.tmp bs=1 seek=32924 conv=notrunc status=none
+( dir_record . 18 2048 2; dir_record FILE.BIN\;1 100 5000 0 ) \
+    |dd of=test_17.tmp bs=2048 seek=18 conv=notrunc status=none
+./cdrparity -b $BS -s 1300k test_17.tmp
+head -c 17000000 /dev/zero >>test_17.tmp
+echo cdrverify test_17.tmp
+if ! ./cdrverify test_17.tmp; then
+    echo 'FAILED!'
+    exit 1
+fi
+echo cdrverify --file /FILE.BIN test_17.tmp
+cat test_17.tmp >test_18.tmp
+modify_byte test_18.tmp $(( 100 * 2048 + 4999 ))
+if ! ./cdrverify --file /FILE.BIN test_17.tmp \
+    || ./cdrverify --file /FILE.BIN test_18.tmp >/dev/null; then
+    echo 'FAILED!'
+    exit 1
+fi
+cat test_18.tmp >test_19.tmp
+modify_byte test_19.tmp 0
+if ! ./cdrverify test_19.tmp |grep -q '^  /FILE.BIN: bytes 0-4999'; then
+    echo 'FAILED!'
+    exit 1
+fi
+echo cdrverify -d test_17.tmp
+if ! ./cdrverify -d -j 3 test_17.tmp |grep -q '^2 markers found'; then
+    echo 'FAILED!'
+    exit 1
+fi
+
 echo
 echo unit tests passed
-rm test_??.tmp
+rm test_??.tmp test_09.tmp.parity-* test_06.hint test_06.csv
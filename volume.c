@@ -0,0 +1,209 @@
+/* Copyright 2016 Chris Studholme.
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "volume.h"
+
+#define SECTOR 2048
+
+/* The parity marker is appended directly after the image, so the size of
+ * the filesystem in the image tells where to look for it.  ISO9660 has a
+ * primary volume descriptor at sector 16; UDF has an anchor volume
+ * descriptor pointer at sector 256 that leads to the partition descriptor.
+ * Multi-byte fields are little-endian in both.
+ */
+
+static uint32_t le32(const uint8_t* p) {
+    return p[0] | p[1]<<8 | p[2]<<16 | (uint32_t)p[3]<<24;
+}
+
+static uint16_t le16(const uint8_t* p) {
+    return p[0] | p[1]<<8;
+}
+
+static int read_sector(int fd, off_t sector, uint8_t* buf) {
+    return pread(fd,buf,SECTOR,sector*SECTOR) == SECTOR;
+}
+
+static off_t iso9660_bytes(int fd) {
+    uint8_t pvd[SECTOR];
+    if (!read_sector(fd,16,pvd) || pvd[0] != 1 ||
+        memcmp(pvd+1,"CD001",5) != 0)
+        return -1;
+    const uint32_t blocks = le32(pvd+80);    // volume space size
+    const uint16_t block_bytes = le16(pvd+128);
+    return blocks && block_bytes ? (off_t)blocks * block_bytes : -1;
+}
+
+/* Directory records (ECMA-119 9.1) do not cross logical sector
+ * boundaries; a zero length byte means the rest of the sector is unused.
+ * Names lose their ";1" version and a trailing dot.
+ */
+#define MAX_DEPTH 64
+
+static int walk_dir(int fd, uint32_t block_bytes, uint32_t extent,
+                    uint32_t bytes, char* path, size_t path_len, int depth,
+                    extent_fn fn, void* arg) {
+    if (depth > MAX_DEPTH || bytes > 64*1024*1024)
+        return 0;
+    uint8_t* dir = malloc(bytes);
+    if (!dir)
+        return 0;
+    if (pread(fd,dir,bytes,(off_t)extent * block_bytes) != (ssize_t)bytes) {
+        free(dir);
+        return 0;
+    }
+    int r = 0;
+    uint32_t i = 0;
+    while (i < bytes && r == 0) {
+        const uint8_t len = dir[i];
+        if (len == 0) {
+            i = (i / SECTOR + 1) * SECTOR;
+            continue;
+        }
+        if (len < 34 || i + len > bytes)
+            break;
+        const uint8_t* rec = dir + i;
+        i += len;
+        size_t name_len = rec[32];
+        const char* name = (const char*)rec + 33;
+        if (33 + name_len > len ||
+            (name_len == 1 && (name[0] == 0 || name[0] == 1)))
+            continue;
+        const char* semi = memchr(name,';',name_len);
+        if (semi)
+            name_len = semi - name;
+        if (name_len > 0 && name[name_len-1] == '.')
+            --name_len;
+        if (path_len + 1 + name_len >= 4096)
+            continue;
+        path[path_len] = '/';
+        memcpy(path + path_len + 1,name,name_len);
+        path[path_len + 1 + name_len] = 0;
+
+        const uint32_t child = le32(rec+2) + rec[1];
+        const uint32_t child_bytes = le32(rec+10);
+        if (rec[25] & 2) {
+            if (child != extent)
+                r = walk_dir(fd,block_bytes,child,child_bytes,path,
+                             path_len + 1 + name_len,depth + 1,fn,arg);
+        }
+        else
+            r = fn(path,(off_t)child * block_bytes,child_bytes,arg);
+        path[path_len] = 0;
+    }
+    free(dir);
+    return r;
+}
+
+int iso9660_walk(int fd, extent_fn fn, void* arg) {
+    uint8_t pvd[SECTOR];
+    if (!read_sector(fd,16,pvd) || pvd[0] != 1 ||
+        memcmp(pvd+1,"CD001",5) != 0)
+        return -1;
+    const uint16_t block_bytes = le16(pvd+128);
+    const uint8_t* root = pvd + 156;
+    if (!block_bytes)
+        return -1;
+    char path[4096] = "";
+    return walk_dir(fd,block_bytes,le32(root+2),le32(root+10),path,0,0,
+                    fn,arg);
+}
+
+struct damage {
+    FILE* out;
+    const off_t* ranges;
+    size_t n;
+    char last_path[4096];
+    off_t file_offset;      // of extent within file (multi-extent files)
+    off_t last_bytes;
+    int last_counted;
+    int files;
+};
+
+static int damaged_extent(const char* path, off_t offset, off_t bytes,
+                          void* arg) {
+    struct damage* d = arg;
+    if (strcmp(path,d->last_path) == 0)
+        d->file_offset += d->last_bytes;
+    else {
+        strcpy(d->last_path,path);
+        d->file_offset = 0;
+        d->last_counted = 0;
+    }
+    d->last_bytes = bytes;
+    size_t i;
+    for (i = 0; i < d->n; ++i) {
+        const off_t a = d->ranges[2*i] > offset ? d->ranges[2*i] : offset;
+        const off_t b = d->ranges[2*i+1] < offset + bytes ?
+            d->ranges[2*i+1] : offset + bytes;
+        if (a >= b)
+            continue;
+        if (!d->last_counted) {
+            ++d->files;
+            d->last_counted = 1;
+        }
+        fprintf(d->out,"  %s: bytes %ld-%ld\n", path,
+               (long)(d->file_offset + a - offset),
+               (long)(d->file_offset + b - offset - 1));
+    }
+    return 0;
+}
+
+int print_damaged_files(FILE* out, int fd, const off_t* ranges, size_t n) {
+    struct damage d;
+    memset(&d,0,sizeof(d));
+    d.out = out;
+    d.ranges = ranges;
+    d.n = n;
+    fprintf(out,"files in damaged regions:\n");
+    const int r = iso9660_walk(fd,damaged_extent,&d);
+    if (r < 0) {
+        fprintf(out,"  (no ISO9660 filesystem)\n");
+        return -1;
+    }
+    if (d.files == 0)
+        fprintf(out,"  (none)\n");
+    return d.files;
+}
+
+static off_t udf_bytes(int fd) {
+    uint8_t d[SECTOR];
+    if (!read_sector(fd,256,d) || le16(d) != 2)  // anchor
+        return -1;
+    const uint32_t vds_sectors = le32(d+16) / SECTOR;
+    const uint32_t vds = le32(d+20);
+    uint32_t i;
+    for (i = 0; i < vds_sectors && i < 64; ++i) {
+        if (!read_sector(fd,vds+i,d))
+            return -1;
+        if (le16(d) == 5)                        // partition descriptor
+            return ((off_t)le32(d+188) + le32(d+192)) * SECTOR;
+        if (le16(d) == 8)                        // terminator
+            break;
+    }
+    return -1;
+}
+
+off_t volume_bytes(int fd) {
+    const off_t r = iso9660_bytes(fd);
+    return r > 0 ? r : udf_bytes(fd);
+}
@@ -0,0 +1,33 @@
+#ifndef __VOLUME_H
+#define __VOLUME_H
+
+#include <stdio.h>
+#include <sys/types.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+    /* size of the filesystem recorded in the image (ISO9660 primary
+     * volume descriptor or UDF partition), -1 if not recognized */
+    off_t volume_bytes(int fd);
+
+    /* call fn for each extent of each file in the ISO9660 directory tree
+     * (path like "/DIR/FILE.TXT", offset and bytes of extent on disc)
+     * returns -1 if there is no ISO9660 filesystem, otherwise the first
+     * nonzero value returned by fn or 0 */
+    typedef int (*extent_fn)(const char* path, off_t offset, off_t bytes,
+                             void* arg);
+    int iso9660_walk(int fd, extent_fn fn, void* arg);
+
+    /* print files with extents overlapping any of n byte ranges (start,
+     * end pairs), and which of their bytes are affected
+     * returns number of files, -1 if there is no ISO9660 filesystem */
+    int print_damaged_files(FILE* out, int fd, const off_t* ranges,
+                            size_t n);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif